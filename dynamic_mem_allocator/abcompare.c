@@ -0,0 +1,158 @@
+/*
+ * abcompare - compare the throughput of two mdriver binaries
+ *
+ * Runs binA and binB with the same mdriver arguments for a number of
+ * rounds, interleaved as ABBA ABBA ... so that drift in the machine (clock
+ * frequency, other load) hits both equally, and collects the "Average
+ * throughput" of every run.  Reports the median of each and the ratio B/A
+ * with its 95% bootstrap confidence interval; the difference is
+ * significant if the interval excludes 1.
+ *
+ * usage: abcompare [-r rounds] <binA> <binB> [mdriver args]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include "fcyc.h"
+
+#define THROUGHPUT_PREFIX "Average throughput (Kops/sec) = "
+
+static void die(const char *msg, const char *name) __attribute__((noreturn));
+
+static void die(const char *msg, const char *name) {
+    fprintf(stderr, "abcompare: %s %s\n", msg, name);
+    exit(1);
+}
+
+/*
+ * run_once - run bin with args and return the throughput it reports
+ */
+static double run_once(const char *bin, char **args, int nargs) {
+    char **argv = calloc(nargs + 2, sizeof(char *));
+    char *output = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t got;
+    char *line;
+    int fds[2];
+    int status;
+    pid_t pid;
+
+    if (argv == NULL || pipe(fds) < 0)
+        die("could not run", bin);
+    argv[0] = (char *) bin;
+    memcpy(argv + 1, args, nargs * sizeof(char *));
+
+    if ((pid = fork()) < 0)
+        die("could not fork for", bin);
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execv(bin, argv);
+        perror(bin);
+        _exit(127);
+    }
+    close(fds[1]);
+    do {
+        if (cap - len < 4096) {
+            cap = cap ? 2 * cap : 65536;
+            if ((output = realloc(output, cap + 1)) == NULL)
+                die("out of memory reading", bin);
+        }
+        got = read(fds[0], output + len, cap - len);
+        if (got > 0)
+            len += got;
+    } while (got > 0);
+    close(fds[0]);
+    output[len] = '\0';
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0) {
+        fputs(output, stderr);
+        die("failed:", bin);
+    }
+
+    line = strstr(output, THROUGHPUT_PREFIX);
+    if (line == NULL) {
+        fputs(output, stderr);
+        die("reported no throughput:", bin);
+    }
+    double tput = atof(line + strlen(THROUGHPUT_PREFIX));
+    free(output);
+    free(argv);
+    return tput;
+}
+
+int main(int argc, char **argv) {
+    int rounds = 10;
+    double *a, *b;
+    double ratio, lo, hi;
+    fstats_t astats, bstats;
+    char *bins[2];
+    int c, r;
+
+    while ((c = getopt(argc, argv, "+r:h")) != EOF) {
+        switch (c) {
+        case 'r': /* Number of runs of each binary */
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] <binA> <binB> [mdriver args]\n",
+                    argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind < 2 || rounds < 2) {
+        fprintf(stderr, "usage: %s [-r rounds] <binA> <binB> [mdriver args]\n",
+                argv[0]);
+        return 1;
+    }
+    bins[0] = argv[optind];
+    bins[1] = argv[optind + 1];
+    optind += 2;
+
+    a = calloc(rounds, sizeof(double));
+    b = calloc(rounds, sizeof(double));
+    if (a == NULL || b == NULL)
+        die("out of memory for", "samples");
+    for (r = 0; r < rounds; r++) {
+        /* ABBA: alternate which binary runs first */
+        if (r % 2 == 0) {
+            a[r] = run_once(bins[0], argv + optind, argc - optind);
+            b[r] = run_once(bins[1], argv + optind, argc - optind);
+        } else {
+            b[r] = run_once(bins[1], argv + optind, argc - optind);
+            a[r] = run_once(bins[0], argv + optind, argc - optind);
+        }
+        printf("round %2d: A %8.0f  B %8.0f Kops/sec\n", r + 1, a[r], b[r]);
+        fflush(stdout);
+    }
+
+    /* fstats_compute reorders the samples, so compare them first */
+    fstats_compare(a, rounds, b, rounds, &ratio, &lo, &hi);
+    fstats_compute(a, rounds, &astats);
+    fstats_compute(b, rounds, &bstats);
+
+    printf("\n%-2s %8s %8s %8s  %-19s  %s\n",
+           "", "median", "mean", "stddev", "95% CI of median", "binary");
+    printf("%-2s %8.0f %8.0f %8.0f  [%8.0f, %8.0f]  %s\n", "A",
+           astats.median, astats.mean, astats.stddev,
+           astats.ci_lo, astats.ci_hi, bins[0]);
+    printf("%-2s %8.0f %8.0f %8.0f  [%8.0f, %8.0f]  %s\n", "B",
+           bstats.median, bstats.mean, bstats.stddev,
+           bstats.ci_lo, bstats.ci_hi, bins[1]);
+    printf("\nB/A throughput = %.3f, 95%% CI [%.3f, %.3f]: ", ratio, lo, hi);
+    if (lo > 1.0)
+        printf("B is significantly faster\n");
+    else if (hi < 1.0)
+        printf("B is significantly slower\n");
+    else
+        printf("no significant difference\n");
+
+    free(a);
+    free(b);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Binary trace format (see bintrace.h)
+ */
+
+#include <string.h>
+#include "bintrace.h"
+
+static bool write_varint(FILE *out, uint64_t value);
+
+bool bintrace_is_binary(const void *buf, size_t len) {
+    return len >= BINTRACE_MAGIC_LEN &&
+        memcmp(buf, BINTRACE_MAGIC, BINTRACE_MAGIC_LEN) == 0;
+}
+
+bool bintrace_open(const void *buf, size_t len, bintrace_header_t *header,
+                   bintrace_reader_t *reader) {
+    if (!bintrace_is_binary(buf, len))
+        return false;
+    reader->pos = (const unsigned char *) buf + BINTRACE_MAGIC_LEN;
+    reader->end = (const unsigned char *) buf + len;
+    reader->index = 0;
+    header->weight = (int) bintrace_varint(reader);
+    header->num_ids = (int) bintrace_varint(reader);
+    header->num_ops = (int) bintrace_varint(reader);
+    header->data_bytes = (size_t) bintrace_varint(reader);
+    return reader->pos < reader->end || header->num_ops == 0;
+}
+
+bool bintrace_write_header(bintrace_writer_t *writer, FILE *out,
+                           const bintrace_header_t *header) {
+    writer->out = out;
+    writer->index = 0;
+    return fwrite(BINTRACE_MAGIC, 1, BINTRACE_MAGIC_LEN, out) == BINTRACE_MAGIC_LEN &&
+        write_varint(out, (uint64_t) header->weight) &&
+        write_varint(out, (uint64_t) header->num_ids) &&
+        write_varint(out, (uint64_t) header->num_ops) &&
+        write_varint(out, (uint64_t) header->data_bytes);
+}
+
+bool bintrace_write_op(bintrace_writer_t *writer, int type, long index,
+                       size_t size) {
+    long delta = index - writer->index;
+    /* zigzag: small negative and positive deltas both get small codes */
+    uint64_t zigzag = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+    writer->index = index;
+    if (!write_varint(writer->out, (zigzag << 2) | (uint64_t) type))
+        return false;
+    return type == BINTRACE_FREE || write_varint(writer->out, (uint64_t) size);
+}
+
+/*
+ * write_varint - Writes value 7 bits at a time, lowest first
+ */
+static bool write_varint(FILE *out, uint64_t value) {
+    unsigned char buf[10];
+    int n = 0;
+    do {
+        buf[n] = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+            buf[n] |= 0x80;
+        n++;
+    } while (value != 0);
+    return fwrite(buf, 1, n, out) == (size_t) n;
+}
@@ -0,0 +1,97 @@
+/*
+ * Binary trace format
+ *
+ * A compact form of the .rep traces read by mdriver, written by rep2bin.
+ * The file starts with the 8 bytes of BINTRACE_MAGIC, followed by the
+ * header of the .rep file as varints: weight, number of ids, number of
+ * ops and peak data bytes.  Each op follows as a varint tag holding its
+ * type in the low 2 bits and, above them, the zigzag-coded difference
+ * between its id and the id of the op before it, then, for allocations
+ * and reallocations, the size as a varint.  Varints are little-endian
+ * base 128: 7 bits per byte, with the top bit set on every byte but the
+ * last.
+ *
+ * Traces mostly allocate and free ids close to the last one, so a typical
+ * op takes 2 to 4 bytes, against the 24 bytes of mdriver's traceop_t.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BINTRACE_MAGIC "MMTRACE1"
+#define BINTRACE_MAGIC_LEN 8
+
+/* Op types, in the order of mdriver's traceop_t */
+enum { BINTRACE_ALLOC, BINTRACE_FREE, BINTRACE_REALLOC };
+
+typedef struct {
+    int weight;
+    int num_ids;
+    int num_ops;
+    size_t data_bytes;
+} bintrace_header_t;
+
+/* Cursor over the ops of a binary trace held in memory */
+typedef struct {
+    const unsigned char *pos, *end;
+    long index;                 /* id of the previous op */
+} bintrace_reader_t;
+
+/* Writer of a binary trace to a stream */
+typedef struct {
+    FILE *out;
+    long index;                 /* id of the previous op */
+} bintrace_writer_t;
+
+/* Returns true if the len bytes at buf start with BINTRACE_MAGIC */
+bool bintrace_is_binary(const void *buf, size_t len);
+
+/* Reads the header of the binary trace in the len bytes at buf and sets
+   reader to its first op.  Returns false if the header is cut short */
+bool bintrace_open(const void *buf, size_t len, bintrace_header_t *header,
+                   bintrace_reader_t *reader);
+
+/* Writes the magic and header to out and sets up writer.  Returns false
+   on a write error */
+bool bintrace_write_header(bintrace_writer_t *writer, FILE *out,
+                           const bintrace_header_t *header);
+
+/* Appends one op; size is ignored for frees.  Returns false on a write
+   error */
+bool bintrace_write_op(bintrace_writer_t *writer, int type, long index,
+                       size_t size);
+
+/* Reads a varint, stopping at the end of the trace or once its 64 bits
+   are full, so that a malformed one cannot shift past them */
+static inline uint64_t bintrace_varint(bintrace_reader_t *reader)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (reader->pos < reader->end && shift < 64) {
+        unsigned char byte = *reader->pos++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+        shift += 7;
+    }
+    return value;
+}
+
+/* Decodes the next op.  Returns false at the end of the trace.  The op is
+   not checked: its type may be 3 and its id out of range */
+static inline bool bintrace_next(bintrace_reader_t *reader, int *type,
+                                 long *index, size_t *size)
+{
+    uint64_t tag, delta;
+    if (reader->pos >= reader->end)
+        return false;
+    tag = bintrace_varint(reader);
+    delta = tag >> 2;
+    *type = (int) (tag & 3);
+    reader->index += (long) (delta >> 1) ^ -(long) (delta & 1);
+    *index = reader->index;
+    *size = (*type == BINTRACE_FREE) ? 0 : (size_t) bintrace_varint(reader);
+    return true;
+}
@@ -16,9 +16,8 @@
 #include <string.h>
 #ifdef USE_TOD
 #include <sys/time.h>
-#else
-#include <time.h>
 #endif
+#include <time.h>
 #include "clock.h"
 
 int gverbose = 1;
@@ -141,3 +140,38 @@ double get_counter()
     return delta_secs * cpu_mhz * 1e6;
 }
 
+
+/* Tick counter */
+
+static double ticks_per_ns = 0.0;
+
+double counter_ticks_per_ns()
+{
+    if (ticks_per_ns == 0.0) {
+        struct timespec t0, t1;
+        uint64_t c0, c1;
+        double ns;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        c0 = read_counter();
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns = 1e9 * (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec);
+        } while (ns < 2e7);
+        c1 = read_counter();
+        ticks_per_ns = (c1 - c0) / ns;
+    }
+    return ticks_per_ns;
+}
+
+uint64_t counter_overhead()
+{
+    uint64_t best = UINT64_MAX;
+    int i;
+    for (i = 0; i < 1000; i++) {
+        uint64_t c0 = read_counter();
+        uint64_t c1 = read_counter();
+        if (c1 - c0 < best)
+            best = c1 - c0;
+    }
+    return best;
+}
@@ -1,5 +1,12 @@
 /* Routines for timing functions */
 
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
 /*  minimum resolution of timer (secs) */
 extern const double timer_resolution;
 
@@ -20,3 +27,23 @@ void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* Tick counter: cheap enough to time a single call */
+
+/* Read the time stamp counter, or a nanosecond clock where there is none */
+static inline uint64_t read_counter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Ticks of read_counter per nanosecond, measured once */
+double counter_ticks_per_ns();
+
+/* Smallest number of ticks between two back-to-back reads of the counter */
+uint64_t counter_overhead();
@@ -19,6 +19,16 @@
 #define SPARSE_MODE 0
 #endif
 
+/*
+ * Preload mode builds memlib into libmm.so, which replaces the allocator
+ * of the C library in real programs (see the Makefile).  The regions are
+ * then much larger reservations of address space, and the break of the
+ * process is left alone.
+ */
+#ifndef MM_PRELOAD
+#define MM_PRELOAD 0
+#endif
+
 /*
  * This is the default path where the driver will look for the
  * default tracefiles. You can override it at runtime with the -t flag.
@@ -115,6 +125,12 @@
 #define MAXFILL        2048
 #define MAXFILL_SPARSE 1024
 
+/*
+ * Number of blocks, besides the neighbors of each op, whose contents the
+ * expensive debug mode (-D) checks after each op
+ */
+#define EXPENSIVE_SWEEP 8
+
 /*
  * Alignment requirement in bytes (either 4, 8, or 16)
  */
@@ -122,15 +138,47 @@
 
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
- * Maximum heap size in bytes
- */
+ * Maximum heap size in bytes, per region.  The guard page build
+ * (mdriver-guard) needs at least two pages per allocation and overrides it,
+ * and libmm.so must hold the heap of any program
+ */
+#ifndef MAX_DENSE_HEAP
+#if MM_PRELOAD
+#define MAX_DENSE_HEAP (64UL<<30)  /* 64 GB of address space per region */
+#else
 #define MAX_DENSE_HEAP (100*(1<<20))  /* 100 MB */
+#endif
+#endif
 
 /*
  * Starting address of the memory allocated for the heap by mmap
  */
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
+/*
+ * Maximum number of heap regions.  Besides the main heap, one region can
+ * be created for each NUMA node that allocates memory.
+ */
+#define MAX_HEAP_REGIONS 8
+
+/*
+ * Huge page backing for the dense heap (can be changed at runtime with
+ * mdriver's -H flag):
+ *   0: default pages
+ *   1: transparent huge pages, requested with madvise(MADV_HUGEPAGE)
+ *   2: explicit MAP_HUGETLB mapping, falling back to 1 when the system
+ *      has no huge pages reserved
+ */
+#ifndef HUGE_PAGE_MODE
+#define HUGE_PAGE_MODE 0
+#endif
+
+/*
+ * Size of a huge page.  The heap start and the heap growth are aligned
+ * to this when huge pages are in use.
+ */
+#define HUGE_PAGE_SIZE (1<<21)  /* 2 MB */
+
 
 /*********** Parameters controlling sparse memory version of heap ***********/
 
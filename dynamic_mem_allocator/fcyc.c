@@ -1,5 +1,8 @@
 /* Compute time used by function f */
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <sys/times.h>
 #include <stdio.h>
 
@@ -10,17 +13,20 @@
 #define MAXSAMPLES 20
 #define EPSILON 0.01 
 #define CLEAR_CACHE 0
-#define CACHE_BYTES (1<<19)
+#define CACHE_BYTES (1<<19)     /* if the caches can't be found in sysfs */
 #define CACHE_BLOCK 32
+#define CACHE_SYSFS "/sys/devices/system/cpu/cpu0/cache"
 #define MIN_TICKS 1000
 #define MIN_REPS 8
+#define BOOTSTRAP_RESAMPLES 2000
 
 static long int kbest = K;
 static int clear_cache = CLEAR_CACHE;
 static long int maxsamples = MAXSAMPLES;
 static double epsilon = EPSILON;
-static long int cache_bytes = CACHE_BYTES;
-static long int cache_block = CACHE_BLOCK;
+static fcyc_cache_mode_t cache_mode = FCYC_CACHE_DEFAULT;
+static long int cache_bytes = 0;     /* 0 until set or found by fcyc_caches */
+static long int cache_block = 0;
 static long int min_reps = MIN_REPS;
 static long int min_ticks = MIN_TICKS;
 static double min_time = 0;
@@ -92,6 +98,80 @@ static long int has_converged()
 
 /* Code to clear cache */
 
+/* Read one value of a cache's sysfs directory into buf, or return 0 */
+static int read_cache_attr(int index, const char *attr, char *buf, int len)
+{
+    char path[256];
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), CACHE_SYSFS "/index%d/%s", index, attr);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+    ok = fgets(buf, len, f) != NULL;
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+int fcyc_caches(fcyc_cache_t caches[], int max)
+{
+    char buf[64], *end;
+    int index, n = 0;
+
+    for (index = 0; n < max; index++) {
+        fcyc_cache_t *c = &caches[n];
+        if (!read_cache_attr(index, "level", buf, sizeof(buf)))
+            break;
+        c->level = atoi(buf);
+        if (!read_cache_attr(index, "type", c->type, sizeof(c->type)))
+            break;
+        if (!read_cache_attr(index, "size", buf, sizeof(buf)))
+            break;
+        c->bytes = strtol(buf, &end, 10);
+        if (*end == 'K')
+            c->bytes <<= 10;
+        else if (*end == 'M')
+            c->bytes <<= 20;
+        c->line = read_cache_attr(index, "coherency_line_size", buf, sizeof(buf))
+            ? atol(buf) : CACHE_BLOCK;
+        n++;
+    }
+    return n;
+}
+
+/* Size the buffer that clear() reads from the caches in sysfs, unless
+   set_fcyc_cache_size or set_fcyc_cache_block have fixed them */
+static void init_cache_params()
+{
+    fcyc_cache_t caches[16];
+    long int largest = 0, line = 0;
+    int i, n;
+
+    if (cache_bytes > 0 && cache_block > 0)
+        return;
+    n = fcyc_caches(caches, 16);
+    for (i = 0; i < n; i++) {
+        if (strcmp(caches[i].type, "Instruction") == 0)
+            continue;
+        if (caches[i].bytes > largest)
+            largest = caches[i].bytes;
+        if (caches[i].line > line)
+            line = caches[i].line;
+    }
+    /* Twice the last level, so that it is flushed even if it is not
+       strictly LRU or does not include the levels above it */
+    if (cache_bytes <= 0)
+        cache_bytes = largest > 0 ? 2 * largest : CACHE_BYTES;
+    if (cache_block <= 0)
+        cache_block = line > 0 ? line : CACHE_BLOCK;
+}
+
+long int fcyc_clear_bytes()
+{
+    init_cache_params();
+    return cache_bytes;
+}
 
 static volatile long int sink = 0;
 
@@ -99,13 +179,17 @@ static void clear()
 {
     long int x = sink;
     long int *cptr, *cend;
-    long int incr = cache_block/sizeof(long int);
+    long int incr;
+    init_cache_params();
+    incr = cache_block/sizeof(long int);
     if (!cache_buf) {
         cache_buf = malloc(cache_bytes);
         if (!cache_buf) {
             fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
             exit(1);
         }
+        /* Fresh pages all map the shared zero page until written */
+        memset(cache_buf, 1, cache_bytes);
     }
     cptr = (long int *) cache_buf;
     cend = cptr + cache_bytes/sizeof(long int);
@@ -116,87 +200,205 @@ static void clear()
     sink = x;
 }
 
-double fcyc(test_funct f, void *args)
+/* Time reps calls of f in the state of the caches set by cache_mode,
+   in cycles if cycles is set, else in seconds */
+static double time_reps(test_funct f, void *args, long reps, int cycles)
 {
-    double result;
-    long reps = min_reps;
+    double total = 0.0;
     long r;
-    double cyc;
-    /* Increase reps until get meaningful times */
-    double sec = 0.0;
-    init_min_time();
-    while (sec < min_time) {
-        if (clear_cache)
-            clear();
-        start_timer();
+
+    if (cache_mode == FCYC_CACHE_COLD) {
+        /* Flush before every call, and time only the calls */
         for (r = 0; r < reps; r++) {
-            f(args);
+            clear();
+            if (cycles) {
+                start_counter();
+                f(args);
+                total += get_counter();
+            } else {
+                start_timer();
+                f(args);
+                total += get_timer();
+            }
         }
-        sec = get_timer();
-        if (sec < min_time)
-            reps += reps;
+        return total;
     }
-    init_sampler();
-    do {
-        if (clear_cache)
-            clear();
+    if (cache_mode == FCYC_CACHE_WARM)
+        f(args);
+    else if (clear_cache)
+        clear();
+    if (cycles) {
         start_counter();
-        for (r = 0; r < reps; r++) {
+        for (r = 0; r < reps; r++)
             f(args);
-        }
-        cyc = (double) get_counter() / reps;
-        if (cyc > 0.0)
-            add_sample(cyc);
-    } while (!has_converged() && samplecount < maxsamples);
-    result = values[0];
-#if !KEEP_VALS
-    free(values); 
-    values = NULL;
-#endif
-    return result;  
+        return get_counter();
+    }
+    start_timer();
+    for (r = 0; r < reps; r++)
+        f(args);
+    return get_timer();
 }
 
-double fsec(test_funct f, void *args)
+/* Find the number of reps of f that take at least min_time */
+static long calibrate_reps(test_funct f, void *args)
 {
-    double result;
-    /* Increase reps until get meaningful times */
     long reps = min_reps;
-    long r;
     double sec = 0.0;
     init_min_time();
     while (sec < min_time) {
-        if (clear_cache)
-            clear();
-        start_timer();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        sec = get_timer();
+        sec = time_reps(f, args, reps, 0);
         if (sec < min_time)
             reps += reps;
-        //        printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
     }
+    return reps;
+}
+
+/* Sample f until the K best samples converge, in cycles or seconds */
+static double kbest_sample(test_funct f, void *args, int cycles)
+{
+    double result, val;
+    long reps = calibrate_reps(f, args);
+
     init_sampler();
-    //    printf("\nuSecs (reps=%ld):", reps);
     do {
-        if (clear_cache)
-            clear();
-        start_timer();
-        for (r = 0; r < reps; r++) {
-            f(args);
-        }
-        sec = get_timer()/reps;
-        //        printf(" %.3f", sec * 1e6);
-        if (sec > 0.0)
-            add_sample(sec);
+        val = time_reps(f, args, reps, cycles) / reps;
+        if (val > 0.0)
+            add_sample(val);
     } while (!has_converged() && samplecount < maxsamples);
     result = values[0];
-    //    printf(" --> %.3f\n", result * 1e6);
 #if !KEEP_VALS
-    free(values); 
+    free(values);
     values = NULL;
 #endif
-    return result;  
+    return result;
+}
+
+double fcyc(test_funct f, void *args)
+{
+    return kbest_sample(f, args, 1);
+}
+
+double fsec(test_funct f, void *args)
+{
+    return kbest_sample(f, args, 0);
+}
+
+double fsec_stats(test_funct f, void *args, int n, fstats_t *stats)
+{
+    double *samples = calloc(n, sizeof(double));
+    long reps;
+    int i;
+
+    if (!samples) {
+        fprintf(stderr, "Fatal error.  Calloc returned null in fsec_stats\n");
+        exit(1);
+    }
+    reps = calibrate_reps(f, args);
+    for (i = 0; i < n; i++)
+        samples[i] = time_reps(f, args, reps, 0) / reps;
+    fstats_compute(samples, n, stats);
+    free(samples);
+    return stats->median;
+}
+
+/*
+ * Bootstrap: resample with replacement from a fixed-seed xorshift
+ * generator, so that the same samples always give the same interval
+ */
+static uint64_t rng_state;
+
+static long int random_index(long int n)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (long int) (rng_state % (uint64_t) n);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Median of n samples, sorting them */
+static double median(double *samples, int n)
+{
+    qsort(samples, n, sizeof(double), compare_doubles);
+    return (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2;
+}
+
+/* Median of a resample of the n samples into buf */
+static double resample_median(const double *samples, int n, double *buf)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        buf[i] = samples[random_index(n)];
+    return median(buf, n);
+}
+
+/* Set [*lo, *hi] to the central 95% of the n values, sorting them */
+static void central_interval(double *values, int n, double *lo, double *hi)
+{
+    qsort(values, n, sizeof(double), compare_doubles);
+    *lo = values[(int) (0.025 * n)];
+    *hi = values[(int) (0.975 * n)];
+}
+
+void fstats_compute(double *samples, int n, fstats_t *stats)
+{
+    double *buf, *medians;
+    double sum = 0, sumsq = 0;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->n = n;
+    if (n == 0)
+        return;
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    stats->mean = sum / n;
+    for (i = 0; i < n; i++)
+        sumsq += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+    stats->stddev = (n > 1) ? sqrt(sumsq / (n - 1)) : 0;
+
+    buf = calloc(n, sizeof(double));
+    medians = calloc(BOOTSTRAP_RESAMPLES, sizeof(double));
+    if (!buf || !medians) {
+        fprintf(stderr, "Fatal error.  Calloc returned null in fstats_compute\n");
+        exit(1);
+    }
+    rng_state = 0x9e3779b97f4a7c15;
+    for (i = 0; i < BOOTSTRAP_RESAMPLES; i++)
+        medians[i] = resample_median(samples, n, buf);
+    central_interval(medians, BOOTSTRAP_RESAMPLES, &stats->ci_lo, &stats->ci_hi);
+    stats->median = median(samples, n);
+    free(buf);
+    free(medians);
+}
+
+void fstats_compare(const double *a, int na, const double *b, int nb,
+                    double *ratio, double *lo, double *hi)
+{
+    double *abuf = calloc(na, sizeof(double));
+    double *bbuf = calloc(nb, sizeof(double));
+    double *ratios = calloc(BOOTSTRAP_RESAMPLES, sizeof(double));
+    int i;
+
+    if (!abuf || !bbuf || !ratios) {
+        fprintf(stderr, "Fatal error.  Calloc returned null in fstats_compare\n");
+        exit(1);
+    }
+    rng_state = 0x9e3779b97f4a7c15;
+    for (i = 0; i < BOOTSTRAP_RESAMPLES; i++)
+        ratios[i] = resample_median(b, nb, bbuf) / resample_median(a, na, abuf);
+    central_interval(ratios, BOOTSTRAP_RESAMPLES, lo, hi);
+    memcpy(abuf, a, na * sizeof(double));
+    memcpy(bbuf, b, nb * sizeof(double));
+    *ratio = median(bbuf, nb) / median(abuf, na);
+    free(abuf);
+    free(bbuf);
+    free(ratios);
 }
 
 
@@ -222,8 +424,16 @@ void set_fcyc_clear_cache(int clear)
     clear_cache = clear;
 }
 
+/* Set the state of the caches in which functions are measured
+   Default = FCYC_CACHE_DEFAULT
+*/
+void set_fcyc_cache_mode(fcyc_cache_mode_t mode)
+{
+    cache_mode = mode;
+}
+
 /* Set size of cache to use when clearing cache 
-   Default = 1<<19 (512KB)
+   Default = 0 (twice the largest cache in sysfs, else 512KB)
 */
 void set_fcyc_cache_size(long int bytes)
 {
@@ -237,7 +447,7 @@ void set_fcyc_cache_size(long int bytes)
 }
 
 /* Set size of cache block 
-   Default = 32
+   Default = 0 (the line size in sysfs, else 32)
 */
 void set_fcyc_cache_block(long int bytes) {
     cache_block = bytes;
@@ -14,6 +14,44 @@ double fcyc(test_funct f, void* args);
 /* Compute number of cycles used by function f on given set of parameters */
 double fsec(test_funct f, void* args);
 
+/* Distribution of a set of timing samples */
+typedef struct {
+    int n;              /* number of samples */
+    double median;
+    double mean;
+    double stddev;
+    double ci_lo;       /* 95% bootstrap confidence interval of the median */
+    double ci_hi;
+} fstats_t;
+
+/* Compute seconds used by f like fsec, but take exactly n samples instead
+   of stopping at K-best convergence, and summarize them in stats.
+   Returns the median */
+double fsec_stats(test_funct f, void *args, int n, fstats_t *stats);
+
+/* Summarize n samples (reordering them) */
+void fstats_compute(double *samples, int n, fstats_t *stats);
+
+/* Compare two sets of samples: sets *ratio to median(b) / median(a) and
+   [*lo, *hi] to its 95% bootstrap confidence interval.  The difference
+   is significant if the interval excludes 1 */
+void fstats_compare(const double *a, int na, const double *b, int nb,
+                    double *ratio, double *lo, double *hi);
+
+/* A cache of the CPU, as described in sysfs */
+typedef struct {
+    int level;
+    char type[16];      /* "Data", "Instruction" or "Unified" */
+    long int bytes;
+    long int line;      /* line size in bytes */
+} fcyc_cache_t;
+
+/* Fill in up to max caches from sysfs and return how many were found */
+int fcyc_caches(fcyc_cache_t caches[], int max);
+
+/* Number of bytes read to clear the cache */
+long int fcyc_clear_bytes();
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -28,13 +66,25 @@ void set_fcyc_min_reps(int r);
 */
 void set_fcyc_clear_cache(int clear);
 
+/* State of the caches in which functions are measured:
+   DEFAULT - as left by the previous sample (cleared if clear_cache is set)
+   WARM    - after an untimed call of the function
+   COLD    - cleared before every call, timing only the calls
+*/
+typedef enum { FCYC_CACHE_DEFAULT, FCYC_CACHE_WARM, FCYC_CACHE_COLD } fcyc_cache_mode_t;
+
+/* Set the state of the caches in which functions are measured
+   Default = FCYC_CACHE_DEFAULT
+*/
+void set_fcyc_cache_mode(fcyc_cache_mode_t mode);
+
 /* Set size of cache to use when clearing cache 
-   Default = 1<<19 (512KB)
+   Default = 0 (twice the largest cache in sysfs, else 512KB)
 */
 void set_fcyc_cache_size(long int bytes);
 
 /* Set size of cache block 
-   Default = 32
+   Default = 0 (the line size in sysfs, else 32)
 */
 void set_fcyc_cache_block(long int bytes);
 
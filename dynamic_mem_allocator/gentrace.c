@@ -0,0 +1,399 @@
+/*
+ * gentrace - generate a synthetic .rep trace from a parameterized model
+ *
+ * The trace is a sequence of phases.  Each -n option ends a phase of that
+ * many ops, generated with the options given so far, so that
+ *
+ *     gentrace -d fixed:64 -n 10000 -d power:16:65536:1.2 -r 0.1 -n 50000
+ *
+ * allocates 64-byte blocks for 10000 ops, then switches to power-law sizes
+ * with reallocs.  Within a phase, each op is:
+ *
+ *  - a free of the live block whose lifetime (in ops, drawn from -l when
+ *    it was allocated) has run out, if any;
+ *  - otherwise, with probability -r, a realloc of a random live block,
+ *    grown by -g;
+ *  - otherwise an allocation with a size drawn from -d.
+ *
+ * Blocks die early, soonest-expiring first, to keep the live bytes within
+ * -p.  The remaining blocks are freed at the end unless -k is given.  The
+ * same seed always gives the same trace.
+ *
+ * Distributions (for sizes in bytes and lifetimes in ops):
+ *     fixed:N             always N
+ *     uniform:MIN:MAX     uniform in [MIN, MAX]
+ *     power:MIN:MAX:A     power law with density ~ x^-A on [MIN, MAX]
+ *     bimodal:X:Y:P       X with probability P, else Y
+ *     exp:MEAN            exponential with mean MEAN
+ *
+ * usage: gentrace [-s seed] [-w weight] [-d sizes] [-l lifetimes]
+ *                 [-p peak] [-r prob] [-g growth] [-n ops]... [-k] [-o out.rep]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <getopt.h>
+
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_POWER, DIST_BIMODAL, DIST_EXP } dist_kind_t;
+
+typedef struct {
+    dist_kind_t kind;
+    double a, b, c;     /* parameters, in the order of the spec */
+} dist_t;
+
+/* Realloc growth: new size = old * factor + delta */
+typedef struct {
+    double factor;
+    long delta;
+} growth_t;
+
+/* One op of the trace */
+typedef struct {
+    char type;          /* 'a', 'r' or 'f' */
+    int id;
+    size_t size;
+} op_t;
+
+/* A live block, in the heap ordered by death */
+typedef struct {
+    long death;         /* op at which the block is freed */
+    int id;
+} live_t;
+
+static uint64_t rng_state;
+
+/* Output ops, buffered because the header counts come first */
+static op_t *ops;
+static long num_ops, max_ops;
+
+/* Live blocks: a min-heap on death, and the sizes by id */
+static live_t *heap;
+static int heap_len;
+static size_t *sizes;
+static int num_ids, max_ids;
+static size_t live_bytes, peak_bytes;
+
+static void die(const char *msg, const char *name) __attribute__((noreturn));
+
+static void die(const char *msg, const char *name) {
+    fprintf(stderr, "gentrace: %s %s\n", msg, name);
+    exit(1);
+}
+
+/*
+ * random_double - uniform in [0, 1), from xorshift64*
+ */
+static double random_double(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * dist_parse - parse a distribution spec, as described at the top
+ */
+static dist_t dist_parse(const char *spec) {
+    dist_t dist = {DIST_FIXED, 0, 0, 0};
+    int n = 0;
+
+    if (sscanf(spec, "fixed:%lf%n", &dist.a, &n) == 1 && spec[n] == '\0') {
+        dist.kind = DIST_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf%n", &dist.a, &dist.b, &n) == 2
+               && spec[n] == '\0' && dist.a <= dist.b) {
+        dist.kind = DIST_UNIFORM;
+    } else if (sscanf(spec, "power:%lf:%lf:%lf%n", &dist.a, &dist.b, &dist.c, &n) == 3
+               && spec[n] == '\0' && 0 < dist.a && dist.a <= dist.b) {
+        dist.kind = DIST_POWER;
+    } else if (sscanf(spec, "bimodal:%lf:%lf:%lf%n", &dist.a, &dist.b, &dist.c, &n) == 3
+               && spec[n] == '\0' && 0 <= dist.c && dist.c <= 1) {
+        dist.kind = DIST_BIMODAL;
+    } else if (sscanf(spec, "exp:%lf%n", &dist.a, &n) == 1 && spec[n] == '\0'
+               && dist.a > 0) {
+        dist.kind = DIST_EXP;
+    } else {
+        die("bad distribution", spec);
+    }
+    return dist;
+}
+
+/*
+ * dist_sample - draw from dist, rounded to a positive integer
+ */
+static long dist_sample(const dist_t *dist) {
+    double u = random_double(), x;
+
+    switch (dist->kind) {
+    case DIST_FIXED:
+        x = dist->a;
+        break;
+    case DIST_UNIFORM:
+        x = dist->a + floor(u * (dist->b - dist->a + 1));
+        break;
+    case DIST_POWER:
+        /* Inverse of the CDF of x^-c on [a, b] */
+        if (fabs(dist->c - 1.0) < 1e-9) {
+            x = dist->a * pow(dist->b / dist->a, u);
+        } else {
+            double e = 1.0 - dist->c;
+            double lo = pow(dist->a, e), hi = pow(dist->b, e);
+            x = pow(lo + u * (hi - lo), 1.0 / e);
+        }
+        break;
+    case DIST_BIMODAL:
+        x = (u < dist->c) ? dist->a : dist->b;
+        break;
+    case DIST_EXP:
+        x = -dist->a * log(1.0 - u);
+        break;
+    default:
+        x = 1;
+    }
+    return x < 1 ? 1 : (long) x;
+}
+
+/*
+ * growth_parse - parse a realloc growth, xF (times F) or +N (plus N bytes)
+ */
+static growth_t growth_parse(const char *spec) {
+    growth_t growth = {1.0, 0};
+    char *end;
+
+    if (spec[0] == 'x') {
+        growth.factor = strtod(spec + 1, &end);
+        if (growth.factor <= 0)
+            die("bad growth", spec);
+    } else if (spec[0] == '+' || spec[0] == '-') {
+        growth.delta = strtol(spec, &end, 10);
+    } else {
+        die("bad growth", spec);
+    }
+    if (end == spec + 1 || *end != '\0')
+        die("bad growth", spec);
+    return growth;
+}
+
+static void emit(char type, int id, size_t size) {
+    if (num_ops == max_ops) {
+        max_ops = max_ops ? 2 * max_ops : 65536;
+        if ((ops = realloc(ops, max_ops * sizeof(op_t))) == NULL)
+            die("out of memory for", "ops");
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+/*
+ * Min-heap on death
+ */
+static void heap_sift_up(int i) {
+    live_t entry = heap[i];
+    while (i > 0 && heap[(i - 1) / 2].death > entry.death) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+static void heap_sift_down(int i) {
+    live_t entry = heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap_len)
+            break;
+        if (child + 1 < heap_len && heap[child + 1].death < heap[child].death)
+            child++;
+        if (heap[child].death >= entry.death)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+/*
+ * allocate - allocate a new block of size bytes, dying after lifetime ops
+ */
+static void allocate(size_t size, long lifetime) {
+    live_t entry;
+
+    if (num_ids == max_ids) {
+        max_ids = max_ids ? 2 * max_ids : 65536;
+        sizes = realloc(sizes, max_ids * sizeof(size_t));
+        heap = realloc(heap, max_ids * sizeof(live_t));
+        if (sizes == NULL || heap == NULL)
+            die("out of memory for", "blocks");
+    }
+    emit('a', num_ids, size);
+    sizes[num_ids] = size;
+    entry.death = num_ops + lifetime;
+    entry.id = num_ids++;
+    heap[heap_len++] = entry;
+    heap_sift_up(heap_len - 1);
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+/*
+ * free_first - free the live block that dies first
+ */
+static void free_first(void) {
+    int id = heap[0].id;
+
+    emit('f', id, 0);
+    live_bytes -= sizes[id];
+    if (--heap_len > 0) {
+        heap[0] = heap[heap_len];
+        heap_sift_down(0);
+    }
+}
+
+/*
+ * reallocate - resize the live block in heap slot i by growth, within peak
+ */
+static void reallocate(int i, const growth_t *growth, size_t peak) {
+    int id = heap[i].id;
+    double grown = sizes[id] * growth->factor + growth->delta;
+    size_t size = grown < 1 ? 1 : (size_t) grown;
+
+    /* Make room by freeing other blocks, then cap the block itself */
+    while (peak > 0 && live_bytes - sizes[id] + size > peak && heap_len > 1
+           && heap[0].id != id)
+        free_first();
+    if (peak > 0 && live_bytes - sizes[id] + size > peak)
+        size = (live_bytes - sizes[id] < peak) ? peak - (live_bytes - sizes[id]) : 1;
+
+    emit('r', id, size);
+    live_bytes = live_bytes - sizes[id] + size;
+    sizes[id] = size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+/*
+ * run_phase - generate n ops with the given model
+ */
+static void run_phase(long n, const dist_t *size_dist, const dist_t *life_dist,
+                      double realloc_prob, const growth_t *growth, size_t peak) {
+    long end = num_ops + n;
+
+    while (num_ops < end) {
+        if (heap_len > 0 && heap[0].death <= num_ops) {
+            free_first();
+        } else if (heap_len > 0 && random_double() < realloc_prob) {
+            reallocate((int) (random_double() * heap_len), growth, peak);
+        } else {
+            size_t size = dist_sample(size_dist);
+            if (peak > 0 && size > peak)
+                size = peak;
+            while (peak > 0 && live_bytes + size > peak && num_ops < end)
+                free_first();
+            if (num_ops < end)
+                allocate(size, dist_sample(life_dist));
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s seed] [-w weight] [-d sizes] [-l lifetimes]\n"
+            "       [-p peak] [-r prob] [-g growth] [-n ops]... [-k] [-o out.rep]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-s <n>     Seed of the generator (default 1).\n");
+    fprintf(stderr, "\t-w <n>     Weight in the trace header (default 1).\n");
+    fprintf(stderr, "\t-d <dist>  Sizes in bytes (default power:16:4096:1.5).\n");
+    fprintf(stderr, "\t-l <dist>  Lifetimes in ops (default exp:1000).\n");
+    fprintf(stderr, "\t-p <n>     Keep at most n live bytes (default unlimited).\n");
+    fprintf(stderr, "\t-r <p>     Realloc a live block with probability p (default 0).\n");
+    fprintf(stderr, "\t-g <g>     Realloc growth: xF times F, +N or -N bytes (default x1.5).\n");
+    fprintf(stderr, "\t-n <n>     End a phase of n ops (default one phase of 10000).\n");
+    fprintf(stderr, "\t-k         Keep the blocks live at the end instead of freeing them.\n");
+    fprintf(stderr, "\t-o <file>  Write the trace to file (default stdout).\n");
+    fprintf(stderr, "Distributions: fixed:N uniform:MIN:MAX power:MIN:MAX:A "
+            "bimodal:X:Y:P exp:MEAN\n");
+}
+
+int main(int argc, char **argv) {
+    dist_t size_dist = dist_parse("power:16:4096:1.5");
+    dist_t life_dist = dist_parse("exp:1000");
+    growth_t growth = growth_parse("x1.5");
+    double realloc_prob = 0;
+    size_t peak = 0;
+    int weight = 1;
+    bool keep = false, ran = false;
+    const char *outname = NULL;
+    FILE *out = stdout;
+    long i;
+    int c;
+
+    rng_state = 1;
+    while ((c = getopt(argc, argv, "s:w:d:l:p:r:g:n:ko:h")) != EOF) {
+        switch (c) {
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            break;
+        case 'd':
+            size_dist = dist_parse(optarg);
+            break;
+        case 'l':
+            life_dist = dist_parse(optarg);
+            break;
+        case 'p':
+            peak = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            realloc_prob = atof(optarg);
+            break;
+        case 'g':
+            growth = growth_parse(optarg);
+            break;
+        case 'n':
+            run_phase(atol(optarg), &size_dist, &life_dist, realloc_prob,
+                      &growth, peak);
+            ran = true;
+            break;
+        case 'k':
+            keep = true;
+            break;
+        case 'o':
+            outname = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!ran)
+        run_phase(10000, &size_dist, &life_dist, realloc_prob, &growth, peak);
+    while (!keep && heap_len > 0)
+        free_first();
+
+    if (outname != NULL && (out = fopen(outname, "w")) == NULL)
+        die("could not create", outname);
+    fprintf(out, "%d\n%d\n%ld\n%zu\n", weight, num_ids, num_ops, peak_bytes);
+    for (i = 0; i < num_ops; i++) {
+        if (ops[i].type == 'f')
+            fprintf(out, "f %d\n", ops[i].id);
+        else
+            fprintf(out, "%c %d %zu\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    if (fclose(out) != 0)
+        die("could not write", outname ? outname : "stdout");
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Log-bucketed histograms of latencies (see hist.h)
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "hist.h"
+
+static int bucket_of(uint64_t value);
+static uint64_t bucket_max(int bucket);
+
+void hist_reset(hist_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+void hist_add(hist_t *hist, uint64_t value) {
+    hist->buckets[bucket_of(value)]++;
+    hist->count++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+uint64_t hist_percentile(const hist_t *hist, double p) {
+    uint64_t rank, seen = 0;
+    int i;
+    if (hist->count == 0)
+        return 0;
+    /* rank of the value sought, counting from 1 */
+    rank = (uint64_t) (p * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    return (bucket_max(i) < hist->max) ? bucket_max(i) : hist->max;
+}
+
+/*
+ * bucket_of - values below 16 are their own bucket; otherwise the bucket
+ *     is given by the position of the top bit and the 3 bits below it.
+ */
+static int bucket_of(uint64_t value) {
+    int top;
+    if (value < 16)
+        return (int) value;
+    top = 63 - __builtin_clzll(value);
+    return 16 + (top - 4) * HIST_SUB_BUCKETS
+        + (int) ((value >> (top - 3)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/*
+ * bucket_max - largest value that falls in the bucket
+ */
+static uint64_t bucket_max(int bucket) {
+    int top, sub;
+    uint64_t lo;
+    if (bucket < 16)
+        return (uint64_t) bucket;
+    top = 4 + (bucket - 16) / HIST_SUB_BUCKETS;
+    sub = (bucket - 16) % HIST_SUB_BUCKETS;
+    lo = (uint64_t) (HIST_SUB_BUCKETS + sub) << (top - 3);
+    return lo + ((uint64_t) 1 << (top - 3)) - 1;
+}
@@ -0,0 +1,28 @@
+/*
+ * Log-bucketed histograms of latencies
+ *
+ * Values below 16 have a bucket each; above that, every power of two is
+ * split into 8 buckets, so a percentile read back from the histogram is
+ * at most 12.5% above the true value.  The maximum is kept exactly.
+ */
+
+#include <stdint.h>
+
+#define HIST_SUB_BUCKETS 8
+#define HIST_BUCKETS (16 + (64 - 4) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;                  /* number of values added */
+    uint64_t max;                    /* largest value added */
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/* Empty the histogram */
+void hist_reset(hist_t *hist);
+
+/* Add one value */
+void hist_add(hist_t *hist, uint64_t value);
+
+/* Upper bound of the smallest bucket holding the fraction p of the values,
+   e.g. p = 0.99 for the 99th percentile.  Returns 0 if empty */
+uint64_t hist_percentile(const hist_t *hist, double p);
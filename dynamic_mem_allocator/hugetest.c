@@ -0,0 +1,102 @@
+/*
+ * hugetest - check that the allocation functions refuse sizes so large
+ *            that the block size would wrap around, as they must when
+ *            libmm.so is the system allocator
+ *
+ * usage: LD_PRELOAD=./libmm.so ./hugetest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+
+/* Sizes pass through here so that gcc cannot fold the calls away */
+static volatile size_t huge_sizes[] = {
+    SIZE_MAX, SIZE_MAX - 1, SIZE_MAX - 8, SIZE_MAX - 15, SIZE_MAX - 16,
+    SIZE_MAX - 23, SIZE_MAX - 24, SIZE_MAX - 4096, SIZE_MAX / 2 + 1,
+    (size_t)PTRDIFF_MAX + 1
+};
+
+static int failures = 0;
+
+/* expect - p must be NULL with errno ENOMEM; p is freed otherwise */
+static void expect(const char *call, size_t size, void *p) {
+    if (p != NULL || errno != ENOMEM) {
+        fprintf(stderr, "hugetest: %s(%#zx) returned %p, errno %d\n",
+                call, size, p, errno);
+        failures++;
+        free(p);
+    }
+}
+
+int main(void) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t n = sizeof(huge_sizes) / sizeof(huge_sizes[0]);
+    char *live, *p;
+    int error;
+
+    /* A live block, which a wrapped size would be handed out on top of */
+    if ((live = malloc(64)) == NULL) {
+        fprintf(stderr, "hugetest: malloc(64) failed\n");
+        return 1;
+    }
+    memset(live, 0x5a, 64);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t size = huge_sizes[i];
+
+        errno = 0;
+        expect("malloc", size, malloc(size));
+        errno = 0;
+        expect("calloc", size, calloc(1, size));
+        errno = 0;
+        expect("realloc(NULL)", size, realloc(NULL, size));
+        errno = 0;
+        if ((p = malloc(16)) == NULL) {
+            fprintf(stderr, "hugetest: malloc(16) failed\n");
+            return 1;
+        }
+        if (realloc(p, size) != NULL || errno != ENOMEM) {
+            fprintf(stderr, "hugetest: realloc(%#zx) did not fail\n", size);
+            failures++;
+        } else {
+            free(p); /* a failed realloc leaves the block alone */
+        }
+        errno = 0;
+        expect("memalign", size, memalign(64, size));
+        errno = 0;
+        expect("memalign(page)", size, memalign(page, size));
+        errno = 0;
+        expect("aligned_alloc", size, aligned_alloc(64, size));
+        errno = 0;
+        expect("valloc", size, valloc(size));
+        errno = 0;
+        expect("pvalloc", size, pvalloc(size));
+        p = NULL;
+        if ((error = posix_memalign((void **)&p, 64, size)) != ENOMEM) {
+            fprintf(stderr, "hugetest: posix_memalign(%#zx) returned %d\n",
+                    size, error);
+            failures++;
+        }
+    }
+
+    for (int i = 0; i < 64; i++) {
+        if ((unsigned char)live[i] != 0x5a) {
+            fprintf(stderr, "hugetest: live block overwritten at %p\n", live);
+            failures++;
+            break;
+        }
+    }
+    free(live);
+
+    if (failures != 0) {
+        fprintf(stderr, "hugetest: %d failures\n", failures);
+        return 1;
+    }
+    printf("hugetest: all huge sizes refused\n");
+    return 0;
+}
@@ -7,6 +7,7 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE             /* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
@@ -21,12 +22,22 @@
 #include <stdbool.h>
 #include <math.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 #include "stree.h"
+#include "hist.h"
+#include "bintrace.h"
+#include "perfctr.h"
 
 /**********************
  * Constants and macros
@@ -77,6 +88,7 @@ typedef struct range_t {
 typedef struct {
     range_t *list;
     tree_t *lo_tree;
+    range_t *sweep;    /* next range whose contents check_sweep checks */
 } range_set_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -93,12 +105,43 @@ typedef struct {
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
-    traceop_t *ops;       /* array of requests */
+    traceop_t *ops;       /* array of requests, or NULL for a binary trace */
+    const void *bin;      /* mapping of a binary trace (see bintrace.h) */
+    size_t bin_length;
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+    int peak_op;          /* op at which eval_mm_util saw the peak payload */
 } trace_t;
 
+/*
+ * Walks the requests of a trace in order. A .rep trace is parsed into its
+ * ops array up front; a binary trace is decoded as it is walked, straight
+ * from its mapping, so that even very long traces are never expanded in
+ * memory.
+ */
+typedef struct {
+    const trace_t *trace;
+    int next;                 /* number of requests walked so far */
+    bintrace_reader_t reader; /* position in a binary trace */
+} trace_cursor_t;
+
+/*
+ * The requests of a trace decoded for the timed replays, so that the
+ * replay loop does no more than stream through three arrays and call the
+ * allocator. Sizes are packed, one per alloc or realloc in order. Ids
+ * used before they are allocated are decoded to what the request does:
+ * a realloc of such an id is an alloc and a free of one is free(NULL),
+ * so the block pointers never need resetting between replays.
+ */
+typedef struct {
+    int num_ops;
+    unsigned char *types;  /* ALLOC, FREE or REALLOC */
+    int *ids;              /* block of each request; -1 for free(NULL) */
+    size_t *sizes;         /* size of each alloc and realloc */
+    void **ptrs;           /* block pointers of the replay in progress */
+} replay_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -107,6 +150,7 @@ typedef struct {
 typedef struct {
     trace_t *trace;
     range_set_t *ranges;
+    replay_t *replay;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -123,6 +167,10 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    fstats_t dist;     /* distribution of the timing samples, with -B */
+    double warm_secs;  /* secs with warm caches, with -C warm or both */
+    double cold_secs;  /* secs with caches flushed, with -C cold or both */
+    double null_secs;  /* secs of the replay itself, subtracted with -N */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -147,7 +195,9 @@ typedef struct {
 
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
-static randint_t random_data[RANDOM_DATA_LEN];
+/* Holds the random data twice, so that the maxfill values from any base
+   are contiguous and a block can be filled and checked in one copy */
+static randint_t random_data[2 * RANDOM_DATA_LEN];
 
 
 /********************
@@ -162,6 +212,31 @@ int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool heapmap_flag = false; /* Print the heap map at each trace's peak */
+static char *persist_file = NULL; /* If set, check a heap backed by this file */
+static int shared_procs = 0;      /* If set, check a heap shared by this many processes */
+static int latency_sample = 0;    /* If set, time every latency_sample-th call */
+/* If set, eval_mm_util writes the usage of the heap over time here */
+static FILE *timeline_out = NULL;
+static bool timeline_json = false; /* Write the timeline as JSON rather than CSV */
+static int timeline_interval = 0;  /* Ops between samples; 0 = 256 samples per trace */
+static int timeline_traces = 0;    /* Number of traces written so far */
+
+/* Multithreaded replay: up to thread_count threads, in thread_mode */
+typedef enum { THREADS_PARTITION, THREADS_REPLICATE, THREADS_PIPELINE } thread_mode_t;
+static int thread_count = 0;
+static thread_mode_t thread_mode = THREADS_PARTITION;
+static int arena_nodes = -1;       /* Made-up nodes for the threads' arenas; -1 = one
+                                      per thread in pipeline mode, else the real ones */
+static bool perf_counters = false; /* Report hardware counters of each trace */
+static int timing_samples = 0;     /* If set, time each trace this many times */
+static bool cache_warm = false;    /* Time each trace with warm caches */
+static bool cache_cold = false;    /* Time each trace with flushed caches */
+static bool null_baseline = false; /* Subtract the time of a null allocator */
+/* Evaluate up to parallel_jobs traces at once in forked workers */
+static int parallel_jobs = 0;
+/* File locked by the workers around timing runs, or NULL */
+static FILE *timing_lock = NULL;
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -203,7 +278,12 @@ static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index);
 static void remove_range(range_set_t *ranges, char *lo);
+static void clear_range_set(range_set_t *ranges);
 static void free_range_set(range_set_t *ranges);
+static bool check_neighbors(range_set_t *ranges, const trace_t *trace,
+                            int opnum, char *lo);
+static bool check_sweep(range_set_t *ranges, const trace_t *trace, int opnum);
+static bool check_all(range_set_t *ranges, const trace_t *trace, int opnum);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -215,6 +295,22 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
+static void alloc_trace_blocks(trace_t *trace, stats_t *stats);
+static bool read_bintrace(trace_t *trace);
+static void trace_rewind(trace_cursor_t *cursor, const trace_t *trace);
+static inline bool trace_next(trace_cursor_t *cursor, traceop_t *op);
+static replay_t *replay_new(const trace_t *trace);
+static void replay_free(replay_t *replay);
+
+/* Evaluation of the traces, one by one or in parallel workers */
+static bool run_trace(int i, const char *tracedir, char **tracefiles,
+                      stats_t *mm_stats, speed_t *speed_params);
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params);
+static void pin_to_cpu(int slot);
+static void timing_begin(void);
+static void timing_end(void);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
@@ -225,9 +321,26 @@ static void eval_libc_speed(void *ptr);
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_null_speed(void *ptr);
+static double time_mm_speed(speed_t *speed_params, stats_t *stats);
+static void eval_mm_heapmap(trace_t *trace, int tracenum);
+static bool eval_mm_resume(trace_t *trace, int tracenum);
+static bool eval_mm_shared(trace_t *trace, int tracenum);
+static void eval_mm_latency(trace_t *trace, int tracenum);
+static void eval_mm_threads(trace_t *trace, int tracenum);
+static void eval_mm_counters(trace_t *trace, int tracenum, speed_t *speed_params);
+
+/* Usage timeline written by eval_mm_util */
+static void timeline_open(const char *filename);
+static void timeline_close(void);
+static void timeline_sample(const trace_t *trace, int opnum, size_t payload,
+                            size_t peak, bool first);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printdistributions(int n, stats_t *stats);
+static void printcaches(int n, stats_t *stats);
+static void printoverhead(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -260,57 +373,274 @@ long int random(void)
 static void run_tests(int num_tracefiles, const char *tracedir,
                       char **tracefiles,
                       stats_t *mm_stats, speed_t *speed_params) {
-    volatile int i;
+    int i;
 
-    for (i=0; i < num_tracefiles; i++) {
-        /* initialize simulated memory system in memlib.c *
-         * start each trace with a clean system */
-        mem_init(sparse_mode);
-        range_set_t *ranges = new_range_set();
+    if (parallel_jobs > 1 && !onetime_flag) {
+        run_tests_parallel(num_tracefiles, tracedir, tracefiles, mm_stats,
+                           speed_params);
+        return;
+    }
+    for (i=0; i < num_tracefiles; i++)
+        if (!run_trace(i, tracedir, tracefiles, mm_stats, speed_params))
+            return;
+}
 
+/*
+ * run_trace - evaluate trace i on a fresh heap and fill in mm_stats[i].
+ *     Returns false once a trace run with -c is done.
+ */
+static bool run_trace(int i, const char *tracedir, char **tracefiles,
+                      stats_t *mm_stats, speed_t *speed_params) {
+    /* initialize simulated memory system in memlib.c *
+     * start each trace with a clean system */
+    mem_init(sparse_mode);
+    range_set_t *ranges = new_range_set();
 
-        // NOTE: If times out, then it will reread the trace file
 
-        trace_t *trace;
-        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
-        strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+    // NOTE: If times out, then it will reread the trace file
 
-        /* Prepare for timeout */
-        if (setjmp(timeout_jmpbuf) != 0) {
-            mm_stats[i].valid = false;
+    trace_t *trace;
+    trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+    strcpy(mm_stats[i].filename, trace->filename);
+    mm_stats[i].ops = trace->num_ops;
+
+    /* Prepare for timeout */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        mm_stats[i].valid = false;
+    } else {
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness, ");
+        mm_stats[i].valid =
+            /* Do 2 tests, since may fail to reinitialize properly */
+            eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
+
+        if (onetime_flag) {
+            free_trace(trace);
+            return false;
+        }
+    }
+    if (mm_stats[i].valid) {
+        if (verbose > 1)
+            printf("efficiency, ");
+        mm_stats[i].util = eval_mm_util(trace, i);
+        if (heapmap_flag)
+            eval_mm_heapmap(trace, i);
+        /* -P and -M check heaps of their own, so that the timing below
+         * is on the same heap as without them */
+        if (persist_file != NULL) {
+            mem_deinit();
+            if (!mem_init_file(persist_file))
+                unix_error("mem_init_file failed in run_tests");
+            mm_stats[i].valid = eval_mm_resume(trace, i);
+            mem_deinit();
+            mem_init(sparse_mode);
+        }
+        if (shared_procs > 0) {
+            mem_deinit();
+            if (!mem_init_shared(NULL))
+                unix_error("mem_init_shared failed in run_tests");
+            mm_stats[i].valid = eval_mm_shared(trace, i);
+            mem_deinit();
+            mem_init(sparse_mode);
+        }
+    }
+    /* A trace that failed -P or -M is not timed either */
+    if (mm_stats[i].valid) {
+        timing_begin();
+        if (latency_sample > 0)
+            eval_mm_latency(trace, i);
+        speed_params->trace = trace;
+        speed_params->ranges = ranges;
+        speed_params->replay = replay_new(trace);
+        if (verbose > 1)
+            printf("and performance.\n");
+        if (sparse_mode) {
+            mm_stats[i].secs = 1.0;
+        } else if (cache_warm || cache_cold) {
+            /* Warm last, so that -B reports the distribution of secs */
+            if (cache_cold) {
+                set_fcyc_cache_mode(FCYC_CACHE_COLD);
+                mm_stats[i].cold_secs = time_mm_speed(speed_params, &mm_stats[i]);
+            }
+            if (cache_warm) {
+                set_fcyc_cache_mode(FCYC_CACHE_WARM);
+                mm_stats[i].warm_secs = time_mm_speed(speed_params, &mm_stats[i]);
+            }
+            set_fcyc_cache_mode(FCYC_CACHE_DEFAULT);
+            mm_stats[i].secs = cache_warm ? mm_stats[i].warm_secs
+                : mm_stats[i].cold_secs;
         } else {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
-                /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
-
-            if (onetime_flag) {
-                free_trace(trace);
-                return;
+            mm_stats[i].secs = time_mm_speed(speed_params, &mm_stats[i]);
+        }
+        if (null_baseline && !sparse_mode) {
+            /* Keep at least a tenth, should noise make the baseline as slow */
+            mm_stats[i].null_secs = fsec(eval_null_speed, speed_params);
+            mm_stats[i].secs = (mm_stats[i].secs - mm_stats[i].null_secs
+                                > mm_stats[i].secs / 10)
+                ? mm_stats[i].secs - mm_stats[i].null_secs
+                : mm_stats[i].secs / 10;
+        }
+        mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+        if (perf_counters)
+            eval_mm_counters(trace, i, speed_params);
+        if (thread_count > 0)
+            eval_mm_threads(trace, i);
+        timing_end();
+        replay_free(speed_params->replay);
+        speed_params->replay = NULL;
+    }
+
+    free_trace(trace);
+    free_range_set(ranges);
+
+    /* clean up memory system */
+    mem_deinit();
+    return true;
+}
+
+/*
+ * Result of a trace evaluated by a worker of run_tests_parallel
+ */
+typedef struct {
+    stats_t stats;
+    int errors;
+} worker_result_t;
+
+/*
+ * run_tests_parallel - run_tests with up to parallel_jobs traces at once,
+ *     each in a forked worker with a heap of its own, pinned to its own CPU.
+ *     The workers take turns for their timing runs (see timing_begin), so
+ *     that throughput is still measured one trace at a time.  The output of
+ *     each worker is held back and printed when it finishes, and the stats
+ *     come back through a pipe.  A worker that dies fails its trace.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params) {
+    int jobs = parallel_jobs < num_tracefiles ? parallel_jobs : num_tracefiles;
+    pid_t *pids = calloc(jobs, sizeof(pid_t));
+    int *traces = calloc(jobs, sizeof(int));
+    int *results = calloc(jobs, sizeof(int));
+    FILE **outputs = calloc(jobs, sizeof(FILE *));
+    int next = 0, running = 0, slot, status;
+    worker_result_t result;
+    pid_t pid;
+    char buf[MAXLINE];
+    size_t n;
+
+    if (pids == NULL || traces == NULL || results == NULL || outputs == NULL)
+        unix_error("calloc failed in run_tests_parallel");
+    if ((timing_lock = tmpfile()) == NULL)
+        unix_error("tmpfile failed in run_tests_parallel");
+
+    while (next < num_tracefiles || running > 0) {
+        /* Start workers in the free slots */
+        for (slot = 0; slot < jobs && next < num_tracefiles; slot++) {
+            int fds[2];
+            if (pids[slot] != 0)
+                continue;
+            if (pipe(fds) < 0 || (outputs[slot] = tmpfile()) == NULL)
+                unix_error("pipe failed in run_tests_parallel");
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in run_tests_parallel");
+            if (pid == 0) {
+                close(fds[0]);
+                dup2(fileno(outputs[slot]), STDOUT_FILENO);
+                dup2(fileno(outputs[slot]), STDERR_FILENO);
+                pin_to_cpu(slot);
+                if (set_timeout > 0)
+                    alarm(set_timeout);
+                run_trace(next, tracedir, tracefiles, mm_stats, speed_params);
+                result.stats = mm_stats[next];
+                result.errors = errors;
+                if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+                    _exit(1);
+                _exit(0);
             }
+            close(fds[1]);
+            pids[slot] = pid;
+            traces[slot] = next++;
+            results[slot] = fds[0];
+            running++;
         }
-        if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
-            speed_params->trace = trace;
-            speed_params->ranges = ranges;
-            if (verbose > 1)
-                printf("and performance.\n");
-            mm_stats[i].secs = sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
-            mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+
+        /* Collect the next worker to finish */
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in run_tests_parallel");
+        for (slot = 0; slot < jobs && pids[slot] != pid; slot++)
+            ;
+        if (slot == jobs)
+            continue;
+        int i = traces[slot];
+        if (read(results[slot], &result, sizeof(result)) == sizeof(result)) {
+            mm_stats[i] = result.stats;
+            errors += result.errors;
+        } else {
+            strcpy(mm_stats[i].filename, tracedir);
+            strcat(mm_stats[i].filename, tracefiles[i]);
+            mm_stats[i].valid = false;
+            errors++;
         }
+        rewind(outputs[slot]);
+        while ((n = fread(buf, 1, sizeof(buf), outputs[slot])) > 0)
+            fwrite(buf, 1, n, stdout);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            printf("Worker for trace %s failed\n", tracefiles[i]);
+        fclose(outputs[slot]);
+        close(results[slot]);
+        pids[slot] = 0;
+        running--;
+    }
+
+    fclose(timing_lock);
+    timing_lock = NULL;
+    free(pids);
+    free(traces);
+    free(results);
+    free(outputs);
+}
 
-        free_trace(trace);
-        free_range_set(ranges);
+/*
+ * pin_to_cpu - bind the calling worker to the slot-th CPU it may run on
+ */
+static void pin_to_cpu(int slot) {
+    cpu_set_t allowed, one;
+    int cpu, count = 0;
 
-        /* clean up memory system */
-        mem_deinit();
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    slot %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && count++ == slot) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
     }
 }
 
+/*
+ * timing_begin, timing_end - lock and unlock timing_lock, so that only one
+ *     worker of run_tests_parallel times a trace at once.  The lock is a
+ *     POSIX record lock, which each process holds on its own and which is
+ *     let go if the worker dies.  Nothing to do when the traces are run
+ *     one by one.
+ */
+static void timing_begin(void) {
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (timing_lock != NULL)
+        while (fcntl(fileno(timing_lock), F_SETLKW, &lock) < 0)
+            if (errno != EINTR)
+                unix_error("fcntl failed in timing_begin");
+}
+
+static void timing_end(void) {
+    struct flock lock = { .l_type = F_UNLCK, .l_whence = SEEK_SET };
+    if (timing_lock != NULL)
+        fcntl(fileno(timing_lock), F_SETLK, &lock);
+}
+
 /**************
  * Main routine
  **************/
@@ -348,7 +678,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:H:q:P:M:L:U:I:n:w:a:j:B:C:hpOVAlDTFeN")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -405,6 +735,84 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'H': /* Back the heap with huge pages */
+            mem_set_huge_pages(atoi(optarg));
+            break;
+
+        case 'F': /* Print the heap map of each trace */
+            heapmap_flag = true;
+            break;
+
+        case 'q': /* Quarantine freed blocks to catch writes after free */
+            mm_set_quarantine(strtoul(optarg, NULL, 0));
+            break;
+
+        case 'P': /* Back the heap with a file and check mm_resume */
+            persist_file = strdup(optarg);
+            break;
+
+        case 'M': /* Replay in several processes sharing one heap */
+            shared_procs = atoi(optarg);
+            break;
+
+        case 'L': /* Report the latency of every n-th call */
+            latency_sample = atoi(optarg);
+            break;
+
+        case 'U': /* Write the usage of the heap over time to a file */
+            timeline_open(optarg);
+            break;
+
+        case 'I': /* Ops between samples of the usage timeline */
+            timeline_interval = atoi(optarg);
+            break;
+
+        case 'n': /* Replay on up to n threads */
+            thread_count = atoi(optarg);
+            break;
+
+        case 'e': /* Report hardware performance counters */
+            perf_counters = true;
+            break;
+
+        case 'B': /* Report the distribution of n timing samples */
+            timing_samples = atoi(optarg);
+            if (timing_samples < 2)
+                app_error("-B takes at least 2 samples");
+            break;
+
+        case 'C': /* Time with warm caches, cold caches, or both */
+            if (strcmp(optarg, "warm") == 0 || strcmp(optarg, "both") == 0)
+                cache_warm = true;
+            if (strcmp(optarg, "cold") == 0 || strcmp(optarg, "both") == 0)
+                cache_cold = true;
+            if (!cache_warm && !cache_cold)
+                app_error("-C takes warm, cold or both");
+            break;
+
+        case 'N': /* Subtract the time of the replay itself */
+            null_baseline = true;
+            break;
+
+        case 'j': /* Evaluate up to n traces at once */
+            parallel_jobs = atoi(optarg);
+            break;
+
+        case 'w': /* How the threads share the trace */
+            if (strcmp(optarg, "partition") == 0)
+                thread_mode = THREADS_PARTITION;
+            else if (strcmp(optarg, "replicate") == 0)
+                thread_mode = THREADS_REPLICATE;
+            else if (strcmp(optarg, "pipeline") == 0)
+                thread_mode = THREADS_PIPELINE;
+            else
+                app_error("-w takes partition, replicate or pipeline");
+            break;
+
+        case 'a': /* Spread the threads over arenas of n made-up nodes */
+            arena_nodes = atoi(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -422,6 +830,15 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
+    if ((persist_file != NULL || shared_procs > 0) && sparse_mode)
+        app_error("-P and -M need a dense heap");
+    if (persist_file != NULL && shared_procs > 0)
+        app_error("-P and -M cannot be combined");
+    if (thread_count > 0 && sparse_mode)
+        app_error("-n needs a dense heap");
+    if (parallel_jobs > 1 && (persist_file != NULL || timeline_out != NULL))
+        app_error("-j cannot be combined with -P or -U");
+
     if (debug_mode != DBG_NONE) {
         init_random_data();
     }
@@ -481,6 +898,7 @@ int main(int argc, char **argv)
 
     run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
               &speed_params);
+    timeline_close();
 
 
     /* Display the mm results in a compact table */
@@ -497,6 +915,18 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (timing_samples > 0 && !sparse_mode) {
+                printdistributions(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if ((cache_warm || cache_cold) && !sparse_mode) {
+                printcaches(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (null_baseline && !sparse_mode) {
+                printoverhead(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
         }
     }
 
@@ -670,6 +1100,7 @@ static range_set_t *new_range_set() {
     range_set_t *ranges = (range_set_t *) malloc(sizeof(range_set_t));
     ranges->list = NULL;
     ranges->lo_tree = tree_new();
+    ranges->sweep = NULL;
     return ranges;
 }
 
@@ -707,7 +1138,7 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
 
     /* Look in the tree for the predecessor block */
     range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned) lo);
-    range_t *next = prev ? prev->next : NULL;
+    range_t *next = prev ? prev->next : ranges->list;
     /* See if it overlaps previous or next blocks */
     if (prev && lo <= prev->hi) {
         malloc_error(trace, opnum,
@@ -759,9 +1190,23 @@ static void remove_range(range_set_t *ranges, char *lo)
         ranges->list = next;
     if (next)
         next->prev = prev;
+    if (ranges->sweep == p)
+        ranges->sweep = next;
     free(p);
 }
 
+/*
+ * clear_range_set - free the range records of the blocks a previous run
+ *     of the trace left allocated
+ */
+static void clear_range_set(range_set_t *ranges)
+{
+    tree_free(ranges->lo_tree, free);
+    ranges->list = NULL;
+    ranges->lo_tree = tree_new();
+    ranges->sweep = NULL;
+}
+
 /*
  * free_range_set - free all of the range records for a trace
  */
@@ -771,6 +1216,61 @@ static void free_range_set(range_set_t *ranges)
     free(ranges);
 }
 
+/*
+ * check_neighbors - Check the contents of the blocks on either side of
+ *     address lo, which the allocator may have written to when it split
+ *     or coalesced free space next to the block at lo
+ */
+static bool check_neighbors(range_set_t *ranges, const trace_t *trace,
+                            int opnum, char *lo)
+{
+    range_t *r = tree_find_nearest(ranges->lo_tree, (long unsigned) lo);
+    range_t *prev = (r && r->lo == lo) ? r->prev : r;
+    range_t *next = r ? r->next : ranges->list;
+    bool ok = true;
+
+    if (prev && !check_index(trace, opnum, prev->index))
+        ok = false;
+    if (next && !check_index(trace, opnum, next->index))
+        ok = false;
+    return ok;
+}
+
+/*
+ * check_sweep - Check the contents of the next EXPENSIVE_SWEEP blocks in
+ *     address order, so that a stray write far from any op is still
+ *     caught within (live blocks / EXPENSIVE_SWEEP) ops
+ */
+static bool check_sweep(range_set_t *ranges, const trace_t *trace, int opnum)
+{
+    size_t n;
+    bool ok = true;
+
+    for (n = 0; n < EXPENSIVE_SWEEP && n < ranges->lo_tree->node_count; n++) {
+        if (!ranges->sweep)
+            ranges->sweep = ranges->list;
+        if (!check_index(trace, opnum, ranges->sweep->index))
+            ok = false;
+        ranges->sweep = ranges->sweep->next;
+    }
+    return ok;
+}
+
+/*
+ * check_all - Check the contents of every allocated block
+ */
+static bool check_all(range_set_t *ranges, const trace_t *trace, int opnum)
+{
+    range_t *r;
+    bool ok = true;
+
+    for (r = ranges->list; r; r = r->next) {
+        if (!check_index(trace, opnum, r->index))
+            ok = false;
+    }
+    return ok;
+}
+
 /**********************************************
  * The following routines handle the random data used for
  * checking memory access.
@@ -784,11 +1284,11 @@ static void init_random_data(void) {
     for(len = 0; len < RANDOM_DATA_LEN; ++len) {
         random_data[len] = random();
     }
+    memcpy(&random_data[RANDOM_DATA_LEN], random_data, RANDOM_DATA_LEN);
 }
 
 static void randomize_block(trace_t *traces, int index) {
     size_t size, fsize;
-    size_t i;
     randint_t *block;
     int base;
 
@@ -805,22 +1305,19 @@ static void randomize_block(trace_t *traces, int index) {
         fsize = maxfill;
     base = traces->block_rand_base[index];
 
-    // NOTE: It's expensive to do this one byte at a time.
-
     // NOTE: It would be nice to also fill in at end of block, but
     // this gets messy with REALLOC
 
-    for(i = 0; i < fsize; i++) {
-        mem_write(&block[i],
-                  random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
+    mem_store(block, &random_data[base % RANDOM_DATA_LEN],
+              fsize * sizeof(randint_t));
 }
 
 static bool check_index(const trace_t *trace, int opnum, int index) {
     size_t size, fsize;
-    size_t i;
+    size_t i, j, n;
     randint_t *block;
+    const randint_t *expected;
+    randint_t data[1024];
     int base;
     int ngarbled = 0;
     int firstgarbled = -1;
@@ -839,12 +1336,20 @@ static bool check_index(const trace_t *trace, int opnum, int index) {
         fsize = thresh;
 
     base = trace->block_rand_base[index];
-
-    // NOTE: It's expensive to do this one byte at a time.
-    for(i = 0; i < fsize; i++) {
-        if (mem_read(&block[i], sizeof(randint_t)) != random_data[(base + i) % RANDOM_DATA_LEN]) {
-            if (firstgarbled == -1) firstgarbled = i;
-            ngarbled++;
+    expected = &random_data[base % RANDOM_DATA_LEN];
+
+    /* Compare a chunk at a time, and count the garbled values of a
+       chunk only if it differs */
+    for (i = 0; i < fsize; i += n) {
+        n = fsize - i < 1024 ? fsize - i : 1024;
+        mem_load(data, &block[i], n * sizeof(randint_t));
+        if (memcmp(data, &expected[i], n * sizeof(randint_t)) == 0)
+            continue;
+        for (j = 0; j < n; j++) {
+            if (data[j] != expected[i + j]) {
+                if (firstgarbled == -1) firstgarbled = i + j;
+                ngarbled++;
+            }
         }
     }
     if (ngarbled != 0) {
@@ -874,6 +1379,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     int max_index = 0;
     int op_index;
     int ignore = 0;
+    int iweight;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -885,10 +1391,15 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
+    trace->ops = NULL;
+    trace->bin = NULL;
+    if (read_bintrace(trace)) {
+        alloc_trace_blocks(trace, stats);
+        return trace;
+    }
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    int iweight;
     ignore += fscanf(tracefile, "%d", &iweight);
     trace->weight = iweight;
     ignore += fscanf(tracefile, "%d", &trace->num_ids);
@@ -904,21 +1415,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
+    alloc_trace_blocks(trace, stats);
 
     /* read every request line in the trace file */
     index = 0;
@@ -955,12 +1452,118 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+    return trace;
+}
+
+/*
+ * alloc_trace_blocks - allocate the arrays that hold the blocks of a
+ *     trace while it is replayed, and fill in its stats
+ */
+static void alloc_trace_blocks(trace_t *trace, stats_t *stats)
+{
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks =
+         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
     stats->ops = trace->num_ops;
+}
 
-    return trace;
+/*
+ * read_bintrace - map the trace file if it is a binary trace (see
+ *     bintrace.h) and read its header. Its requests are decoded from the
+ *     mapping as they are replayed, rather than into trace->ops. Returns
+ *     false if the file is not a binary trace.
+ */
+static bool read_bintrace(trace_t *trace)
+{
+    bintrace_header_t header;
+    bintrace_reader_t reader;
+    struct stat st;
+    void *bin;
+    int fd;
+
+    if ((fd = open(trace->filename, O_RDONLY)) < 0)
+        unix_error("Could not open %s in read_trace", trace->filename);
+    if (fstat(fd, &st) != 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    bin = (st.st_size > 0) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (bin == MAP_FAILED)
+        return false;
+    if (!bintrace_is_binary(bin, st.st_size)) {
+        munmap(bin, st.st_size);
+        return false;
+    }
+    if (!bintrace_open(bin, st.st_size, &header, &reader))
+        app_error("%s: binary trace is cut short", trace->filename);
+    if (header.weight < 0 || header.weight > 3)
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    if (header.num_ids < 0 || header.num_ops < 0)
+        app_error("%s: bad header in binary trace", trace->filename);
+
+    madvise(bin, st.st_size, MADV_SEQUENTIAL);
+    trace->bin = bin;
+    trace->bin_length = st.st_size;
+    trace->weight = header.weight;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->data_bytes = header.data_bytes;
+    return true;
+}
+
+/*
+ * trace_rewind - start walking the requests of the trace from the first
+ */
+static void trace_rewind(trace_cursor_t *cursor, const trace_t *trace)
+{
+    bintrace_header_t header;
+
+    cursor->trace = trace;
+    cursor->next = 0;
+    if (trace->bin != NULL)
+        bintrace_open(trace->bin, trace->bin_length, &header, &cursor->reader);
+}
+
+/*
+ * trace_next - get the next request of the trace in *op. Returns false
+ *     once every request has been walked.
+ */
+static inline bool trace_next(trace_cursor_t *cursor, traceop_t *op)
+{
+    const trace_t *trace = cursor->trace;
+    int type;
+
+    if (cursor->next == trace->num_ops)
+        return false;
+    cursor->next++;
+    if (trace->ops != NULL) {
+        *op = trace->ops[cursor->next - 1];
+        return true;
+    }
+    if (!bintrace_next(&cursor->reader, &type, &op->index, &op->size))
+        app_error("%s: binary trace is cut short", trace->filename);
+    /* only frees may take id -1, for free(NULL) */
+    if (type > BINTRACE_REALLOC || op->index >= trace->num_ids ||
+        op->index < (type == BINTRACE_FREE ? -1 : 0))
+        app_error("%s: bad request %d in binary trace", trace->filename,
+                  cursor->next - 1);
+    op->type = type;
+    return true;
 }
 
 /*
@@ -973,6 +1576,59 @@ static void reinit_trace(trace_t *trace)
     /* block_rand_base is unused if size is zero */
 }
 
+/*
+ * replay_new - decode the requests of the trace for the timed replays
+ */
+static replay_t *replay_new(const trace_t *trace)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    replay_t *replay;
+    bool *live;
+    int i, nsizes = 0;
+
+    if ((replay = malloc(sizeof(replay_t))) == NULL
+        || (replay->types = malloc(trace->num_ops)) == NULL
+        || (replay->ids = malloc(trace->num_ops * sizeof(int))) == NULL
+        || (replay->sizes = malloc(trace->num_ops * sizeof(size_t))) == NULL
+        || (replay->ptrs = calloc(trace->num_ids, sizeof(void *))) == NULL
+        || (live = calloc(trace->num_ids, sizeof(bool))) == NULL)
+        unix_error("malloc failed in replay_new");
+    replay->num_ops = trace->num_ops;
+
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        replay->types[i] = op.type;
+        replay->ids[i] = op.index;
+        switch (op.type) {
+        case REALLOC:
+            if (!live[op.index])
+                replay->types[i] = ALLOC;
+            /* fall through */
+        case ALLOC:
+            replay->sizes[nsizes++] = op.size;
+            live[op.index] = true;
+            break;
+        case FREE:
+            if (op.index >= 0 && !live[op.index])
+                replay->ids[i] = -1;
+            break;
+        }
+    }
+    free(live);
+    return replay;
+}
+
+static void replay_free(replay_t *replay)
+{
+    if (replay == NULL)
+        return;
+    free(replay->types);
+    free(replay->ids);
+    free(replay->sizes);
+    free(replay->ptrs);
+    free(replay);
+}
+
 /*
  * free_trace - Free the trace record and the four arrays it points
  *              to, all of which were allocated in read_trace().
@@ -980,6 +1636,8 @@ static void reinit_trace(trace_t *trace)
 static void free_trace(trace_t *trace)
 {
     free(trace->ops);         /* free the three arrays... */
+    if (trace->bin != NULL)
+        munmap((void *)trace->bin, trace->bin_length);
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
@@ -996,6 +1654,8 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
+    trace_cursor_t cursor;
+    traceop_t op;
     int i;
     int index;
     size_t size;
@@ -1007,6 +1667,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     reinit_trace(trace);
+    clear_range_set(ranges);
 
     /* Call the mm package's init function */
     if (!mm_init()) {
@@ -1015,31 +1676,24 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        index = op.index;
+        size = op.size;
 
         if (debug_mode == DBG_EXPENSIVE) {
-            range_t *r;
-
             /* Let the students check their own heap */
             if (!mm_checkheap(0)) {
                 malloc_error(trace, i, "mm_checkheap returned false\n");
                 return false;
             };
 
-            /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r) {
-                if (!check_index(trace, i, r->index))
-                {
-                    allCheck = false;
-                }
-                r = r->next;
-            }
+            /* Now check that a share of our allocated blocks have the
+               right data; the neighbors of each op are checked below */
+            if (!check_sweep(ranges, trace, i))
+                allCheck = false;
         }
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -1063,6 +1717,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+            if (debug_mode == DBG_EXPENSIVE && !check_neighbors(ranges, trace, i, p))
+                allCheck = false;
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1110,6 +1766,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+            if (debug_mode == DBG_EXPENSIVE) {
+                if (newp != oldp && !check_neighbors(ranges, trace, i, oldp))
+                    allCheck = false;
+                if (newp != NULL && !check_neighbors(ranges, trace, i, newp))
+                    allCheck = false;
+            }
             break;
 
         case FREE: /* mm_free */
@@ -1126,12 +1788,20 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 remove_range(ranges, p);
             }
             mm_free(p);
+            if (debug_mode == DBG_EXPENSIVE && p != NULL
+                && !check_neighbors(ranges, trace, i, p))
+                allCheck = false;
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
     }
+
+    /* Catch whatever the sweep has not reached yet */
+    if (debug_mode == DBG_EXPENSIVE && !check_all(ranges, trace, i))
+        allCheck = false;
+
     /* As far as we know, this is a valid malloc package */
     return allCheck;
 }
@@ -1150,6 +1820,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum)
 {
+    trace_cursor_t cursor;
+    traceop_t op;
     int i;
     int index;
     size_t size, newsize, oldsize;
@@ -1157,20 +1829,25 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     size_t total_size = 0;
     char *p;
     char *newp, *oldp;
+    int interval = timeline_interval;
+    bool sampled = false;
 
     reinit_trace(trace);
+    trace->peak_op = trace->num_ops - 1;
+    if (interval <= 0)
+        interval = (trace->num_ops + 255) / 256;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op.index;
+            size = op.size;
 
             if ((p = mm_malloc(size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
@@ -1185,8 +1862,8 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = op.index;
+            newsize = op.size;
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
@@ -1203,7 +1880,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op.index;
             if (index < 0) {
                 size = 0;
                 p = 0;
@@ -1223,8 +1900,16 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         }
 
         /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            trace->peak_op = i;
+        }
+
+        if (timeline_out != NULL &&
+            ((i + 1) % interval == 0 || i == trace->num_ops - 1)) {
+            timeline_sample(trace, i, total_size, max_total_size, !sampled);
+            sampled = true;
+        }
     }
 
 #if !REF_ONLY
@@ -1234,58 +1919,879 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     return ((double)max_total_size / (double)mem_heapsize());
 }
 
-
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * timeline_open - Start the usage timeline in filename, as JSON if its
+ *   name ends in .json and as CSV otherwise. Each sample is taken by
+ *   eval_mm_util after a number of ops and gives the payload then live,
+ *   its peak so far, the heap size, and the allocated and free bytes of
+ *   the heap as reported by mm_heapinfo.
  */
-static void eval_mm_speed(void *ptr)
+static void timeline_open(const char *filename)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
+    size_t len = strlen(filename);
 
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (!mm_init())
-        app_error("mm_init failed in eval_mm_speed");
+    if ((timeline_out = fopen(filename, "w")) == NULL)
+        unix_error("Could not open %s for the usage timeline", filename);
+    timeline_json = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+    if (timeline_json)
+        fprintf(timeline_out, "[");
+    else
+        fprintf(timeline_out, "trace,op,payload,peak_payload,heap,alloc,free,"
+                "largest_free,free_blocks\n");
+}
 
-    /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+/*
+ * timeline_close - Finish the usage timeline, if any
+ */
+static void timeline_close(void)
+{
+    if (timeline_out == NULL)
+        return;
+    if (timeline_json)
+        fprintf(timeline_out, "%s]\n", timeline_traces > 0 ? "\n]}\n" : "");
+    fclose(timeline_out);
+    timeline_out = NULL;
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * timeline_sample - Write one sample of the usage timeline, after op opnum
+ *   of the trace. The first sample of a trace starts its record.
+ */
+static void timeline_sample(const trace_t *trace, int opnum, size_t payload,
+                            size_t peak, bool first)
+{
+    mm_heapinfo_t info;
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+    mm_heapinfo(&info);
+
+    if (!timeline_json) {
+        fprintf(timeline_out, "%s,%d,%zu,%zu,%zu,%zu,%zu,%zu,%zu\n",
+                trace->filename, opnum + 1, payload, peak, mem_heapsize(),
+                info.alloc_bytes, info.free_bytes, info.largest_free,
+                info.free_blocks);
+        return;
+    }
+    if (first) {
+        fprintf(timeline_out, "%s{\"trace\": \"%s\", \"ops\": %d, \"samples\": [\n",
+                timeline_traces > 0 ? "\n]},\n" : "\n", trace->filename, trace->num_ops);
+        timeline_traces++;
+    }
+    fprintf(timeline_out, "%s  {\"op\": %d, \"payload\": %zu, \"peak_payload\": %zu, "
+            "\"heap\": %zu, \"alloc\": %zu, \"free\": %zu, \"largest_free\": %zu, "
+            "\"free_blocks\": %zu}", first ? "" : ",\n", opnum + 1, payload, peak,
+            mem_heapsize(), info.alloc_bytes, info.free_bytes, info.largest_free,
+            info.free_blocks);
+}
+
+
+/*
+ * eval_mm_heapmap - Show where the space went in the student's package
+ *   Replays the trace up to the op at which eval_mm_util saw the peak
+ *   payload, i.e. the point that sets the utilization score, and prints
+ *   the internal fragmentation against the requested sizes followed by
+ *   mm_heapmap's summary of the free space.
+ */
+static void eval_mm_heapmap(trace_t *trace, int tracenum)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    int i;
+    int index;
+    size_t total_size = 0;
+    char *p;
+    mm_heapinfo_t info;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_heapmap", tracenum);
+
+    for (trace_rewind(&cursor, trace), i = 0;  i <= trace->peak_op && trace_next(&cursor, &op);  i++) {
+        index = op.index;
+        switch (op.type) {
+
+        case ALLOC: /* mm_alloc */
+            if ((p = mm_malloc(op.size)) == NULL)
+                app_error("trace %d: mm_malloc failed in eval_mm_heapmap",
+                          tracenum);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = op.size;
+            total_size += op.size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], op.size);
+            if (p == NULL && op.size != 0)
+                app_error("trace %d: mm_realloc failed in eval_mm_heapmap",
+                          tracenum);
+            total_size += op.size - trace->block_sizes[index];
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = op.size;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
             if (index < 0) {
-                block = 0;
+                mm_free(NULL);
             } else {
-                block = trace->blocks[index];
+                mm_free(trace->blocks[index]);
+                total_size -= trace->block_sizes[index];
+            }
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in eval_mm_heapmap",
+                      tracenum);
+        }
+    }
+
+    mm_heapinfo(&info);
+    printf("\nHeap map of trace %d (%s) at op %d of %d:\n", tracenum,
+           trace->filename, trace->peak_op + 1, trace->num_ops);
+    printf("  requested: %zu bytes; heap: %zu bytes (%.1f%% utilization)\n",
+           total_size, mem_heapsize(),
+           100.0 * (double)total_size / (double)mem_heapsize());
+    printf("  internal fragmentation: %zu bytes (%.1f%% of allocated blocks)\n",
+           info.alloc_bytes - total_size, info.alloc_bytes ?
+           100.0 * (double)(info.alloc_bytes - total_size) / info.alloc_bytes : 0.0);
+    mm_heapmap(stdout, 64);
+}
+
+
+/*
+ * eval_mm_resume - Check that a file-backed heap survives being reopened
+ *   Replays the trace up to its peak, syncs the heap and unmaps its file,
+ *   then maps the file again and resumes the heap from it. The old range
+ *   is held while the file is mapped again, so that the heap moves and
+ *   its links and root must follow it. Every block still allocated at the
+ *   peak must have kept its contents, must be found again through its
+ *   offset in the heap, and must be freed cleanly by the resumed allocator.
+ */
+static bool eval_mm_resume(trace_t *trace, int tracenum)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    int i;
+    int index;
+    char *p;
+    char *old_lo;
+    void *hold;
+    intptr_t delta;
+    int root = -1;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_resume", tracenum);
+
+    for (trace_rewind(&cursor, trace), i = 0;  i <= trace->peak_op && trace_next(&cursor, &op);  i++) {
+        index = op.index;
+        switch (op.type) {
+
+        case ALLOC: /* mm_alloc */
+        case REALLOC: /* mm_realloc */
+            if (op.type == ALLOC)
+                p = mm_malloc(op.size);
+            else
+                p = mm_realloc(trace->blocks[index], op.size);
+            if (p == NULL && op.size != 0)
+                app_error("trace %d: allocation failed in eval_mm_resume",
+                          tracenum);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = (p != NULL) ? op.size : 0;
+            randomize_block(trace, index);
+            break;
+
+        case FREE: /* mm_free */
+            if (index < 0) {
+                mm_free(NULL);
+            } else {
+                mm_free(trace->blocks[index]);
+                trace->blocks[index] = NULL;
+                trace->block_sizes[index] = 0;
+            }
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in eval_mm_resume",
+                      tracenum);
+        }
+    }
+
+    for (index = 0;  index < trace->num_ids;  index++) {
+        if (trace->blocks[index] != NULL) {
+            root = index;
+            break;
+        }
+    }
+    mm_set_root(root >= 0 ? trace->blocks[root] : NULL);
+
+    old_lo = mem_heap_lo();
+    if (!mm_sync()) {
+        malloc_error(trace, trace->peak_op, "mm_sync failed");
+        return false;
+    }
+    mem_deinit();
+    hold = mmap(old_lo, MAX_DENSE_HEAP, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                -1, 0);
+    if (hold == MAP_FAILED)
+        unix_error("Could not hold the old heap range in eval_mm_resume");
+    if (!mem_init_file(persist_file))
+        unix_error("mem_init_file failed in eval_mm_resume");
+    munmap(hold, MAX_DENSE_HEAP);
+    if (!mm_resume()) {
+        malloc_error(trace, trace->peak_op, "mm_resume failed");
+        return false;
+    }
+    delta = (char *)mem_heap_lo() - old_lo;
+    if (delta == 0) {
+        malloc_error(trace, trace->peak_op, "the heap was not moved by the remap");
+        return false;
+    }
+
+    if (!mm_checkheap(0)) {
+        malloc_error(trace, trace->peak_op, "mm_checkheap returned false after mm_resume");
+        return false;
+    }
+    if (mm_get_root() != (root >= 0 ? trace->blocks[root] + delta : NULL)) {
+        malloc_error(trace, trace->peak_op, "mm_get_root did not return block %d", root);
+        return false;
+    }
+    for (index = 0;  index < trace->num_ids;  index++) {
+        if (trace->blocks[index] == NULL)
+            continue;
+        trace->blocks[index] += delta;
+        if (!check_index(trace, trace->peak_op, index))
+            return false;
+        mm_free(trace->blocks[index]);
+        trace->blocks[index] = NULL;
+    }
+    if (!mm_checkheap(0)) {
+        malloc_error(trace, trace->peak_op, "mm_checkheap returned false after freeing the resumed heap");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * eval_mm_shared - Check a heap shared between processes
+ *   Forks shared_procs processes that all replay the trace at once in
+ *   the heap set up by mm_init, checking the contents of their blocks as
+ *   in eval_mm_valid, so that a block handed to two processes is caught.
+ *   Each one frees what it has left at the end; then the heap must be
+ *   consistent and hold no more allocated blocks than it started with.
+ */
+static bool eval_mm_shared(trace_t *trace, int tracenum)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    int i, p;
+    int index;
+    int status;
+    char *newp;
+    mm_heapinfo_t before, after;
+    bool ok = true;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_shared", tracenum);
+    mm_heapinfo(&before);
+
+    fflush(stdout);
+    for (p = 0;  p < shared_procs;  p++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            unix_error("fork failed in eval_mm_shared");
+        if (pid > 0)
+            continue;
+
+        /* Child: replay the whole trace, then free what is left. Each
+         * one fills its blocks from its own seed, so that two processes
+         * handed the same block do not write the same data over it */
+        errors = 0;
+        srand((unsigned) getpid()); /* random() is rand() here */
+        for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+            index = op.index;
+            switch (op.type) {
+
+            case ALLOC: /* mm_malloc */
+                newp = mm_malloc(op.size);
+                if (newp == NULL && op.size != 0)
+                    malloc_error(trace, i, "mm_malloc failed");
+                trace->blocks[index] = newp;
+                trace->block_sizes[index] = (newp != NULL) ? op.size : 0;
+                randomize_block(trace, index);
+                break;
+
+            case REALLOC: /* mm_realloc */
+                check_index(trace, i, index);
+                newp = mm_realloc(trace->blocks[index], op.size);
+                if (newp == NULL && op.size != 0)
+                    malloc_error(trace, i, "mm_realloc failed");
+                trace->blocks[index] = newp;
+                trace->block_sizes[index] = (newp != NULL) ? op.size : 0;
+                randomize_block(trace, index);
+                break;
+
+            case FREE: /* mm_free */
+                if (index >= 0) {
+                    check_index(trace, i, index);
+                    mm_free(trace->blocks[index]);
+                    trace->blocks[index] = NULL;
+                    trace->block_sizes[index] = 0;
+                } else {
+                    mm_free(NULL);
+                }
+                break;
+
+            default:
+                app_error("trace %d: Nonexistent request type in eval_mm_shared",
+                          tracenum);
+            }
+        }
+        for (index = 0;  index < trace->num_ids;  index++) {
+            if (trace->blocks[index] != NULL) {
+                check_index(trace, trace->num_ops - 1, index);
+                mm_free(trace->blocks[index]);
+            }
+        }
+        fflush(stdout);
+        _exit(errors == 0 ? 0 : 1);
+    }
+
+    for (p = 0;  p < shared_procs;  p++) {
+        if (wait(&status) < 0)
+            unix_error("wait failed in eval_mm_shared");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+    }
+    if (!ok) {
+        malloc_error(trace, trace->num_ops - 1,
+                     "a process sharing the heap failed or crashed");
+        return false;
+    }
+    if (!mm_checkheap(0)) {
+        malloc_error(trace, trace->num_ops - 1,
+                     "mm_checkheap returned false after the shared replay");
+        return false;
+    }
+    mm_heapinfo(&after);
+    if (after.alloc_blocks != before.alloc_blocks) {
+        malloc_error(trace, trace->num_ops - 1, "%zu blocks were left allocated "
+                     "in the shared heap", after.alloc_blocks - before.alloc_blocks);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Latency histograms, one for each entry point of the package
+ */
+enum { LAT_MALLOC, LAT_FREE, LAT_REALLOC, LAT_CALLOC, LAT_CALLS };
+static const char *latency_names[LAT_CALLS] = { "malloc", "free", "realloc", "calloc" };
+
+/*
+ * latency_replay - Replays the whole trace, timing every latency_sample-th
+ *   call with the tick counter into hists. If use_calloc is set, the
+ *   allocations of the trace are made with mm_calloc instead of mm_malloc.
+ */
+static void latency_replay(trace_t *trace, int tracenum, bool use_calloc,
+                           hist_t *hists, uint64_t overhead)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    int i;
+    int index;
+    int kind;
+    char *p;
+    uint64_t start, ticks;
+    long calls = 0;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_latency", tracenum);
+
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        index = op.index;
+        start = read_counter();
+        switch (op.type) {
+
+        case ALLOC: /* mm_malloc or mm_calloc */
+            if (use_calloc) {
+                kind = LAT_CALLOC;
+                p = mm_calloc(1, op.size);
+            } else {
+                kind = LAT_MALLOC;
+                p = mm_malloc(op.size);
+            }
+            if (p == NULL && op.size != 0)
+                app_error("trace %d: allocation failed in eval_mm_latency",
+                          tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            kind = LAT_REALLOC;
+            p = mm_realloc(trace->blocks[index], op.size);
+            if (p == NULL && op.size != 0)
+                app_error("trace %d: mm_realloc failed in eval_mm_latency",
+                          tracenum);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            kind = LAT_FREE;
+            mm_free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in eval_mm_latency",
+                      tracenum);
+        }
+        ticks = read_counter() - start;
+        if (calls++ % latency_sample != 0 || (use_calloc && kind != LAT_CALLOC))
+            continue;
+        hist_add(&hists[kind], ticks > overhead ? ticks - overhead : 0);
+    }
+}
+
+/*
+ * eval_mm_latency - Report the tail latency of the student's package
+ *   Replays the trace once as it is and once more with calloc in place of
+ *   malloc, timing each sampled call on its own, and prints the median,
+ *   99th and 99.9th percentiles and maximum of each call in nanoseconds.
+ *   The percentiles are read from log-bucketed histograms (see hist.h),
+ *   and the time to read the counter itself is taken off every call.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum)
+{
+    hist_t hists[LAT_CALLS];
+    double ns = counter_ticks_per_ns();
+    uint64_t overhead = counter_overhead();
+    int kind;
+
+    for (kind = 0;  kind < LAT_CALLS;  kind++)
+        hist_reset(&hists[kind]);
+    latency_replay(trace, tracenum, false, hists, overhead);
+    latency_replay(trace, tracenum, true, hists, overhead);
+
+    printf("\nLatency of trace %d (%s), in ns, timing 1 of every %d calls:\n",
+           tracenum, trace->filename, latency_sample);
+    printf("  %-8s %10s %10s %10s %10s %10s\n",
+           "call", "count", "p50", "p99", "p99.9", "max");
+    for (kind = 0;  kind < LAT_CALLS;  kind++) {
+        if (hists[kind].count == 0)
+            continue;
+        printf("  %-8s %10lu %10.0f %10.0f %10.0f %10.0f\n", latency_names[kind],
+               (unsigned long) hists[kind].count,
+               hist_percentile(&hists[kind], 0.5) / ns,
+               hist_percentile(&hists[kind], 0.99) / ns,
+               hist_percentile(&hists[kind], 0.999) / ns,
+               hists[kind].max / ns);
+    }
+}
+
+/*
+ * eval_mm_counters - Report hardware performance counters of the student's
+ *   package over one replay of the trace by eval_mm_speed, after one more
+ *   to warm up the caches, as totals and per op.  Events that the CPU or
+ *   the kernel do not offer are shown as n/a.
+ */
+static void eval_mm_counters(trace_t *trace, int tracenum, speed_t *speed_params)
+{
+    perfctr_t ctr;
+    int64_t counts[PERFCTR_EVENTS];
+    int event;
+
+    printf("\nCounters of trace %d (%s), over one replay:\n",
+           tracenum, trace->filename);
+    if (perfctr_open(&ctr) == 0) {
+        printf("  not available (%s)\n", strerror(errno));
+        perfctr_close(&ctr);
+        return;
+    }
+    eval_mm_speed(speed_params);
+    perfctr_start(&ctr);
+    eval_mm_speed(speed_params);
+    perfctr_stop(&ctr, counts);
+    perfctr_close(&ctr);
+
+    printf("  %-22s %14s %10s\n", "event", "count", "per op");
+    for (event = 0;  event < PERFCTR_EVENTS;  event++) {
+        if (counts[event] < 0)
+            printf("  %-22s %14s %10s\n", perfctr_names[event], "n/a", "n/a");
+        else
+            printf("  %-22s %14lld %10.2f\n", perfctr_names[event],
+                   (long long) counts[event], (double) counts[event] / trace->num_ops);
+    }
+    if (counts[PERFCTR_CYCLES] > 0 && counts[PERFCTR_INSTRUCTIONS] >= 0)
+        printf("  %-22s %14.2f\n", "IPC",
+               (double) counts[PERFCTR_INSTRUCTIONS] / counts[PERFCTR_CYCLES]);
+}
+
+
+/*
+ * Multithreaded replay
+ *   partition: thread t replays the requests for the ids with id % T == t,
+ *              in trace order, so the threads share the work of one run
+ *   replicate: every thread replays the whole trace, T runs at once
+ *   pipeline:  as replicate, but every block is freed by the next thread
+ *              rather than the one that allocated it; frees are handed
+ *              over in batches through the inbox of that thread
+ * Each thread keeps its own table of blocks, indexed by trace id.
+ */
+#define INBOX_BATCH 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;               /* blocks waiting to be freed */
+    size_t count, capacity;
+} inbox_t;
+
+typedef struct {
+    trace_t *trace;
+    int id;                     /* thread number, from 0 */
+    int nthreads;
+    pthread_barrier_t *start;   /* released when every thread is ready */
+    inbox_t *inboxes;           /* one per thread, for pipeline mode */
+    char **blocks;              /* this thread's blocks, by trace id */
+    long ops;                   /* requests made by this thread */
+    bool failed;                /* set if the heap ran out */
+    struct timespec begin, end; /* when the thread started and finished */
+} worker_t;
+
+/*
+ * inbox_push - Hand n blocks over to the thread that owns inbox
+ */
+static void inbox_push(inbox_t *inbox, char **items, size_t n)
+{
+    pthread_mutex_lock(&inbox->lock);
+    if (inbox->count + n > inbox->capacity) {
+        inbox->capacity = 2 * (inbox->count + n);
+        inbox->items = realloc(inbox->items, inbox->capacity * sizeof(char *));
+        if (inbox->items == NULL)
+            unix_error("realloc failed in inbox_push");
+    }
+    memcpy(inbox->items + inbox->count, items, n * sizeof(char *));
+    inbox->count += n;
+    pthread_mutex_unlock(&inbox->lock);
+}
+
+/*
+ * inbox_drain - Free every block handed over to the worker so far
+ */
+static void inbox_drain(worker_t *w)
+{
+    inbox_t *inbox = &w->inboxes[w->id];
+    char *batch[INBOX_BATCH];
+    size_t n, i;
+
+    do {
+        pthread_mutex_lock(&inbox->lock);
+        n = inbox->count < INBOX_BATCH ? inbox->count : INBOX_BATCH;
+        inbox->count -= n;
+        memcpy(batch, inbox->items + inbox->count, n * sizeof(char *));
+        pthread_mutex_unlock(&inbox->lock);
+        for (i = 0; i < n; i++)
+            mm_free(batch[i]);
+        w->ops += n;
+    } while (n == INBOX_BATCH);
+}
+
+/*
+ * thread_replay - Body of each worker thread
+ */
+static void *thread_replay(void *arg)
+{
+    trace_cursor_t cursor;
+    traceop_t op;
+    worker_t *w = arg;
+    trace_t *trace = w->trace;
+    inbox_t *next = &w->inboxes[(w->id + 1) % w->nthreads];
+    char *outbox[INBOX_BATCH];
+    size_t pending = 0;
+    int i, index;
+    char *p;
+
+    pthread_barrier_wait(w->start);
+    clock_gettime(CLOCK_MONOTONIC, &w->begin);
+    for (trace_rewind(&cursor, trace), i = 0;  !w->failed && trace_next(&cursor, &op);  i++) {
+        index = op.index;
+        if (thread_mode == THREADS_PARTITION &&
+            (index < 0 ? i : index) % w->nthreads != w->id)
+            continue;
+
+        switch (op.type) {
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(op.size)) == NULL)
+                w->failed = true;
+            w->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(w->blocks[index], op.size);
+            if (p == NULL && op.size != 0)
+                w->failed = true;
+            w->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free, or hand the block over */
+            p = (index < 0) ? NULL : w->blocks[index];
+            if (index >= 0)
+                w->blocks[index] = NULL;
+            if (thread_mode == THREADS_PIPELINE && p != NULL) {
+                outbox[pending++] = p;
+                if (pending == INBOX_BATCH) {
+                    inbox_push(next, outbox, pending);
+                    pending = 0;
+                    inbox_drain(w);
+                }
+                continue;
             }
-            mm_free(block);
+            mm_free(p);
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in thread_replay");
+        }
+        w->ops++;
+    }
+    if (pending > 0)
+        inbox_push(next, outbox, pending);
+    clock_gettime(CLOCK_MONOTONIC, &w->end);
+    return NULL;
+}
+
+/*
+ * run_threads - Replay the trace on nthreads threads in thread_mode, on a
+ *   fresh heap, and return the wall-clock seconds from the first thread
+ *   starting to the last one finishing, or -1 if the heap ran out. *ops
+ *   is set to the number of requests made. Blocks left allocated at the
+ *   end of the trace are freed outside the timing.
+ */
+static double run_threads(trace_t *trace, int nthreads, long *ops)
+{
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    inbox_t *inboxes = calloc(nthreads, sizeof(inbox_t));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    pthread_barrier_t start;
+    double first = 0.0, last = 0.0, t0, t1;
+    bool failed = false;
+    int t, index;
+
+    if (workers == NULL || inboxes == NULL || tids == NULL)
+        unix_error("calloc failed in run_threads");
+    /* Pipeline frees go to the arena of another thread, through its
+     * remote_free stack, only if the threads have arenas of their own */
+    if (arena_nodes > 0)
+        mm_set_arena_nodes(arena_nodes);
+    else if (arena_nodes < 0 && thread_mode == THREADS_PIPELINE)
+        mm_set_arena_nodes(nthreads);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in run_threads");
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++) {
+        pthread_mutex_init(&inboxes[t].lock, NULL);
+        workers[t].trace = trace;
+        workers[t].id = t;
+        workers[t].nthreads = nthreads;
+        workers[t].start = &start;
+        workers[t].inboxes = inboxes;
+        if ((workers[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+            unix_error("calloc failed in run_threads");
+        if (pthread_create(&tids[t], NULL, thread_replay, &workers[t]) != 0)
+            unix_error("pthread_create failed in run_threads");
+    }
+    pthread_barrier_wait(&start);
+    for (t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+
+    *ops = 0;
+    for (t = 0; t < nthreads; t++) {
+        t0 = workers[t].begin.tv_sec + 1e-9 * workers[t].begin.tv_nsec;
+        t1 = workers[t].end.tv_sec + 1e-9 * workers[t].end.tv_nsec;
+        if (t == 0 || t0 < first)
+            first = t0;
+        if (t == 0 || t1 > last)
+            last = t1;
+        inbox_drain(&workers[t]);
+        for (index = 0; index < trace->num_ids; index++)
+            mm_free(workers[t].blocks[index]);
+        *ops += workers[t].ops;
+        failed |= workers[t].failed;
+        free(workers[t].blocks);
+        free(inboxes[t].items);
+        pthread_mutex_destroy(&inboxes[t].lock);
+    }
+    pthread_barrier_destroy(&start);
+    free(workers);
+    free(inboxes);
+    free(tids);
+    return failed ? -1.0 : last - first;
+}
+
+/*
+ * eval_mm_threads - Measure how the student's package scales with threads
+ *   Replays the trace on 1, 2, 4, ... up to thread_count threads in
+ *   thread_mode and prints the aggregate throughput of each run and its
+ *   speedup over one thread. The best of three runs is taken for each
+ *   count. This runs in a child process, since once a program has started
+ *   threads it stays multithreaded, and the package may then take locks
+ *   that it skips in the single-threaded runs of the other traces.
+ */
+static void eval_mm_threads(trace_t *trace, int tracenum)
+{
+    static const char *mode_names[] = { "partition", "replicate", "pipeline" };
+    double secs, best, base = 0.0;
+    long ops = 0;
+    int nthreads, rep, status;
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        unix_error("fork failed in eval_mm_threads");
+    if (pid > 0) {
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            malloc_error(trace, trace->num_ops - 1, "multithreaded replay failed");
+        return;
+    }
+
+    printf("\nThreaded replay of trace %d (%s), %s mode:\n",
+           tracenum, trace->filename, mode_names[thread_mode]);
+    printf("  %7s %10s %10s %10s %8s\n", "threads", "ops", "secs", "Kops", "speedup");
+    for (nthreads = 1; ; nthreads = (2 * nthreads < thread_count) ? 2 * nthreads : thread_count) {
+        best = -1.0;
+        for (rep = 0; rep < 3; rep++) {
+            secs = run_threads(trace, nthreads, &ops);
+            if (secs < 0) {
+                best = -1.0;
+                break;
+            }
+            if (best < 0 || secs < best)
+                best = secs;
+        }
+        if (best < 0) {
+            printf("  %7d %10s %10s %10s %8s  (out of memory)\n", nthreads, "-", "-", "-", "-");
+            break;
         }
+        if (nthreads == 1)
+            base = ops / best;
+        printf("  %7d %10ld %10.4f %10.0f %8.2f\n", nthreads, ops, best,
+               ops / (best * 1000.0), (ops / best) / base);
+        if (nthreads >= thread_count)
+            break;
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+
+/*
+ * Stand-ins for the allocator in eval_null_speed, kept out of line so
+ * that the baseline pays for the calls just as the real replay does
+ */
+static __attribute__((noinline)) void *null_malloc(size_t size)
+{
+    static char block[ALIGNMENT] __attribute__((aligned(ALIGNMENT)));
+    __asm__ volatile("" : : "r"(size) : "memory");
+    return block;
+}
+
+static __attribute__((noinline)) void *null_realloc(void *ptr, size_t size)
+{
+    __asm__ volatile("" : : "r"(ptr), "r"(size) : "memory");
+    return null_malloc(size);
+}
+
+static __attribute__((noinline)) void null_free(void *ptr)
+{
+    __asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+/*
+ * replay_ops - Replay the decoded requests with mm malloc, or with the
+ *    null allocator if null is set. Inlined into both callers so that
+ *    null is a constant and each gets a loop of its own.
+ */
+static inline __attribute__((always_inline))
+void replay_ops(replay_t *replay, bool null)
+{
+    const unsigned char *types = replay->types;
+    const int *ids = replay->ids;
+    const size_t *sizes = replay->sizes;
+    void **ptrs = replay->ptrs;
+    int i, n = replay->num_ops;
+
+    for (i = 0; i < n; i++) {
+        int id = ids[i];
+        size_t size;
+
+        switch (types[i]) {
+        case ALLOC:
+            size = *sizes++;
+            ptrs[id] = null ? null_malloc(size) : mm_malloc(size);
+            if (ptrs[id] == NULL)
+                app_error("mm_malloc error in eval_mm_speed");
+            break;
+
+        case REALLOC:
+            size = *sizes++;
+            ptrs[id] = null ? null_realloc(ptrs[id], size)
+                : mm_realloc(ptrs[id], size);
+            if (ptrs[id] == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_speed");
+            break;
+
+        default: /* FREE */
+            if (null)
+                null_free(id < 0 ? NULL : ptrs[id]);
+            else
+                mm_free(id < 0 ? NULL : ptrs[id]);
+            break;
+        }
+    }
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_speed");
+
+    replay_ops(((speed_t *)ptr)->replay, false);
+}
+
+/*
+ * eval_null_speed - Replay the trace as eval_mm_speed does, but with an
+ *    allocator that does nothing, to measure the cost of the replay itself
+ */
+static void eval_null_speed(void *ptr)
+{
+    mem_reset_brk();
+    replay_ops(((speed_t *)ptr)->replay, true);
+}
+
+/*
+ * time_mm_speed - Time eval_mm_speed in the current cache mode of fcyc,
+ *    recording the distribution of the samples in stats with -B
+ */
+static double time_mm_speed(speed_t *speed_params, stats_t *stats)
+{
+    if (timing_samples > 0)
+        return fsec_stats(eval_mm_speed, speed_params, timing_samples,
+                          &stats->dist);
+    return fsec(eval_mm_speed, speed_params);
 }
 
 /*
@@ -1296,36 +2802,38 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
+    trace_cursor_t cursor;
+    traceop_t op;
     int i;
     size_t newsize;
     char *p, *newp, *oldp;
 
     reinit_trace(trace);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
+            if ((p = malloc(op.size)) == NULL) {
                 malloc_error(trace, i, "libc malloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = p;
+            trace->blocks[op.index] = p;
             break;
 
         case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+            oldp = trace->blocks[op.index];
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
                 malloc_error(trace, i, "libc realloc failed");
                 unix_error("System message");
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            trace->blocks[op.index] = newp;
             break;
 
         case FREE: /* free */
-            if (trace->ops[i].index >= 0) {
-                free(trace->blocks[trace->ops[i].index]);
+            if (op.index >= 0) {
+                free(trace->blocks[op.index]);
             } else {
                 free(0);
             }
@@ -1346,6 +2854,8 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
+    trace_cursor_t cursor;
+    traceop_t op;
     int i;
     int index;
     size_t size, newsize;
@@ -1354,19 +2864,19 @@ static void eval_libc_speed(void *ptr)
 
     reinit_trace(trace);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (trace_rewind(&cursor, trace), i = 0;  trace_next(&cursor, &op);  i++) {
+        switch (op.type) {
         case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op.index;
+            size = op.size;
             if ((p = malloc(size)) == NULL)
                 unix_error("malloc failed in eval_libc_speed");
             trace->blocks[index] = p;
             break;
 
         case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+            index = op.index;
+            newsize = op.size;
             oldp = trace->blocks[index];
             if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
                 unix_error("realloc failed in eval_libc_speed\n");
@@ -1375,7 +2885,7 @@ static void eval_libc_speed(void *ptr)
             break;
 
         case FREE: /* free */
-            index = trace->ops[i].index;
+            index = op.index;
             if (index >= 0) {
                 block = trace->blocks[index];
                 free(block);
@@ -1564,6 +3074,105 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printcaches - prints the caches that -C flushes and the throughput of
+ *               each valid trace with warm and cold caches
+ */
+static void printcaches(int n, stats_t *stats)
+{
+    fcyc_cache_t caches[16];
+    int i, ncaches = fcyc_caches(caches, 16);
+
+    printf("Caches:");
+    for (i = 0; i < ncaches; i++)
+        printf("%s L%d %s %ldK", i ? "," : "", caches[i].level,
+               caches[i].type, caches[i].bytes >> 10);
+    printf("%s\n", ncaches ? "" : " unknown");
+    if (cache_cold)
+        printf("Cold runs read %.1f MB to flush them before every replay.\n",
+               fcyc_clear_bytes() / (1024.0 * 1024.0));
+    if (tab_mode)
+        printf("warm\tcold\tcold/warm\ttrace\n");
+    else
+        printf("%10s%10s%10s  %s\n", "warm Kops", "cold Kops", "cold/warm", "trace");
+    for (i = 0; i < n; i++) {
+        double warm, cold;
+        if (!stats[i].valid)
+            continue;
+        warm = stats[i].warm_secs > 0 ? stats[i].ops / (stats[i].warm_secs * 1000.0) : 0;
+        cold = stats[i].cold_secs > 0 ? stats[i].ops / (stats[i].cold_secs * 1000.0) : 0;
+        if (tab_mode) {
+            printf("%.0f\t%.0f\t%.3f\t%s\n", warm, cold,
+                   (warm > 0 && cold > 0) ? cold / warm : 0, stats[i].filename);
+            continue;
+        }
+        if (warm > 0)
+            printf("%10.0f", warm);
+        else
+            printf("%10s", "-");
+        if (cold > 0)
+            printf("%10.0f", cold);
+        else
+            printf("%10s", "-");
+        if (warm > 0 && cold > 0)
+            printf("%10.3f", cold / warm);
+        else
+            printf("%10s", "-");
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
+/*
+ * printoverhead - prints how much of the measured time of the valid
+ *                 traces was the replay itself, which -N subtracted
+ */
+static void printoverhead(int n, stats_t *stats)
+{
+    double null_secs = 0, mm_secs = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        null_secs += stats[i].null_secs;
+        mm_secs += stats[i].secs;
+    }
+    if (null_secs + mm_secs <= 0)
+        return;
+    printf("Replay overhead (null allocator), subtracted: %.3f of %.3f msecs (%.1f%%)\n",
+           null_secs * 1000.0, (null_secs + mm_secs) * 1000.0,
+           100.0 * null_secs / (null_secs + mm_secs));
+}
+
+/*
+ * printdistributions - prints the distribution of the -B timing samples
+ *                      of each valid trace, in msecs per replay
+ */
+static void printdistributions(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Timing distributions (%d samples, msecs):\n", timing_samples);
+    if (tab_mode)
+        printf("median\tmean\tstddev\tci_lo\tci_hi\ttrace\n");
+    else
+        printf("%10s%10s%9s  %-21s  %s\n",
+               "median", "mean", "stddev", "95% CI of median", "trace");
+    for (i = 0; i < n; i++) {
+        fstats_t *d = &stats[i].dist;
+        if (!stats[i].valid || d->n == 0)
+            continue;
+        if (tab_mode)
+            printf("%.4f\t%.4f\t%.4f\t%.4f\t%.4f\t%s\n",
+                   d->median * 1000.0, d->mean * 1000.0, d->stddev * 1000.0,
+                   d->ci_lo * 1000.0, d->ci_hi * 1000.0, stats[i].filename);
+        else
+            printf("%10.4f%10.4f%9.4f  [%9.4f, %9.4f]  %s\n",
+                   d->median * 1000.0, d->mean * 1000.0, d->stddev * 1000.0,
+                   d->ci_lo * 1000.0, d->ci_hi * 1000.0, stats[i].filename);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1699,4 +3308,21 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-H <i>     Huge pages: 0 off; 1 transparent; 2 MAP_HUGETLB.\n");
+    fprintf(stderr, "\t-F         Print a fragmentation map of the heap at each trace's peak.\n");
+    fprintf(stderr, "\t-q <n>     Hold up to n bytes of freed blocks in poisoned quarantine.\n");
+    fprintf(stderr, "\t-P <file>  Back the heap with file and check that it can be resumed.\n");
+    fprintf(stderr, "\t-M <n>     Replay each trace in n processes sharing one heap.\n");
+    fprintf(stderr, "\t-L <n>     Report latency percentiles of every n-th call (1 for all).\n");
+    fprintf(stderr, "\t-U <file>  Write the heap usage over time to file (CSV, or JSON if *.json).\n");
+    fprintf(stderr, "\t-I <n>     Sample the heap usage every n ops (default: 256 samples per trace).\n");
+    fprintf(stderr, "\t-n <n>     Report throughput on 1, 2, 4, ... up to n threads.\n");
+    fprintf(stderr, "\t-w <mode>  How threads share the trace: partition, replicate or pipeline.\n");
+    fprintf(stderr, "\t-a <n>     Give threads arenas of n made-up NUMA nodes (default: one\n"
+                    "\t           per thread for pipeline, 0 for the real nodes).\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to n traces at once, timing one at a time.\n");
+    fprintf(stderr, "\t-e         Report hardware performance counters and IPC of each trace.\n");
+    fprintf(stderr, "\t-B <n>     Time each trace n times and report the median and its 95%% CI.\n");
+    fprintf(stderr, "\t-C <mode>  Time with warm caches, cold (flushed) caches, or both.\n");
+    fprintf(stderr, "\t-N         Subtract the replay overhead, timed with a null allocator.\n");
 }
@@ -5,64 +5,249 @@
  *
  * This version has been updated to enable sparse emulation of very large heaps
  */
+#define _GNU_SOURCE             /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The heap is made of one or more regions, each with its own break.
+ * Region 0 is the main heap created by mem_init; any others are created
+ * on demand by mem_region_new (one per NUMA node) and can be bound to
+ * the memory of a node.
+ */
+typedef struct {
+    unsigned char *lo;          /* Starting address of region */
+    unsigned char *brk;         /* Current position of break */
+    unsigned char *max_addr;    /* Maximum allowable address */
+    size_t mmap_length;         /* Number of bytes allocated by mmap */
+} region_t;
+
 /* private global variables */
-static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
-static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
-static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static region_t regions[MAX_HEAP_REGIONS];
+static int num_regions = 0;                 /* Number of regions in use */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
+static int huge_mode = HUGE_PAGE_MODE;      /* Requested huge page backing */
+static bool huge_active = false;            /* Is the heap backed by huge pages? */
+static bool protected = false;              /* Has mem_protect revoked access to any page? */
+static int heap_fd = -1;                    /* File backing region 0, if any */
+static bool heap_shared = false;            /* Is region 0 shared between processes? */
+
+/*
+ * Sparse mode: the heap is a range of virtual addresses starting at
+ * SPARSE_HEAP_START that is never mapped.  Its contents are held in
+ * SPARSE_PAGE_SIZE page frames that are created on first write and found
+ * through a chained hash table keyed by page number.  Pages that were never
+ * written read as zero.
+ */
+typedef struct sparse_page {
+    uintptr_t pageno;                       /* Address / SPARSE_PAGE_SIZE */
+    struct sparse_page *next;               /* Next page in hash chain */
+    unsigned char data[SPARSE_PAGE_SIZE];
+} sparse_page_t;
+
+#define SPARSE_INIT_BUCKETS 1024
+
+static bool sparse = false;                 /* Is the heap emulated? */
+static sparse_page_t **page_table = NULL;   /* Hash buckets */
+static size_t table_size = 0;               /* Number of buckets (power of 2) */
+static size_t page_count = 0;               /* Number of materialized pages */
 
 static void print_stats();
+static void *map_huge_heap(void *start, size_t length);
+static bool mem_map_fd(int fd);
+static unsigned char *sparse_find_page(uintptr_t pageno, bool create);
+static void sparse_free_pages(void);
+static void sparse_read_bytes(void *buf, uintptr_t addr, size_t len);
+static void sparse_write_bytes(uintptr_t addr, const void *buf, size_t len);
+static size_t sparse_pages_in_range(uintptr_t lo, size_t len, uintptr_t **pagenos);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model.  If sparse_mode is set,
+ *            emulate a heap of up to MAX_SPARSE_HEAP bytes.
  */
-void mem_init(){
+void mem_init(bool sparse_mode){
+    region_t *r = &regions[0];
+    num_regions = 1;
+    sparse = sparse_mode;
+    huge_active = false;
+    heap_fd = -1;
+    heap_shared = false;
+    if (sparse) {
+        r->mmap_length = 0;
+        table_size = SPARSE_INIT_BUCKETS;
+        page_table = calloc(table_size, sizeof(sparse_page_t *));
+        if (page_table == NULL) {
+            fprintf(stderr, "FAILURE.  couldn't allocate sparse page table\n");
+            exit(1);
+        }
+        page_count = 0;
+        r->lo = SPARSE_HEAP_START;
+        r->max_addr = r->lo + MAX_SPARSE_HEAP;
+
+        stats_printed = false;
+        r->brk = r->lo;
+        mem_reset_brk();
+        return;
+    }
+
     /* Dense allocation */
-    mmap_length = MAX_DENSE_HEAP;
+    r->mmap_length = MAX_DENSE_HEAP;
+    size_t mmap_length = r->mmap_length;
 
-    int dev_zero = open("/dev/zero", O_RDWR);
     void *start = TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,        /* suggested start*/
-                      mmap_length,  /* length */
-                      PROT_WRITE,   /* permissions */
-                      MAP_PRIVATE,  /* private or shared? */
-                      dev_zero,            /* fd */
-                      0);            /* offset */
+    void *addr = MAP_FAILED;
+    if (huge_mode != 0) {
+        addr = map_huge_heap(start, mmap_length);
+    }
+    if (addr == MAP_FAILED) {
+        /* Only address space is reserved; pages are committed as touched */
+        addr = mmap(start,        /* suggested start*/
+                    mmap_length,  /* length */
+                    PROT_READ | PROT_WRITE,   /* permissions */
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1,            /* fd */
+                    0);            /* offset */
+    }
     if (addr == MAP_FAILED) {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
         exit(1);
     }
     
-    heap = addr;
-    mem_max_addr = heap + MAX_DENSE_HEAP;
+    r->lo = addr;
+    r->max_addr = r->lo + MAX_DENSE_HEAP;
     
     stats_printed = false;
-    mem_brk = heap;
+    r->brk = r->lo;
     mem_reset_brk();
 }
 
+/*
+ * mem_init_file - initialize the memory system model with the main heap
+ *            backed by the file at path, mapped shared so that the heap
+ *            outlives the process.  The file is created if needed and
+ *            extended (sparsely) to MAX_DENSE_HEAP bytes.  The break starts
+ *            at the bottom as with mem_init; mm_resume moves it back to the
+ *            end of a heap left in the file.  Returns false if the file
+ *            could not be opened or mapped.
+ */
+bool mem_init_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    heap_shared = false;
+    return fd >= 0 && mem_map_fd(fd);
+}
+
+/*
+ * mem_init_shared - initialize the memory system model with the main heap
+ *            in memory shared between processes.  If name is NULL, the
+ *            memory is an anonymous memfd, which processes forked after
+ *            mm_init share at the same address.  Otherwise it is the POSIX
+ *            shared memory object of that name (see shm_open), created if
+ *            needed, which unrelated processes can map and join with
+ *            mm_attach.  Returns false if it could not be created or mapped.
+ */
+bool mem_init_shared(const char *name) {
+    int fd = (name == NULL) ? memfd_create("mm-heap", MFD_CLOEXEC)
+                            : shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || !mem_map_fd(fd))
+        return false;
+    heap_shared = true;
+    return true;
+}
+
+/*
+ * mem_map_fd - map the file fd as the main heap, with MAP_SHARED, after
+ *            extending it (sparsely) to MAX_DENSE_HEAP bytes.  Closes fd
+ *            and returns false on failure.
+ */
+static bool mem_map_fd(int fd) {
+    region_t *r = &regions[0];
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        ((size_t) st.st_size < MAX_DENSE_HEAP && ftruncate(fd, MAX_DENSE_HEAP) != 0)) {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(TRY_DENSE_HEAP_START, MAX_DENSE_HEAP, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    num_regions = 1;
+    sparse = false;
+    huge_active = false;
+    heap_fd = fd;
+    r->lo = addr;
+    r->max_addr = r->lo + MAX_DENSE_HEAP;
+    r->mmap_length = MAX_DENSE_HEAP;
+    stats_printed = false;
+    r->brk = r->lo;
+    return true;
+}
+
+/*
+ * mem_persistent - returns true if the main heap is backed by a file
+ */
+bool mem_persistent(void) {
+    return heap_fd >= 0;
+}
+
+/*
+ * mem_shared - returns true if the main heap was mapped by mem_init_shared
+ */
+bool mem_shared(void) {
+    return heap_shared;
+}
+
+/*
+ * mem_sync - write the used part of a file-backed main heap back to its
+ *            file.  Returns false if the heap is not file-backed or the
+ *            write failed.
+ */
+bool mem_sync(void) {
+    region_t *r = &regions[0];
+    if (heap_fd < 0)
+        return false;
+    return msync(r->lo, r->brk - r->lo, MS_SYNC) == 0;
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
     print_stats();
-    munmap(heap, mmap_length);
+    if (sparse) {
+        sparse_free_pages();
+        free(page_table);
+        page_table = NULL;
+        table_size = 0;
+    } else {
+        int i;
+        for (i = 0; i < num_regions; i++)
+            munmap(regions[i].lo, regions[i].mmap_length);
+    }
+    if (heap_fd >= 0) {
+        close(heap_fd);
+        heap_fd = -1;
+    }
+    heap_shared = false;
+    num_regions = 0;
 }
 
 /*
@@ -70,7 +255,16 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
     print_stats();
-    mem_brk = heap;
+    int i;
+    for (i = 0; i < num_regions; i++) {
+        if (protected && regions[i].brk > regions[i].lo)
+            mprotect(regions[i].lo, regions[i].brk - regions[i].lo,
+                     PROT_READ | PROT_WRITE);
+        regions[i].brk = regions[i].lo;
+    }
+    protected = false;
+    if (sparse)
+        sparse_free_pages();
 }
 
 /* 
@@ -79,22 +273,31 @@ void mem_reset_brk(){
  *                this model, the heap cannot be shrunk.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for the heap region with the given id.
+ *                Calls for the same region must be serialized by the caller.
+ */
+void *mem_region_sbrk(int id, intptr_t incr) {
+    region_t *r = &regions[id];
+    unsigned char *old_brk = r->brk;
 
     bool ok = true;
     if (incr < 0) {
         ok = false;
         fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+    } else if (r->brk + incr > r->max_addr) {
         ok = false;
-        size_t alloc = mem_brk - heap + incr;
+        size_t alloc = r->brk - r->lo + incr;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (sbrk(incr) == (void*) -1) {
+    } else if (!sparse && id == 0 && !MM_PRELOAD && sbrk(incr) == (void*) -1) {
         ok = false;
         fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
     if (ok) {
-        mem_brk += incr;
+        r->brk += incr;
         return (void *) old_brk;
     } else {
         errno = ENOMEM;
@@ -106,21 +309,25 @@ void *mem_sbrk(intptr_t incr) {
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo(){
-    return (void *) heap;
+    return (void *) regions[0].lo;
 }
 
 /* 
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return (void *)(regions[0].brk - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    size_t size = 0;
+    int i;
+    for (i = 0; i < num_regions; i++)
+        size += (size_t)(regions[i].brk - regions[i].lo);
+    return size;
 }
 
 /*
@@ -131,33 +338,490 @@ size_t mem_pagesize(){
 }
 
 
+/*
+ * mem_region_new - map an additional heap region and bind it to the
+ *                memory of NUMA node (if node >= 0).  Returns the region id,
+ *                or -1 if no more regions can be created.
+ */
+int mem_region_new(int node) {
+    if (sparse || heap_fd >= 0 || num_regions == MAX_HEAP_REGIONS)
+        return -1;
+
+    size_t length = MAX_DENSE_HEAP;
+    void *addr = MAP_FAILED;
+    if (huge_mode != 0)
+        addr = map_huge_heap(NULL, length);
+    if (addr == MAP_FAILED)
+        addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+
+    int id = num_regions;
+    region_t *r = &regions[id];
+    r->lo = addr;
+    r->brk = r->lo;
+    r->max_addr = r->lo + length;
+    r->mmap_length = length;
+    num_regions++;
+    if (node >= 0)
+        mem_region_bind(id, node);
+    return id;
+}
+
+/*
+ * mem_region_bind - bind the memory of a region to NUMA node.  Returns
+ *                false if the kernel refused, in which case the region
+ *                keeps the default (first touch) policy.
+ */
+bool mem_region_bind(int id, int node) {
+    region_t *r = &regions[id];
+    unsigned long nodemask[4] = {0};
+    size_t maxnode = 8 * sizeof(nodemask);
+    if (sparse || node < 0 || (size_t) node >= maxnode)
+        return false;
+    nodemask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, r->lo, r->mmap_length, MPOL_BIND,
+                   nodemask, maxnode, 0) == 0;
+}
+
+/*
+ * mem_region_count - returns the number of regions mapped, the main heap
+ *                included; mem_init drops all but the main heap
+ */
+int mem_region_count(void) {
+    return num_regions;
+}
+
+/*
+ * mem_region_lo, mem_region_hi, mem_region_size - mem_heap_lo,
+ *                mem_heap_hi and mem_heapsize for a single region
+ */
+void *mem_region_lo(int id) {
+    return (void *) regions[id].lo;
+}
+
+void *mem_region_hi(int id) {
+    return (void *)(regions[id].brk - 1);
+}
+
+size_t mem_region_size(int id) {
+    return (size_t)(regions[id].brk - regions[id].lo);
+}
+
+/*
+ * mem_region_max - returns the address just past the largest extent of
+ *                the region, so that [lo, max) contains all of its blocks
+ */
+void *mem_region_max(int id) {
+    return (void *) regions[id].max_addr;
+}
+
+/*
+ * mem_numa_node - returns the NUMA node of the CPU the caller is running on
+ */
+int mem_numa_node(void) {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return (int) node;
+}
+
+/*
+ * mem_set_huge_pages - select huge page backing for the heap:
+ *                0 = default pages, 1 = transparent, 2 = MAP_HUGETLB.
+ *                Takes effect at the next call to mem_init.
+ */
+void mem_set_huge_pages(int mode) {
+    huge_mode = mode;
+}
+
+/*
+ * mem_hugepagesize() - returns the huge page size if the heap is backed
+ *                by huge pages, and 0 otherwise
+ */
+size_t mem_hugepagesize() {
+    return huge_active ? (size_t) HUGE_PAGE_SIZE : 0;
+}
+
+
 /*************** Private Functions *******************/
 
+/*
+ * map_huge_heap - map the heap so that it can be backed by huge pages.
+ *      An explicit MAP_HUGETLB mapping is tried first if requested, since it
+ *      only succeeds when huge pages have been reserved by the administrator.
+ *      Otherwise the heap is mapped anonymously on a huge page boundary and
+ *      marked with MADV_HUGEPAGE.  Returns MAP_FAILED if neither works.
+ */
+static void *map_huge_heap(void *start, size_t mmap_length) {
+    void *addr;
+#ifdef MAP_HUGETLB
+    if (huge_mode == 2) {
+        addr = mmap(start, mmap_length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            huge_active = true;
+            return addr;
+        }
+    }
+#endif
+
+    /* Over-allocate by one huge page so that the start can be aligned */
+    size_t len = mmap_length + HUGE_PAGE_SIZE;
+    unsigned char *raw = mmap(start, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+        return MAP_FAILED;
+    uintptr_t mask = HUGE_PAGE_SIZE - 1;
+    unsigned char *aligned = (unsigned char *) (((uintptr_t) raw + mask) & ~mask);
+    size_t lead = aligned - raw;
+    if (lead > 0)
+        munmap(raw, lead);
+    if (HUGE_PAGE_SIZE - lead > 0)
+        munmap(aligned + mmap_length, HUGE_PAGE_SIZE - lead);
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, mmap_length, MADV_HUGEPAGE) == 0)
+        huge_active = true;
+#endif
+    if (!huge_active)
+        fprintf(stderr, "WARNING: huge pages unavailable, using default pages\n");
+    return aligned;
+}
+
 
 static void print_stats() {
     size_t vbytes = mem_heapsize();
     if (!show_stats || vbytes == 0 || stats_printed)
         return;
     printf("Allocated %zu heap bytes.  Max address = %p\n",
-           vbytes, mem_brk);
+           vbytes, regions[0].brk);
+    if (sparse)
+        printf("Materialized %zu pages of %d bytes\n",
+               page_count, SPARSE_PAGE_SIZE);
     stats_printed = true;
 }
 
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
 
-    rdata = *(uint64_t *) addr;
-    if (len < sizeof(uint64_t)) {
-        uint64_t mask = ((uint64_t) 1 << (8 * len)) - 1;
-        rdata &= mask;
+    if (sparse) {
+        rdata = 0;
+        sparse_read_bytes(&rdata, (uintptr_t) addr, len);
+        return rdata;
     }
+    if (len == sizeof(uint64_t))
+        return *(uint64_t *) addr;
+    /* Read no further than len bytes, which may end at a guard page */
+    rdata = 0;
+    memcpy((void *) &rdata, addr, len);
     return rdata;
 }
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-   if (len == sizeof(uint64_t))
+   if (sparse)
+        sparse_write_bytes((uintptr_t) addr, &val, len);
+   else if (len == sizeof(uint64_t))
         *(uint64_t *) addr = val;
     else
         memcpy(addr, (void *) &val, len);
 }
+
+void mem_load(void *buf, const void *src, size_t len) {
+    if (sparse)
+        sparse_read_bytes(buf, (uintptr_t) src, len);
+    else
+        memcpy(buf, src, len);
+}
+
+void mem_store(void *dst, const void *buf, size_t len) {
+    if (sparse)
+        sparse_write_bytes((uintptr_t) dst, buf, len);
+    else
+        memcpy(dst, buf, len);
+}
+
+/* Copy len bytes from src to dst within the heap.  Regions must not overlap */
+void mem_memcpy(void *dst, const void *src, size_t len) {
+    if (!sparse) {
+        memcpy(dst, src, len);
+        return;
+    }
+
+    /* Unwritten source pages read as zero, so clear the destination first
+     * and then copy only the source pages that have been materialized. */
+    mem_memset(dst, 0, len);
+    uintptr_t *pagenos;
+    size_t n = sparse_pages_in_range((uintptr_t) src, len, &pagenos);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        uintptr_t page_lo = pagenos[i] * SPARSE_PAGE_SIZE;
+        uintptr_t lo = page_lo > (uintptr_t) src ? page_lo : (uintptr_t) src;
+        uintptr_t hi = page_lo + SPARSE_PAGE_SIZE;
+        if (hi > (uintptr_t) src + len)
+            hi = (uintptr_t) src + len;
+        unsigned char *data = sparse_find_page(pagenos[i], false);
+        sparse_write_bytes((uintptr_t) dst + (lo - (uintptr_t) src),
+                           data + (lo - page_lo), hi - lo);
+    }
+    free(pagenos);
+}
+
+/*
+ * mem_remap - move the pages of [src, src+len) to dst within the heap
+ *             without copying them.  The pages that were at dst take the
+ *             place of the ones at src, so that neither range has to be
+ *             faulted in again, and src is left with stale contents.
+ *             dst, src and len must be multiples of the page size and
+ *             the ranges must not overlap.  Returns false if the pages
+ *             could not be moved, with *parked set to NULL if the heap is
+ *             unchanged.  If the pages of src were moved out but could not
+ *             be put in place, *parked is set to where they are: the caller
+ *             must copy them to dst and give them back with mem_unpark.
+ *             mremap only moves a range that lies in a single mapping, so
+ *             this fails once earlier moves have split the heap around src.
+ *             It never works on a file-backed heap, whose contents stay at
+ *             their file offsets whatever the mapping.
+ */
+bool mem_remap(void *dst, void *src, size_t len, void **parked) {
+    *parked = NULL;
+#ifdef MREMAP_DONTUNMAP
+    if (sparse || heap_fd >= 0 || len == 0)
+        return false;
+
+    /* Park the pages of src elsewhere, move the pages of dst onto src and
+     * the parked pages onto dst.  DONTUNMAP keeps every range mapped, so
+     * that no other mapping can take its place in between */
+    void *tmp = mremap(src, len, len, MREMAP_MAYMOVE | MREMAP_DONTUNMAP);
+    if (tmp == MAP_FAILED)
+        return false;
+    if (mremap(dst, len, len, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP,
+               src) == MAP_FAILED) {
+        if (mremap(tmp, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, src) == MAP_FAILED)
+            *parked = tmp;
+        return false;
+    }
+    if (mremap(tmp, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED) {
+        *parked = tmp;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * mem_unpark - give back the len bytes of pages that mem_remap left at
+ *             parked, once the caller has copied them
+ */
+void mem_unpark(void *parked, size_t len) {
+    munmap(parked, len);
+}
+
+/*
+ * mem_protect - make the pages of [addr, addr+len) accessible or not, so
+ *             that any access to an inaccessible page faults.  addr and len
+ *             must be multiples of the page size.  mem_reset_brk makes the
+ *             whole heap accessible again.  Returns false if the protection
+ *             could not be changed, as in sparse mode.
+ */
+bool mem_protect(void *addr, size_t len, bool accessible) {
+    if (sparse)
+        return false;
+    if (mprotect(addr, len, accessible ? PROT_READ | PROT_WRITE : PROT_NONE) != 0)
+        return false;
+    if (!accessible)
+        protected = true;
+    return true;
+}
+
+/* Set len bytes of the heap starting at dst to c */
+void mem_memset(void *dst, int c, size_t len) {
+    if (!sparse) {
+        memset(dst, c, len);
+        return;
+    }
+
+    if (c != 0) {
+        unsigned char buf[SPARSE_PAGE_SIZE];
+        memset(buf, c, sizeof(buf));
+        uintptr_t addr = (uintptr_t) dst;
+        while (len > 0) {
+            size_t chunk = SPARSE_PAGE_SIZE - addr % SPARSE_PAGE_SIZE;
+            if (chunk > len)
+                chunk = len;
+            sparse_write_bytes(addr, buf, chunk);
+            addr += chunk;
+            len -= chunk;
+        }
+        return;
+    }
+
+    /* Zeroing never needs to materialize a page */
+    uintptr_t *pagenos;
+    size_t n = sparse_pages_in_range((uintptr_t) dst, len, &pagenos);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        uintptr_t page_lo = pagenos[i] * SPARSE_PAGE_SIZE;
+        uintptr_t lo = page_lo > (uintptr_t) dst ? page_lo : (uintptr_t) dst;
+        uintptr_t hi = page_lo + SPARSE_PAGE_SIZE;
+        if (hi > (uintptr_t) dst + len)
+            hi = (uintptr_t) dst + len;
+        unsigned char *data = sparse_find_page(pagenos[i], false);
+        memset(data + (lo - page_lo), 0, hi - lo);
+    }
+    free(pagenos);
+}
+
+
+/*************** Sparse heap emulation *******************/
+
+/* Bucket of page number in the hash table */
+static size_t sparse_bucket(uintptr_t pageno, size_t nbuckets) {
+    return (size_t) ((pageno * 0x9E3779B97F4A7C15UL) >> 20) & (nbuckets - 1);
+}
+
+/* Double the number of buckets once the load exceeds HASH_LOAD */
+static void sparse_grow_table(void) {
+    size_t new_size = table_size * 2;
+    sparse_page_t **new_table = calloc(new_size, sizeof(sparse_page_t *));
+    if (new_table == NULL)
+        return; /* Keep going with longer chains */
+    size_t b;
+    for (b = 0; b < table_size; b++) {
+        sparse_page_t *p = page_table[b];
+        while (p) {
+            sparse_page_t *next = p->next;
+            size_t nb = sparse_bucket(p->pageno, new_size);
+            p->next = new_table[nb];
+            new_table[nb] = p;
+            p = next;
+        }
+    }
+    free(page_table);
+    page_table = new_table;
+    table_size = new_size;
+}
+
+/*
+ * sparse_find_page - return the data of page pageno.  If it has not
+ *      been materialized, create a zeroed page when create is set and
+ *      return NULL otherwise.
+ */
+static unsigned char *sparse_find_page(uintptr_t pageno, bool create) {
+    size_t b = sparse_bucket(pageno, table_size);
+    sparse_page_t *p;
+    for (p = page_table[b]; p != NULL; p = p->next) {
+        if (p->pageno == pageno)
+            return p->data;
+    }
+    if (!create)
+        return NULL;
+
+    if ((p = calloc(1, sizeof(sparse_page_t))) == NULL) {
+        fprintf(stderr, "FAILURE.  couldn't allocate sparse page\n");
+        exit(1);
+    }
+    p->pageno = pageno;
+    p->next = page_table[b];
+    page_table[b] = p;
+    page_count++;
+    if ((double) page_count > HASH_LOAD * table_size)
+        sparse_grow_table();
+    return p->data;
+}
+
+/* Release every materialized page */
+static void sparse_free_pages(void) {
+    size_t b;
+    for (b = 0; b < table_size; b++) {
+        sparse_page_t *p = page_table[b];
+        while (p) {
+            sparse_page_t *next = p->next;
+            free(p);
+            p = next;
+        }
+        page_table[b] = NULL;
+    }
+    page_count = 0;
+}
+
+/* Read len bytes at emulated address addr, which may span pages */
+static void sparse_read_bytes(void *buf, uintptr_t addr, size_t len) {
+    unsigned char *out = buf;
+    while (len > 0) {
+        size_t offset = addr % SPARSE_PAGE_SIZE;
+        size_t chunk = SPARSE_PAGE_SIZE - offset;
+        if (chunk > len)
+            chunk = len;
+        unsigned char *data = sparse_find_page(addr / SPARSE_PAGE_SIZE, false);
+        if (data)
+            memcpy(out, data + offset, chunk);
+        else
+            memset(out, 0, chunk);
+        out += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+}
+
+/* Write len bytes at emulated address addr, materializing pages as needed */
+static void sparse_write_bytes(uintptr_t addr, const void *buf, size_t len) {
+    const unsigned char *in = buf;
+    while (len > 0) {
+        size_t offset = addr % SPARSE_PAGE_SIZE;
+        size_t chunk = SPARSE_PAGE_SIZE - offset;
+        if (chunk > len)
+            chunk = len;
+        unsigned char *data = sparse_find_page(addr / SPARSE_PAGE_SIZE, true);
+        memcpy(data + offset, in, chunk);
+        in += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * sparse_pages_in_range - collect the numbers of the materialized pages
+ *      overlapping [lo, lo+len) into a malloc'd array.  Walks the range when
+ *      it spans fewer pages than are materialized, and scans the hash table
+ *      otherwise, so huge ranges cost time proportional to the pages in use.
+ *      Returns the number of pages found.
+ */
+static size_t sparse_pages_in_range(uintptr_t lo, size_t len, uintptr_t **pagenos) {
+    size_t n = 0;
+    *pagenos = NULL;
+    if (len == 0 || page_count == 0)
+        return 0;
+
+    uintptr_t first = lo / SPARSE_PAGE_SIZE;
+    uintptr_t last = (lo + len - 1) / SPARSE_PAGE_SIZE;
+    size_t span = last - first + 1;
+    size_t cap = span < page_count ? span : page_count;
+    if ((*pagenos = malloc(cap * sizeof(uintptr_t))) == NULL) {
+        fprintf(stderr, "FAILURE.  couldn't allocate sparse page list\n");
+        exit(1);
+    }
+
+    if (span <= page_count) {
+        uintptr_t pageno;
+        for (pageno = first; pageno <= last; pageno++) {
+            if (sparse_find_page(pageno, false))
+                (*pagenos)[n++] = pageno;
+        }
+    } else {
+        size_t b;
+        for (b = 0; b < table_size; b++) {
+            sparse_page_t *p;
+            for (p = page_table[b]; p != NULL; p = p->next) {
+                if (p->pageno >= first && p->pageno <= last)
+                    (*pagenos)[n++] = p->pageno;
+            }
+        }
+    }
+    return n;
+}
@@ -2,7 +2,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void mem_init();               
+void mem_init(bool sparse_mode);
+bool mem_init_file(const char *path);
+bool mem_init_shared(const char *name);
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
@@ -11,6 +13,22 @@ void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
 
+/* Additional heap regions, e.g. one per NUMA node.  Region 0 is the main heap */
+int mem_region_new(int node);
+int mem_region_count(void);
+bool mem_region_bind(int region, int node);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+void *mem_region_max(int region);
+size_t mem_region_size(int region);
+int mem_numa_node(void);
+
+/* Select huge page backing (see HUGE_PAGE_MODE); takes effect at next mem_init */
+void mem_set_huge_pages(int mode);
+/* Returns the huge page size if the heap is backed by huge pages, else 0 */
+size_t mem_hugepagesize(void);
+
 /* Read len bytes and return value zero-extended to 64 bits */
 /* Require 0 <= len <= 8 */
 uint64_t mem_read(const void *addr, size_t len);
@@ -18,3 +36,26 @@ uint64_t mem_read(const void *addr, size_t len);
 /* Write lower order len bytes of val to address */
 /* Require 0 <= len <= 8 */
 void mem_write(void *addr, uint64_t val, size_t len);
+
+/* Copy and fill ranges of heap memory; needed to access an emulated sparse heap */
+void mem_memcpy(void *dst, const void *src, size_t len);
+void mem_memset(void *dst, int c, size_t len);
+
+/* Copy len bytes out of the heap at src, or into the heap at dst */
+void mem_load(void *buf, const void *src, size_t len);
+void mem_store(void *dst, const void *buf, size_t len);
+
+/* Move whole pages within the heap by remapping them; false if not possible.
+   *parked is then NULL, or where the pages of src were left if they could be
+   moved out but not put in place: copy them and free them with mem_unpark */
+bool mem_remap(void *dst, void *src, size_t len, void **parked);
+void mem_unpark(void *parked, size_t len);
+
+/* Main heap backed by a file (mem_init_file), and writing it back */
+bool mem_persistent(void);
+bool mem_sync(void);
+/* Main heap shared between processes (mem_init_shared) */
+bool mem_shared(void);
+
+/* Revoke or restore access to whole pages of the heap; false if not possible */
+bool mem_protect(void *addr, size_t len, bool accessible);
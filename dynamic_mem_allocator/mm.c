@@ -63,9 +63,17 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stddef.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/single_threaded.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "policy.h"
 
 #ifdef DRIVER
 /* create aliases for driver tests */
@@ -73,6 +81,12 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
@@ -98,21 +112,29 @@
 #define dbg_ensures(...)
 #endif
 
-/* Extra macros */
-#define seg_list_size 11 // size of segregated list for block sizes > 16 bytes
-#define nth_fit 25		 // implementing 25th fit
+/* Extra macros; the allocation policy (seg_list_size, nth_fit) is in policy.h */
+#define max_arenas 8	 // at most one arena per NUMA node, up to this many
+#define remote_free_batch 64 // drain remote frees from free() past this many
+#define map_rows 16		 // rows of the occupancy map printed by mm_heapmap
+#define map_max_width 128 // cells per row of the occupancy map, at most
+#define remap_min_size (1 << 18) // realloc moves payloads this big by remapping pages
+#define guard_delay 1024  // freed page runs stay inaccessible for this many frees (GUARD_PAGES)
+#define guard_classes 16  // reusable page runs are listed by length up to this many pages
+#define quarantine_check_max 4096 // bytes of each quarantined payload that are poisoned
+#define quarantine_slots 4096 // freed blocks each arena holds in quarantine, at most
 
 /* Basic constants */
 typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);				 // word and header size (bytes)
 static const size_t dsize = 2 * sizeof(word_t);			 // double word size (bytes)
 static const size_t min_block_size = 2 * sizeof(word_t); // Minimum block size
-static const size_t chunksize = (1 << 12);				 // requires (chunksize % 16 == 0), minimum heap size to expand by
+static const size_t chunksize = chunk_bytes;			 // requires (chunksize % 16 == 0), minimum heap size to expand by
 
 static const word_t alloc_mask = 0x1;
 static const word_t size_mask = ~(word_t)0xF;
 static const word_t prev_alloc_mask = 0x2;
 static const word_t prev_sseg_mask = 0x4;
+static const word_t quarantine_poison = 0xdbdbdbdbdbdbdbdb; // fill of quarantined payloads
 
 typedef struct block block_t;
 
@@ -141,6 +163,7 @@ struct block
 	 * 	2. Blocks in seg_list (total size>16 bytes):
 	 *		next_free pointer (8 bytes)
 	 * 		prev_free pointer (8 bytes)
+	 *  (the pointers are stored relative to the block, see make_link)
 	 * Allocated blocks:
 	 * 	payload only
 	 */
@@ -158,24 +181,166 @@ struct block
      */
 };
 
-/* Global variables 8+11*8+8=104 bytes */
-/* Pointer to first block */
-static block_t *heap_start = NULL;
-/* Pointer to the root of the segregated list for block sizes > 16 bytes */
-static block_t *seg_list[seg_list_size];
-/* Pointer to the root of the list for small sized blocks */
-static block_t *small_seg_list = NULL;
+/*
+ * An arena is an independent heap in its own memlib region, with its own
+ * segregated lists.  Arena 0 is the main heap set up by mm_init and is the
+ * only one used by a single-threaded program.  Once the program starts
+ * threads, each thread allocates from the arena of the NUMA node it first
+ * ran on, whose region is bound to that node's memory.  Threads of the same
+ * node share the arena under its lock; blocks freed by threads of another
+ * node are pushed on remote_free without taking that lock and are given
+ * back in batches by the owner.
+ */
+typedef struct arena arena_t;
+
+struct arena
+{
+	/* Pointer to first block */
+	block_t *heap_start;
+	/* Pointer to the root of the segregated list for block sizes > 16 bytes */
+	block_t *seg_list[seg_list_size];
+	/* Pointer to the root of the list for small sized blocks */
+	block_t *small_seg_list;
+
+	int region;			   // memlib region holding the heap
+	int node;			   // NUMA node the region is bound to
+	char *lo;			   // [lo, max) contains every block of the arena
+	char *max;
+	pthread_mutex_t lock;  // serializes the threads of the node
+
+	block_t *remote_free;  // lock-free stack of blocks freed by other nodes
+	int remote_count;	   // number of blocks pushed since the last drain
+
+	block_t *quarantine[quarantine_slots]; // freed blocks in quarantine, oldest first from quarantine_head
+	int quarantine_head;
+	int quarantine_count;
+	size_t quarantine_bytes;  // total size of the blocks in quarantine
+};
+
+/*
+ * Quarantine: while quarantine_budget is set by mm_set_quarantine, freed
+ * blocks are not given back right away. They stay allocated in a ring of
+ * up to quarantine_slots blocks per arena, kept outside the heap so that
+ * no link lives in a payload, with the first quarantine_check_max bytes of
+ * their payloads filled with quarantine_poison. Once the blocks in
+ * quarantine add up to more than the budget, or the ring is full, the
+ * oldest ones are checked to still hold the poison, which any write by
+ * the program after free would have broken, and only then freed. libmm.so
+ * takes the budget from the MM_QUARANTINE environment variable.
+ */
+static size_t quarantine_budget = 0;
+
+/*
+ * A main heap backed by a file (see mem_init_file) starts with a
+ * heap_root_t, from which a later process that maps the file can take up
+ * the heap again with mm_resume. It holds the state of the main arena as
+ * offsets from the start of the region, with 0 for NULL, just as the links
+ * in the free blocks are relative (see make_link), so the file may be
+ * mapped anywhere. The lists are only written to it by mm_sync, and clean
+ * tells whether the heap has been changed since.
+ *
+ * A heap shared between processes (see mem_init_shared) has a root too,
+ * through which the processes pass the main arena to each other: each one
+ * holds the robust, process-shared lock in the root while it uses the
+ * arena, loads the lists from the root as it takes the lock and stores
+ * them back before releasing it (see arena_lock).
+ */
+typedef struct
+{
+	word_t magic;	   // heap_root_magic once the heap has been set up
+	word_t classes;	   // seg_list_size of the policy that built the heap
+	word_t clean;	   // set by mm_sync, cleared by the next malloc or free
+	word_t heap_size;  // bytes of the region in use
+	word_t heap_start; // offsets of the blocks in the main arena
+	word_t small_seg_list;
+	word_t seg_list[seg_list_size];
+	word_t root;	   // set by mm_set_root
+	word_t shared;	   // set if lock has been set up for a shared heap
+	pthread_mutex_t lock;
+} heap_root_t;
+
+static const word_t heap_root_magic = 0x746f6f7270616568; // "heaproot"
+/* Root of the main heap if it is backed by a file, and NULL otherwise */
+static heap_root_t *heap_root = NULL;
+/* Is the main arena shared with other processes through heap_root? */
+static bool heap_shared = false;
+
+/* Global variables */
+static arena_t arenas[max_arenas];
+static int num_arenas = 0;
+/* Protects creation of arenas */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Arena used by the current thread once it has allocated, until mm_init
+   bumps arenas_epoch past the epoch it was taken in */
+static __thread arena_t *thread_arena = NULL;
+static __thread int thread_arena_epoch = 0;
+static int arenas_epoch = 1;
+/* If set, threads take arenas of this many made-up nodes in turn (see
+   mm_set_arena_nodes) */
+static int arena_nodes = 0;
+static int arena_next_node = 0;
+
+#ifdef GUARD_PAGES
+#if SPARSE_MODE
+#error "GUARD_PAGES needs a dense heap with real pages to protect"
+#endif
+/*
+ * Guard page mode (built with -DGUARD_PAGES, as in mdriver-guard) replaces
+ * the arenas with an electric-fence style allocator for hunting memory
+ * errors. Every allocation gets its own run of pages in the main region,
+ * followed by a guard page that is never accessible, and its payload is
+ * placed at the end of the run so that overrunning it faults at once.
+ * Payloads stay 16-byte aligned, so an overrun is only caught at the exact
+ * byte when the size is a multiple of 16; otherwise it first runs through
+ * up to 15 bytes of padding. The size and length of the run are kept in
+ * the 16 bytes before the payload, scrambled with guard_magic so that free
+ * rejects pointers it did not hand out.
+ *
+ * A freed run is made inaccessible as well, so that a use after free or a
+ * double free faults, and waits in guard_fifo until guard_delay later frees
+ * have happened before it is made accessible again and listed for reuse.
+ * Every allocation costs at least two pages and an mprotect call, so this
+ * is for debugging only; the regular builds contain none of it.
+ */
+typedef struct guard_run guard_run_t;
+
+struct guard_run
+{
+	guard_run_t *next; // next reusable run in the same list
+	size_t pages;	   // length of the run, not counting its guard page
+};
+
+static const word_t guard_magic = 0x9e3779b97f4a7c15;
+
+static bool guard_ready = false;
+/* Freed runs waiting to be reused, oldest first starting at guard_fifo_head */
+static char *guard_fifo[guard_delay];
+static size_t guard_fifo_pages[guard_delay];
+static int guard_fifo_head = 0;
+static int guard_fifo_count = 0;
+/* Reusable runs by length; longer runs all share the last list */
+static guard_run_t *guard_lists[guard_classes];
+/* Allocated runs: their number, total length in pages and payload bytes */
+static size_t guard_live_runs = 0;
+static size_t guard_live_pages = 0;
+static size_t guard_live_bytes = 0;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 bool mm_checkheap(int lineno);
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
-static block_t *coalesce(block_t *block);
+static block_t *extend_heap(arena_t *arena, size_t size);
+static void place(arena_t *arena, block_t *block, size_t asize);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static block_t *coalesce(arena_t *arena, block_t *block);
+static void free_block(arena_t *arena, block_t *block);
+static void *malloc_congruent(size_t size, const void *ptr, size_t page);
+static block_t *split_lead(arena_t *arena, block_t *block, size_t lead);
 
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
+static bool too_large(size_t size, size_t slack);
 static word_t pack(size_t size, bool alloc);
 
 static size_t extract_size(word_t header);
@@ -198,12 +363,86 @@ static block_t *find_prev(block_t *block);
 /* Extra helper functions */
 static block_t *find_prev_free(block_t *block);
 static block_t *find_next_free(block_t *block);
-static void insert_freeblock(block_t *block);
-static void remove_freeblock(block_t *block);
+static void insert_freeblock(arena_t *arena, block_t *block);
+static void remove_freeblock(arena_t *arena, block_t *block);
 static size_t get_prev_alloc(block_t *block);
 static size_t get_prev_sseg(block_t *block);
 static int get_seg_list(size_t size);
 
+#if MM_POLICY == MM_POLICY_CTREE
+/* Cartesian tree of free blocks */
+static void tree_insert(arena_t *arena, block_t *block);
+static void tree_remove(arena_t *arena, block_t *block);
+static block_t *tree_fit(arena_t *arena, size_t asize);
+static bool tree_check(block_t *node, block_t *lo, block_t *hi, size_t max_size);
+static bool tree_contains(arena_t *arena, block_t *block);
+static block_t *tree_child(block_t *node, bool right);
+static void set_tree_child(arena_t *arena, block_t *parent, bool right, block_t *child);
+#endif
+
+/* Arena management */
+static void arenas_reset(void);
+static void heap_init(void);
+#ifndef DRIVER
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+#endif
+static bool arena_init_heap(arena_t *arena);
+static arena_t *arena_create(int region, int node);
+static arena_t *get_thread_arena(void);
+static arena_t *find_arena(block_t *block);
+static bool arena_lock(arena_t *arena);
+static void arena_unlock(arena_t *arena, bool locked);
+static bool arena_lock_shared(arena_t *arena);
+static void remote_free_push(arena_t *arena, block_t *block);
+static void remote_free_drain(arena_t *arena);
+static bool check_arena(arena_t *arena);
+
+/* Persistent heaps */
+static word_t root_offset(const void *ptr);
+static void *root_pointer(word_t offset);
+static void root_load(arena_t *arena);
+static void root_store(arena_t *arena);
+static void shared_lock(void);
+
+/* Quarantine */
+static void retire_block(arena_t *arena, block_t *block);
+static void quarantine_push(arena_t *arena, block_t *block);
+static void quarantine_evict(arena_t *arena);
+
+/* Heap analysis */
+static void arena_heapinfo(arena_t *arena, mm_heapinfo_t *info);
+static void arena_heapmap(FILE *out, arena_t *arena, int width);
+
+#ifdef GUARD_PAGES
+/* Guard page mode */
+static void guard_init(void);
+static void *guard_malloc(size_t size);
+static void guard_free(void *bp);
+static void *guard_realloc(void *ptr, size_t size);
+static char *guard_find_run(void *bp, size_t *pages, size_t *size);
+static char *guard_take_run(size_t *pages);
+static bool guard_check(void);
+static void guard_heapinfo(mm_heapinfo_t *info);
+#endif
+
+/* Heap memory access helpers */
+static word_t load_word(const void *addr);
+static void store_word(void *addr, word_t val);
+static void set_header_bits(block_t *block, word_t mask);
+static void clear_header_bits(block_t *block, word_t mask);
+static void set_next_free(block_t *block, block_t *next);
+static void set_prev_free(block_t *block, block_t *prev);
+static word_t make_link(block_t *block, block_t *target);
+static block_t *follow_link(block_t *block, word_t link);
+static void copy_payload(void *dst, const void *src, size_t n);
+static void zero_payload(void *dst, size_t n);
+static void poison_payload(void *dst, size_t n);
+static void move_payload(void *dst, void *src, size_t n, size_t page);
+static void move_pages(char *dst, char *src, size_t len, size_t page);
+static void stream_copy(void *dst, const void *src, size_t n);
+
 void print_seg_list(void);
 void print_small_seg_list(void);
 void print_heap(void);
@@ -215,18 +454,22 @@ void print_heap(void);
  */
 void print_seg_list(void)
 {
-	dbg_printf("seg_list:\n");
 	block_t *block;
 	unsigned int count = 1;
 	int index;
-	for (index = 0; index < seg_list_size; index++)
+	arena_t *a;
+	for (a = arenas; a < arenas + num_arenas; a++)
 	{
-		dbg_printf("index %d:\n", index);
-		count = 1;
-		for (block = seg_list[index]; block != NULL; block = find_next_free(block))
+		dbg_printf("seg_list (arena %d):\n", (int)(a - arenas));
+		for (index = 0; index < seg_list_size; index++)
 		{
-			dbg_printf("  block %u at %p \n", count, block);
-			count += 1;
+			dbg_printf("index %d:\n", index);
+			count = 1;
+			for (block = a->seg_list[index]; block != NULL; block = find_next_free(block))
+			{
+				dbg_printf("  block %u at %p \n", count, block);
+				count += 1;
+			}
 		}
 	}
 
@@ -239,13 +482,18 @@ void print_seg_list(void)
  */
 void print_small_seg_list(void)
 {
-	dbg_printf("small_seg_list:\n");
 	block_t *block;
-	unsigned int count = 1;
-	for (block = small_seg_list; block != NULL; block = find_next_free(block))
+	unsigned int count;
+	arena_t *a;
+	for (a = arenas; a < arenas + num_arenas; a++)
 	{
-		dbg_printf("  block %u at %p \n", count, block);
-		count += 1;
+		dbg_printf("small_seg_list (arena %d):\n", (int)(a - arenas));
+		count = 1;
+		for (block = a->small_seg_list; block != NULL; block = find_next_free(block))
+		{
+			dbg_printf("  block %u at %p \n", count, block);
+			count += 1;
+		}
 	}
 	dbg_printf(" \n");
 }
@@ -256,115 +504,101 @@ void print_small_seg_list(void)
  */
 void print_heap(void)
 {
-	dbg_printf("heap blocks:\n");
 	block_t *block;
 	unsigned int count;
-	count = 0;
-	dbg_printf("   --Heap start at %p-- \n", mem_heap_lo());
-	for (block = heap_start; get_size(block) > 0; block = find_next(block))
+	arena_t *a;
+	for (a = arenas; a < arenas + num_arenas; a++)
 	{
-		dbg_printf("   Heap block %u at %p %s (size=%zu)  \n", count, block, get_alloc(block) ? "allocated" : "free", get_size(block));
-		count += 1;
+		if (a->heap_start == NULL)
+		{
+			continue;
+		}
+		dbg_printf("heap blocks (arena %d):\n", (int)(a - arenas));
+		count = 0;
+		dbg_printf("   --Heap start at %p-- \n", mem_region_lo(a->region));
+		for (block = a->heap_start; get_size(block) > 0; block = find_next(block))
+		{
+			dbg_printf("   Heap block %u at %p %s (size=%zu)  \n", count, block, get_alloc(block) ? "allocated" : "free", get_size(block));
+			count += 1;
+		}
+		dbg_printf("   --Heap end at %p-- \n\n", mem_region_hi(a->region));
 	}
-	dbg_printf("   --Heap end at %p-- \n\n", mem_heap_hi());
 }
 
 /* 
  * get_seg_list: given the size needed to allocate, return which size class it 
- * 				 belongs to. One class for each larger size: [(2^i)+1, 2^(i+1)].
+ * 				 belongs to, as defined by the policy in policy.h.
  */
 static int get_seg_list(size_t size)
 {
-	if ((size > 16) && (size <= 32))
-	{
-		return 0;
-	}
-	else if ((size > 32) && (size <= 64))
-	{
-		return 1;
-	}
-	else if ((size > 64) && (size <= 128))
-	{
-		return 2;
-	}
-	else if ((size > 128) && (size <= 256))
-	{
-		return 3;
-	}
-	else if ((size > 256) && (size <= 512))
-	{
-		return 4;
-	}
-	else if ((size > 512) && (size <= 1024))
-	{
-		return 5;
-	}
-	else if ((size > 1024) && (size <= 2048))
-	{
-		return 6;
-	}
-	else if ((size > 2048) && (size <= 4098))
-	{
-		return 7;
-	}
-	else if ((size > 4098) && (size <= 8192))
-	{
-		return 8;
-	}
-	else if ((size > 8192) && (size <= 16384))
-	{
-		return 9;
-	}
-	else if (size > 16384)
-	{
-		return 10;
-	}
-	else
+	int class = policy_size_class(size);
+	if (class < 0)
 	{
 		dbg_printf("\nSmall block encountered!\n");
-		return -1;
 	}
+	return class;
 }
 
 /*
  * mm_init: at the start of the program when the heap is originally empty, call
  * 			this function to perform any necessary initializations such as
- * 			allocating the initial heap area, and initializing seg_list and
- * 			small_seg_list. 
- * 			Returns -1 if there is a problem during initialization, and returns
- * 			0 otherwise.
+ * 			allocating the initial heap area of the main arena, and 
+ * 			initializing seg_list and small_seg_list. The heaps of any other
+ * 			arenas are discarded and rebuilt when their node next allocates.
+ * 			Returns false if there is a problem during initialization, and
+ * 			returns true otherwise.
  */
 bool mm_init(void)
 {
 	dbg_printf("\n----------------------------------INIT------------------------------------\n");
-	// Create the initial empty heap
-	word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-	if (start == (void *)-1)
+#ifdef GUARD_PAGES
+	pthread_mutex_lock(&guard_lock);
+	guard_init();
+	pthread_mutex_unlock(&guard_lock);
+	return true;
+#endif
+	if (num_arenas == 0)
 	{
-		return false;
+		arena_create(0, mem_numa_node());
+		mem_region_bind(0, arenas[0].node);
 	}
+	arenas_reset();
 
-	start[0] = pack(0, true);	 // Prologue footer
-	start[1] = pack(0, true);	 // Epilogue header
-	start[1] |= prev_alloc_mask; // set previous alloc bit
-
-	// Heap starts with first "block header", currently the epilogue footer
-	heap_start = (block_t *)&(start[1]);
-
-	int ite;
-	// initialize seg_list and small_seg_list
-	small_seg_list = NULL;
-	for (ite = 0; ite < seg_list_size; ite++)
+	// A file-backed or shared heap starts with its root
+	heap_root = NULL;
+	heap_shared = false;
+	if (mem_persistent())
 	{
-		seg_list[ite] = NULL;
+		heap_root_t *root = mem_sbrk((intptr_t)round_up(sizeof(heap_root_t), dsize));
+		if (root == (void *)-1)
+		{
+			return false;
+		}
+		memset(root, 0, sizeof(*root));
+		root->magic = heap_root_magic;
+		root->classes = seg_list_size;
+		if (mem_shared())
+		{
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&root->lock, &attr);
+			pthread_mutexattr_destroy(&attr);
+			root->shared = 1;
+		}
+		heap_root = root;
 	}
 
-	// Extend the empty heap with a free block of chunksize bytes
-	if ((extend_heap(chunksize)) == NULL)
+	if (!arena_init_heap(&arenas[0]))
 	{
 		return false;
 	}
+	if (mem_shared())
+	{
+		root_store(&arenas[0]);
+		heap_shared = true;
+	}
 
 	dbg_printf("\n------------------------------FINISHED INIT----------------------------------\n");
 	return true;
@@ -374,8 +608,8 @@ bool mm_init(void)
  * malloc: given the size to allocate on the heap by the user, the malloc routine
  * 		   adjusts the given size to conform to the alignment policy of 16 bytes
  * 		   and the minimum block size of 16 bytes. Then malloc searches the
- * 		   appropriate list for a fit. If no fit is found, request more memory,
- * 		   and then and place the block. 
+ * 		   appropriate list of the caller's arena for a fit. If no fit is found, 
+ * 		   request more memory, and then and place the block. 
  * 		   Returns a pointer to an allocated block payload with the user 
  * 		   designated size.
  */
@@ -387,36 +621,66 @@ void *malloc(size_t size)
 	size_t extendsize; // Amount to extend heap if no fit is found
 	block_t *block;
 	void *bp = NULL;
+	arena_t *arena;
+	bool locked;
+
+#ifdef GUARD_PAGES
+	return guard_malloc(size);
+#endif
 
-	if (heap_start == NULL) // Initialize heap if it isn't initialized
+	if (too_large(size, 0)) // the block size would wrap around
 	{
-		mm_init();
+		return bp;
+	}
+
+	if (arenas[0].heap_start == NULL) // Initialize heap if it isn't initialized
+	{
+		heap_init();
 	}
 
 	if (size == 0) // Ignore spurious request
 	{
+#ifdef DRIVER
 		dbg_ensures(mm_checkheap(__LINE__));
 		return bp;
+#else
+		size = 1; // programs expect a pointer they can free, as from the C library
+#endif
+	}
+
+	arena = get_thread_arena();
+	locked = arena_lock(arena);
+	if (heap_root != NULL)
+	{
+		heap_root->clean = 0;
+	}
+	if (arena->heap_start == NULL && !arena_init_heap(arena))
+	{
+		arena_unlock(arena, locked);
+		return bp;
 	}
+	remote_free_drain(arena);
 
 	asize = round_up(size + wsize, dsize);
 
 	// Search the appropriate list for a fit
-	block = find_fit(asize);
+	block = find_fit(arena, asize);
 
 	// If no fit is found, request more memory, and then and place the block
 	if (block == NULL)
 	{
 		extendsize = max(asize, chunksize);
 		dbg_printf("\nextend_heap called in malloc at line: %d   expand by size: %zu\n", __LINE__, extendsize);
-		block = extend_heap(extendsize);
+		block = extend_heap(arena, extendsize);
 		if (block == NULL) // extend_heap returns an error
 		{
+			arena_unlock(arena, locked);
 			return bp;
 		}
 	}
 
-	place(block, asize);
+	place(arena, block, asize);
+	arena_unlock(arena, locked);
 	bp = header_to_payload(block);
 
 	dbg_printf("\nMalloc size %zd on (payload) address %p \n", size, bp);
@@ -426,11 +690,10 @@ void *malloc(size_t size)
 }
 
 /*
- * free: the free routine frees the block pointed to by bp that it writes the
- * 		 appropriate header and footer with the prev_alloc and prev_sseg status
- * 		 of the block pointed to by bp. Then free zeroes out the prev_alloc bit
- * 		 of the current block's successor. Lastly, it calls coalesce on the 
- * 		 current block to merge any free neighbors. Note this routine is only
+ * free: the free routine returns the block pointed to by bp to the arena
+ * 		 that owns it. If the caller runs on another NUMA node than the owner,
+ * 		 the block is queued for the owner to free later; otherwise it is
+ * 		 freed right away by free_block. Note this routine is only
  * 		 guaranteed to work when the passed pointer bp was returned by an earlier
  * 		 call to malloc, calloc, or realloc and has not yet been freed. 
  * 		 Returns nothing.
@@ -444,8 +707,43 @@ void free(void *bp)
 		return;
 	}
 
+#ifdef GUARD_PAGES
+	guard_free(bp);
+	return;
+#endif
+
 	block_t *block = payload_to_header(bp);
 	dbg_printf("At: %p\n", block);
+	arena_t *arena = find_arena(block);
+
+	if (!__libc_single_threaded && arena != get_thread_arena())
+	{
+		remote_free_push(arena, block);
+		return;
+	}
+
+	bool locked = arena_lock(arena);
+	if (heap_root != NULL)
+	{
+		heap_root->clean = 0;
+	}
+	retire_block(arena, block);
+	if (locked && __atomic_load_n(&arena->remote_count, __ATOMIC_RELAXED) >= remote_free_batch)
+	{
+		remote_free_drain(arena);
+	}
+	arena_unlock(arena, locked);
+	dbg_printf("\n-------------------------------FINISHED FREE---------------------------------\n");
+}
+
+/*
+ * free_block: writes the appropriate header and footer with the prev_alloc
+ * 		 and prev_sseg status of the block. Then it zeroes out the prev_alloc
+ * 		 bit of the current block's successor. Lastly, it calls coalesce on the 
+ * 		 current block to merge any free neighbors. Requires the arena lock.
+ */
+static void free_block(arena_t *arena, block_t *block)
+{
 	size_t size = get_size(block);
 
 	// get the prev_alloc and prev_sseg status of the block
@@ -456,10 +754,9 @@ void free(void *bp)
 
 	write_header(block, size, false);
 	write_footer(block, size, false);
-	find_next(block)->header &= (~prev_alloc_mask); // zero out prev_alloc bit of the successor
+	clear_header_bits(find_next(block), prev_alloc_mask); // zero out prev_alloc bit of the successor
 
-	coalesce(block);
-	dbg_printf("\n-------------------------------FINISHED FREE---------------------------------\n");
+	coalesce(arena, block);
 }
 
 /*
@@ -472,14 +769,22 @@ void free(void *bp)
  * 			   untouched. Otherwise, copy the old data into the new block, 
  * 		       and call free(ptr) afterwards. Lastly, it returns the pointer
  * 			   pointing to the newly allocated block.
+ * 			Payloads of at least remap_min_size bytes are not copied: the new
+ * 			block is placed at the same offset within a page as the old one,
+ * 			so that the whole pages in between can be moved by remapping.
  */
 void *realloc(void *ptr, size_t size)
 {
 	dbg_printf("\n---------------------------------REALLOC----------------------------------------");
 	block_t *block = payload_to_header(ptr);
-	size_t copysize;
+	size_t copysize, page;
+	bool remap;
 	void *newptr;
 
+#ifdef GUARD_PAGES
+	return guard_realloc(ptr, size);
+#endif
+
 	// If size == 0, then free block and return NULL
 	if (size == 0)
 	{
@@ -493,21 +798,51 @@ void *realloc(void *ptr, size_t size)
 		return malloc(size);
 	}
 
+	copysize = get_payload_size(block); // gets size of old payload
+	if (size < copysize)
+	{
+		copysize = size;
+	}
+
+	// Huge page backed heaps are remapped a huge page at a time, so that
+	// the pages are moved without being split
+	page = mem_hugepagesize();
+	if (page == 0)
+	{
+		page = mem_pagesize();
+	}
+#if SPARSE_MODE
+	remap = false; // an emulated heap has no pages to move
+#else
+	// a file-backed heap keeps its contents at their file offsets, so its
+	// pages cannot be moved
+	remap = copysize >= max(remap_min_size, 2 * page) && heap_root == NULL;
+#endif
+
 	// Otherwise, proceed with reallocation
-	newptr = malloc(size);
+	if (remap)
+	{
+		newptr = malloc_congruent(size, ptr, page);
+	}
+	else
+	{
+		newptr = malloc(size);
+	}
 	// If malloc fails, the original block is left untouched
 	if (newptr == NULL)
 	{
 		return NULL;
 	}
 
-	// Copy the old data
-	copysize = get_payload_size(block); // gets size of old payload
-	if (size < copysize)
+	// Move the old data
+	if (remap)
 	{
-		copysize = size;
+		move_payload(newptr, ptr, copysize, page);
+	}
+	else
+	{
+		copy_payload(newptr, ptr, copysize);
 	}
-	memcpy(newptr, ptr, copysize);
 
 	// Free the old block
 	free(ptr);
@@ -527,7 +862,7 @@ void *calloc(size_t elements, size_t size)
 	void *bp;
 	size_t asize = elements * size;
 
-	if (asize / elements != size)
+	if (elements != 0 && asize / elements != size)
 	{
 		// Multiplication overflowed
 		return NULL;
@@ -539,542 +874,2121 @@ void *calloc(size_t elements, size_t size)
 		return NULL;
 	}
 	// Initialize all bits to 0
-	memset(bp, 0, asize);
+	zero_payload(bp, asize);
 	dbg_printf("\n--------------------------------FINISHED CALLOC--------------------------------\n");
 	return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
+/*
+ * memalign: allocates a block whose payload is aligned to alignment bytes,
+ * 			 which must be a power of two. Alignments up to 16 bytes are
+ * 			 those of malloc; larger ones take a congruent block (see
+ * 			 malloc_congruent) from the caller's arena. Returns NULL with
+ * 			 errno set if the alignment is invalid or there is no memory.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (alignment <= dsize)
+	{
+		return malloc(size);
+	}
+#ifdef GUARD_PAGES
+	errno = EINVAL; // guarded payloads sit at the end of their pages
+	return NULL;
+#endif
+	if (arenas[0].heap_start == NULL)
+	{
+		heap_init();
+	}
+	if (size + alignment < size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return malloc_congruent(max(size, 1), NULL, alignment);
+}
 
 /*
- * extend_heap: extends the heap size by size and rounds up size to meet the 
- * 				alignment of 16 bytes. Then it initializes the or afterwards.iginal
- * 				epilogue to be a free block and creates new epilogue header. 
- * 				Lastly it calls coalesce. 
- * 				Returns NULL if mem_sbrk fails. Otherwise, returns coalesce(block).
+ * posix_memalign, aligned_alloc, valloc, pvalloc: the other aligned
+ * 			 allocation functions of the C library, in terms of memalign.
  */
-static block_t *extend_heap(size_t size)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
+	int saved = errno, error;
 	void *bp;
-	block_t *epilogue;
-	size_t prev_alloc, prev_sseg;
-
-	// save prev_alloc and prev_sseg flags of the current epilogue (end block)
-	// before extending heap
-	epilogue = (block_t *)((char *)mem_heap_hi() - 7);
-	prev_alloc = get_prev_alloc(epilogue);
-	prev_sseg = get_prev_sseg(epilogue);
 
-	// Allocate an even number of words to maintain alignment
-	size = round_up(size, dsize);
-	if ((bp = mem_sbrk(size)) == (void *)-1)
+	if (alignment % sizeof(void *) != 0)
 	{
-		return NULL;
+		return EINVAL;
 	}
+	bp = memalign(alignment, size);
+	if (bp == NULL)
+	{
+		error = errno; // posix_memalign returns the error, leaving errno alone
+		errno = saved;
+		return error;
+	}
+	*memptr = bp;
+	return 0;
+}
 
-	// Initialize free block header/footer
-	block_t *block = payload_to_header(bp);
-	// inherit the prev_alloc and prev_sseg status of the original epilogue header
-	size |= prev_alloc;
-	size |= prev_sseg;
-	write_header(block, size, false);
-	write_footer(block, size, false);
-
-	// Create new epilogue header
-	block_t *block_next = find_next(block);
-	block_next->header = 0;
-	write_header(block_next, 0, true);
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
 
-	// Coalesce in case the previous block was free
+void *valloc(size_t size)
+{
+	return memalign(mem_pagesize(), size);
+}
 
-	return coalesce(block);
+void *pvalloc(size_t size)
+{
+	if (too_large(size, mem_pagesize()))
+	{
+		return NULL;
+	}
+	return memalign(mem_pagesize(), round_up(max(size, 1), mem_pagesize()));
 }
 
 /*
- * remove_freeblock: removes the free block from its corresponding seg_list 
- * 			 		 or small_seg_list, and sets up the next and prev pointers
- * 					 appropriately.
+ * malloc_usable_size: returns the number of bytes that can be used in the
+ * 			 payload at bp, which may be more than were asked for, or 0 if
+ * 			 bp is NULL.
  */
-static void remove_freeblock(block_t *block)
+size_t malloc_usable_size(void *bp)
 {
-	block_t *prev_free, *next_free;
-
-	size_t size = get_size(block);
-	if (block)
+	if (bp == NULL)
 	{
-		if (size <= min_block_size) // block belongs to small_seg_list
-		{
-			block_t *b;
-			// traverse small_seg_list to find the target block
-			for (b = small_seg_list; b != NULL; b = find_next_free(b))
-			{
-				if (b == block)
-				{
-					if (b == small_seg_list)
-					{ // block is the root of small_seg_list
-						small_seg_list = find_next_free(b); // set the successor to be the root
-					}
-					else
-					{	// link prev_free to next_free
-						prev_free->data.pointers.next = find_next_free(b);
-					}
-					return;
-				}
-				prev_free = b; // need to keep track of prev_free since small_seg_list is a singly linkedlist
-			}
-		}
-		else // block belongs to seg_list
-		{
-			int seg_list_index = get_seg_list(size);
-			prev_free = find_prev_free(block);
-			next_free = find_next_free(block);
-			if (!prev_free && !next_free)
-			{ // root of free list && current block is the only element in seg_list
-				seg_list[seg_list_index] = NULL;
-			}
-			else if (prev_free && !next_free)
-			{ // end of free list
-				prev_free->data.pointers.next = NULL;  // prev_free becomes the new end
-				block->data.pointers.prev = NULL;
-			}
-			else if (!prev_free && next_free)
-			{ // root of free list
-				next_free->data.pointers.prev = NULL;  // next_free becomes the new root
-				block->data.pointers.next = NULL;
-				seg_list[seg_list_index] = next_free;
-			}
-			else
-			{
-				prev_free->data.pointers.next = next_free;	// link prev_free and next_free
-				next_free->data.pointers.prev = prev_free;
-			}
-			return;
-		}
+		return 0;
 	}
+#ifdef GUARD_PAGES
+	size_t pages, size;
+	return guard_find_run(bp, &pages, &size) != NULL ? size : 0;
+#endif
+	return get_payload_size(payload_to_header(bp));
 }
 
 /*
- * insert_freeblock: inserts the free block into its corresponding seg_list 
- * 			 		 or small_seg_list with LIFO policy, and sets up the next 
- * 					 and prev pointers appropriately. 
+ * mm_resume: takes up the heap that mm_sync left in the file backing the
+ * 			  main heap (see mem_init_file), instead of starting an empty
+ * 			  heap with mm_init. Every block allocated at the time of the
+ * 			  sync is still allocated, with its contents, although at
+ * 			  another address if the file is mapped elsewhere; pointers that
+ * 			  the program stored in its blocks are then its own concern.
+ * 			  Returns false if the file holds no heap, one built by another
+ * 			  policy, or one changed after its last mm_sync, whose lists may
+ * 			  be inconsistent.
  */
-static void insert_freeblock(block_t *block)
+bool mm_resume(void)
 {
-	size_t size = get_size(block);
-	if (size <= min_block_size) // block belongs to small_seg_list
+	heap_root_t *root = mem_heap_lo();
+	if (!mem_persistent() || mem_shared() || mem_heapsize() != 0 ||
+		root->magic != heap_root_magic || root->classes != seg_list_size || !root->clean)
 	{
-		block->data.pointers.next = small_seg_list;
-		small_seg_list = block;
-		return;
+		return false;
 	}
-	else  // block belongs to seg_list
+	if (mem_sbrk((intptr_t)root->heap_size) == (void *)-1)
 	{
-		int seg_list_index = get_seg_list(size);
-		if (!seg_list[seg_list_index])
-		{ // originally empty list
-			seg_list[seg_list_index] = block;
-			seg_list[seg_list_index]->data.pointers.prev = NULL;
-			seg_list[seg_list_index]->data.pointers.next = NULL;
-		}
+		return false;
+	}
+
+	if (num_arenas == 0)
+	{
+		arena_create(0, mem_numa_node());
+	}
+	arenas_reset();
+	heap_root = root;
+	heap_shared = false;
+	root_load(&arenas[0]);
+	root->clean = 0;
+	return true;
+}
+
+/*
+ * mm_attach: joins a heap shared between processes that another process
+ * 			  set up with mm_init in the shared memory object mapped by
+ * 			  mem_init_shared, instead of starting a new one. Processes
+ * 			  forked after mm_init share the heap already and need not call
+ * 			  it. Blocks may be freed by any process, and a process that
+ * 			  dies while it holds the heap's lock is recovered from by the
+ * 			  next one to take it. Returns false if the memory holds no
+ * 			  shared heap or one built by another policy.
+ */
+bool mm_attach(void)
+{
+	heap_root_t *root = mem_heap_lo();
+	bool locked;
+
+	if (!mem_shared() || mem_heapsize() != 0 || root->magic != heap_root_magic ||
+		root->classes != seg_list_size || !root->shared)
+	{
+		return false;
+	}
+
+	if (num_arenas == 0)
+	{
+		arena_create(0, mem_numa_node());
+	}
+	arenas_reset();
+	heap_root = root;
+	heap_shared = true;
+	locked = arena_lock(&arenas[0]); // loads the arena from the root
+	arena_unlock(&arenas[0], locked);
+	return true;
+}
+
+/*
+ * mm_sync: records the state of the main arena in the root of a file-backed
+ * 			heap and writes the heap back to its file, so that mm_resume can
+ * 			take it up in a later process. Blocks still waiting to be freed,
+ * 			on the remote_free stack or in quarantine, are freed first. The
+ * 			heap is marked clean only once everything else is written.
+ * 			Returns false if the heap is not backed by a file or could not
+ * 			be written.
+ */
+bool mm_sync(void)
+{
+	arena_t *arena = &arenas[0];
+	bool locked, ok;
+
+	if (heap_root == NULL)
+	{
+		return false;
+	}
+
+	locked = arena_lock(arena);
+	remote_free_drain(arena);
+	while (arena->quarantine_count != 0)
+	{
+		quarantine_evict(arena);
+	}
+
+	heap_root->clean = 0;
+	root_store(arena);
+	ok = mem_sync();
+	if (ok)
+	{
+		heap_root->clean = 1;
+		ok = mem_sync();
+	}
+	arena_unlock(arena, locked);
+	return ok;
+}
+
+/*
+ * mm_set_root, mm_get_root: keep one pointer into a file-backed heap in its
+ * 			root, such as the payload holding the program's top-level data
+ * 			structure, to find it again after mm_resume. The pointer is
+ * 			stored as an offset, so that it follows the heap wherever it is
+ * 			mapped. Without a file, nothing is kept and NULL is returned.
+ */
+void mm_set_root(void *ptr)
+{
+	if (heap_root != NULL)
+	{
+		heap_root->root = root_offset(ptr);
+	}
+}
+
+void *mm_get_root(void)
+{
+	return (heap_root != NULL) ? root_pointer(heap_root->root) : NULL;
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * arenas_reset: forgets the heaps of every arena, which are rebuilt when
+ * 				 their node next allocates, and takes the bounds of the main
+ * 				 arena from its region again, which may have been remapped.
+ */
+static void arenas_reset(void)
+{
+	int ite;
+
+	// memlib drops the regions of the other arenas when it is set up
+	// again, and threads must then pick their arenas anew
+	while (num_arenas > 1 && arenas[num_arenas - 1].region >= mem_region_count())
+	{
+		num_arenas--;
+	}
+	arenas_epoch++;
+	for (ite = 0; ite < num_arenas; ite++)
+	{
+		arenas[ite].heap_start = NULL;
+		arenas[ite].remote_free = NULL;
+		arenas[ite].remote_count = 0;
+		arenas[ite].quarantine_head = 0;
+		arenas[ite].quarantine_count = 0;
+		arenas[ite].quarantine_bytes = 0;
+	}
+	arenas[0].lo = (char *)mem_region_lo(0);
+	arenas[0].max = (char *)mem_region_max(0);
+}
+
+/*
+ * heap_init: sets up the main heap at the first allocation, under the
+ * 			  arenas_lock so that threads racing to allocate do it once.
+ * 			  Without the driver (as libmm.so), nothing has set up memlib
+ * 			  before either, so that is done first, and the fork handlers
+ * 			  are registered once the heap can serve the allocations they
+ * 			  may make.
+ */
+static void heap_init(void)
+{
+#ifndef DRIVER
+	bool first = false;
+#endif
+	pthread_mutex_lock(&arenas_lock);
+	if (arenas[0].heap_start == NULL)
+	{
+#ifndef DRIVER
+		if (mem_region_lo(0) == NULL)
+		{
+			mem_init(false);
+			first = true;
+
+			// lets canary hosts run with quarantine, which has no driver to
+			// call mm_set_quarantine
+			const char *budget = getenv("MM_QUARANTINE");
+			if (budget != NULL)
+			{
+				quarantine_budget = strtoul(budget, NULL, 0);
+			}
+		}
+#endif
+		mm_init();
+	}
+	pthread_mutex_unlock(&arenas_lock);
+#ifndef DRIVER
+	if (first)
+	{
+		pthread_atfork(fork_prepare, fork_parent, fork_child);
+	}
+#endif
+}
+
+#ifndef DRIVER
+/*
+ * fork_prepare, fork_parent, fork_child: hold every arena lock across fork,
+ * 			  so that the child does not inherit a heap that another thread
+ * 			  was changing, nor a lock that no thread of the child will
+ * 			  ever release.
+ */
+static void fork_prepare(void)
+{
+	int ite;
+	pthread_mutex_lock(&arenas_lock);
+	for (ite = 0; ite < num_arenas; ite++)
+	{
+		pthread_mutex_lock(&arenas[ite].lock);
+	}
+}
+
+static void fork_parent(void)
+{
+	int ite;
+	for (ite = num_arenas - 1; ite >= 0; ite--)
+	{
+		pthread_mutex_unlock(&arenas[ite].lock);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+static void fork_child(void)
+{
+	fork_parent();
+}
+#endif
+
+/*
+ * root_offset: returns the offset of ptr from the root of a file-backed
+ * 				heap, or 0 for NULL.
+ */
+static word_t root_offset(const void *ptr)
+{
+	return (ptr == NULL) ? 0 : (word_t)((const char *)ptr - (char *)heap_root);
+}
+
+/*
+ * root_pointer: returns the pointer at offset from the root of a
+ * 				 file-backed heap, or NULL for 0.
+ */
+static void *root_pointer(word_t offset)
+{
+	return (offset == 0) ? NULL : (char *)heap_root + offset;
+}
+
+/*
+ * root_load: takes the state of the main arena from the root, moving the
+ * 			  break of the main heap up to where the root says it ends.
+ */
+static void root_load(arena_t *arena)
+{
+	size_t size = mem_region_size(0);
+	int index;
+	if (heap_root->heap_size > size)
+	{
+		mem_sbrk((intptr_t)(heap_root->heap_size - size));
+	}
+	arena->heap_start = root_pointer(heap_root->heap_start);
+	arena->small_seg_list = root_pointer(heap_root->small_seg_list);
+	for (index = 0; index < seg_list_size; index++)
+	{
+		arena->seg_list[index] = root_pointer(heap_root->seg_list[index]);
+	}
+}
+
+/*
+ * root_store: records the state of the main arena in the root.
+ */
+static void root_store(arena_t *arena)
+{
+	int index;
+	heap_root->heap_size = mem_region_size(0);
+	heap_root->heap_start = root_offset(arena->heap_start);
+	heap_root->small_seg_list = root_offset(arena->small_seg_list);
+	for (index = 0; index < seg_list_size; index++)
+	{
+		heap_root->seg_list[index] = root_offset(arena->seg_list[index]);
+	}
+}
+
+/*
+ * shared_lock: takes the lock of a shared heap. If the process that held it
+ * 				died, the lists it last stored are taken up, and since it may
+ * 				have died halfway through changing the blocks, the heap is
+ * 				checked before anyone goes on using it.
+ */
+static void shared_lock(void)
+{
+	if (pthread_mutex_lock(&heap_root->lock) == EOWNERDEAD)
+	{
+		root_load(&arenas[0]);
+		if (!check_arena(&arenas[0]))
+		{
+			fprintf(stderr, "shared heap: a process died while changing the heap\n");
+			abort();
+		}
+		pthread_mutex_consistent(&heap_root->lock);
+	}
+}
+
+/*
+ * arena_create: sets up the next free arena slot for the heap in memlib
+ * 				 region, bound to NUMA node. Requires arenas_lock unless the
+ * 				 program is single-threaded. Returns the new arena.
+ */
+static arena_t *arena_create(int region, int node)
+{
+	arena_t *arena = &arenas[num_arenas];
+	arena->heap_start = NULL;
+	arena->region = region;
+	arena->node = node;
+	arena->lo = (char *)mem_region_lo(region);
+	arena->max = (char *)mem_region_max(region);
+	arena->remote_free = NULL;
+	arena->remote_count = 0;
+	arena->quarantine_head = 0;
+	arena->quarantine_count = 0;
+	arena->quarantine_bytes = 0;
+	pthread_mutex_init(&arena->lock, NULL);
+
+	// publish the arena only once it is fully set up (see find_arena)
+	__atomic_store_n(&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+	return arena;
+}
+
+/*
+ * arena_init_heap: creates the initial empty heap of an arena with its
+ * 					prologue and epilogue, empties its seg_list and
+ * 					small_seg_list, and extends it by chunksize bytes.
+ * 					Returns false if the heap couldn't be extended.
+ */
+static bool arena_init_heap(arena_t *arena)
+{
+	// Create the initial empty heap
+	word_t *start = (word_t *)(mem_region_sbrk(arena->region, 2 * wsize));
+
+	if (start == (void *)-1)
+	{
+		return false;
+	}
+
+	store_word(&start[0], pack(0, true));					// Prologue footer
+	store_word(&start[1], pack(0, true) | prev_alloc_mask); // Epilogue header with previous alloc bit set
+
+	// Heap starts with first "block header", currently the epilogue footer
+	arena->heap_start = (block_t *)&(start[1]);
+
+	int ite;
+	// initialize seg_list and small_seg_list
+	arena->small_seg_list = NULL;
+	for (ite = 0; ite < seg_list_size; ite++)
+	{
+		arena->seg_list[ite] = NULL;
+	}
+
+	// Extend the empty heap with a free block of chunksize bytes
+	if ((extend_heap(arena, chunksize)) == NULL)
+	{
+		return false;
+	}
+	return true;
+}
+
+/*
+ * get_thread_arena: returns the arena the calling thread allocates from.
+ * 					 That is always the main arena while the program is
+ * 					 single-threaded, or if the heap is shared between
+ * 					 processes. Otherwise each thread is attached on
+ * 					 first use to the arena of its NUMA node, which is created
+ * 					 with a region bound to the node if it doesn't exist yet.
+ * 					 When no region is left, nodes share the existing arenas.
+ * 					 With mm_set_arena_nodes, threads take the made-up
+ * 					 nodes in turn instead, with unbound regions.
+ */
+static arena_t *get_thread_arena(void)
+{
+	if (__libc_single_threaded || heap_shared)
+	{
+		return &arenas[0];
+	}
+	if (thread_arena != NULL && thread_arena_epoch == arenas_epoch)
+	{
+		return thread_arena;
+	}
+
+	int node = (arena_nodes > 0)
+		? __atomic_fetch_add(&arena_next_node, 1, __ATOMIC_RELAXED) % arena_nodes
+		: mem_numa_node();
+	arena_t *arena = NULL;
+	int index;
+	pthread_mutex_lock(&arenas_lock);
+	for (index = 0; index < num_arenas; index++)
+	{
+		if (arenas[index].node == node)
+		{
+			arena = &arenas[index];
+			break;
+		}
+	}
+	if (arena == NULL)
+	{
+		int region = (num_arenas < max_arenas) ? mem_region_new(arena_nodes > 0 ? -1 : node) : -1;
+		if (region >= 0)
+		{
+			arena = arena_create(region, node);
+		}
+		else
+		{
+			arena = &arenas[node % num_arenas];
+		}
+	}
+	pthread_mutex_unlock(&arenas_lock);
+
+	thread_arena = arena;
+	thread_arena_epoch = arenas_epoch;
+	return arena;
+}
+
+/*
+ * mm_set_arena_nodes: makes threads take arenas as if they ran on nodes
+ * 					   NUMA nodes in turn, or on their real nodes if nodes
+ * 					   is 0. On a single node host, this is how frees
+ * 					   between threads can be made to take the remote_free
+ * 					   path, which otherwise only runs across nodes. Should
+ * 					   be called before any threads are started.
+ */
+void mm_set_arena_nodes(int nodes)
+{
+	arena_nodes = nodes;
+	arena_next_node = 0;
+	arenas_epoch++;
+}
+
+/*
+ * find_arena: returns the arena whose region contains block.
+ */
+static arena_t *find_arena(block_t *block)
+{
+	int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+	int index;
+	for (index = 1; index < count; index++)
+	{
+		if ((char *)block >= arenas[index].lo && (char *)block < arenas[index].max)
+		{
+			return &arenas[index];
+		}
+	}
+	return &arenas[0];
+}
+
+/*
+ * arena_lock: locks arena if the program has started threads. Returns
+ * 			   whether the lock was taken, to be passed to arena_unlock.
+ */
+static bool arena_lock(arena_t *arena)
+{
+	if (heap_shared && arena == &arenas[0])
+	{
+		shared_lock();
+		root_load(arena);
+		return true;
+	}
+	if (__libc_single_threaded)
+	{
+		return false;
+	}
+	pthread_mutex_lock(&arena->lock);
+	return true;
+}
+
+/*
+ * arena_unlock: releases the lock taken by arena_lock, if any.
+ */
+static void arena_unlock(arena_t *arena, bool locked)
+{
+	if (locked && heap_shared && arena == &arenas[0])
+	{
+		root_store(arena);
+		pthread_mutex_unlock(&heap_root->lock);
+	}
+	else if (locked)
+	{
+		pthread_mutex_unlock(&arena->lock);
+	}
+}
+
+/*
+ * arena_lock_shared: takes the lock of the main arena for the debug
+ * 					  routines, which read the arenas without locking,
+ * 					  only if it is shared with other processes.
+ */
+static bool arena_lock_shared(arena_t *arena)
+{
+	return heap_shared && arena == &arenas[0] && arena_lock(arena);
+}
+
+/*
+ * remote_free_push: pushes a block freed by a thread of another node on the
+ * 					 remote_free stack of its arena, reusing the next pointer
+ * 					 in its payload. The block stays allocated until drained.
+ * 					 Any number of threads may push at once: each push is a
+ * 					 single compare-and-swap on the head, and since the owner
+ * 					 only ever takes the whole stack, there is no ABA problem.
+ */
+static void remote_free_push(arena_t *arena, block_t *block)
+{
+	block_t *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+	do
+	{
+		set_next_free(block, head);
+	} while (!__atomic_compare_exchange_n(&arena->remote_free, &head, block, true,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&arena->remote_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_free_drain: detaches the whole remote_free stack of arena with one
+ * 					  atomic exchange and frees every block on it. Requires
+ * 					  the arena lock.
+ */
+static void remote_free_drain(arena_t *arena)
+{
+	if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) == NULL)
+	{
+		return;
+	}
+
+	block_t *block = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+	int count = 0;
+	while (block != NULL)
+	{
+		block_t *next = find_next_free(block);
+		retire_block(arena, block);
+		block = next;
+		count++;
+	}
+	__atomic_sub_fetch(&arena->remote_count, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_set_quarantine: keeps up to budget bytes of freed blocks in quarantine
+ * 					  in each arena (see quarantine_budget), or none if
+ * 					  budget is 0. Blocks already in quarantine past a new,
+ * 					  lower budget are freed at the next free. Should be
+ * 					  called before any threads are started.
+ */
+void mm_set_quarantine(size_t budget)
+{
+	quarantine_budget = budget;
+}
+
+/*
+ * retire_block: frees block, or puts it in quarantine and frees the oldest
+ * 				 blocks in quarantine past the budget. Requires the arena lock.
+ */
+static void retire_block(arena_t *arena, block_t *block)
+{
+	if (quarantine_budget == 0 && arena->quarantine_count == 0)
+	{
+		free_block(arena, block);
+		return;
+	}
+
+	quarantine_push(arena, block);
+	while (arena->quarantine_bytes > quarantine_budget)
+	{
+		quarantine_evict(arena);
+	}
+}
+
+/*
+ * quarantine_push: poisons the payload of block and appends block to the
+ * 					quarantine of arena, first freeing the oldest block if
+ * 					the ring is full.
+ */
+static void quarantine_push(arena_t *arena, block_t *block)
+{
+	size_t n = get_payload_size(block);
+
+	if (arena->quarantine_count == quarantine_slots)
+	{
+		quarantine_evict(arena);
+	}
+	poison_payload(header_to_payload(block), (n < quarantine_check_max) ? n : quarantine_check_max);
+	arena->quarantine[(arena->quarantine_head + arena->quarantine_count) % quarantine_slots] = block;
+	arena->quarantine_count++;
+	arena->quarantine_bytes += get_size(block);
+}
+
+/*
+ * quarantine_evict: removes the oldest block from the quarantine of arena
+ * 					 and frees it. Aborts if its payload no longer holds the
+ * 					 poison written by quarantine_push.
+ */
+static void quarantine_evict(arena_t *arena)
+{
+	block_t *block = arena->quarantine[arena->quarantine_head];
+	char *bp = header_to_payload(block);
+	size_t n = get_payload_size(block);
+	size_t offset;
+
+	if (n > quarantine_check_max)
+	{
+		n = quarantine_check_max;
+	}
+	for (offset = 0; offset < n; offset += wsize)
+	{
+		if (load_word(bp + offset) != quarantine_poison)
+		{
+			fprintf(stderr, "quarantine: freed block %p was written at payload offset %zu\n", bp, offset);
+			abort();
+		}
+	}
+
+	arena->quarantine_head = (arena->quarantine_head + 1) % quarantine_slots;
+	arena->quarantine_count--;
+	arena->quarantine_bytes -= get_size(block);
+	free_block(arena, block);
+}
+
+/*
+ * extend_heap: extends the heap size by size and rounds up size to meet the 
+ * 				alignment of 16 bytes (or of the huge page size, in huge page 
+ * 				mode). Then it initializes the original epilogue to be a free
+ * 				block and creates new epilogue header. 
+ * 				Lastly it calls coalesce. 
+ * 				Returns NULL if mem_sbrk fails. Otherwise, returns coalesce(block).
+ */
+static block_t *extend_heap(arena_t *arena, size_t size)
+{
+	void *bp;
+	block_t *epilogue;
+	size_t prev_alloc, prev_sseg;
+
+	// save prev_alloc and prev_sseg flags of the current epilogue (end block)
+	// before extending heap
+	epilogue = (block_t *)((char *)mem_region_hi(arena->region) - 7);
+	prev_alloc = get_prev_alloc(epilogue);
+	prev_sseg = get_prev_sseg(epilogue);
+
+	// mem_sbrk takes a signed increment, and the huge page rounding below
+	// must not wrap around
+	if (size > PTRDIFF_MAX / 2)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Allocate an even number of words to maintain alignment
+	size = round_up(size, dsize);
+
+	// When the heap is backed by huge pages, grow it up to the next huge
+	// page boundary so that each page is filled before touching a new one
+	size_t hpage = mem_hugepagesize();
+	if (hpage != 0)
+	{
+		size_t heapsize = mem_region_size(arena->region);
+		size = round_up(heapsize + size, hpage) - heapsize;
+	}
+	if ((bp = mem_region_sbrk(arena->region, size)) == (void *)-1)
+	{
+		return NULL;
+	}
+
+	// Initialize free block header/footer
+	block_t *block = payload_to_header(bp);
+	// inherit the prev_alloc and prev_sseg status of the original epilogue header
+	size |= prev_alloc;
+	size |= prev_sseg;
+	write_header(block, size, false);
+	write_footer(block, size, false);
+
+	// Create new epilogue header
+	block_t *block_next = find_next(block);
+	store_word(&block_next->header, 0);
+	write_header(block_next, 0, true);
+	// write_header marks the successor of an allocated block, which for the
+	// zero-sized epilogue is itself; its predecessor is the new free block
+	clear_header_bits(block_next, prev_alloc_mask);
+
+	// Coalesce in case the previous block was free
+
+	return coalesce(arena, block);
+}
+
+/*
+ * remove_freeblock: removes the free block from its corresponding seg_list 
+ * 			 		 or arena->small_seg_list, and sets up the next and prev pointers
+ * 					 appropriately.
+ */
+static void remove_freeblock(arena_t *arena, block_t *block)
+{
+	block_t *prev_free, *next_free;
+
+	size_t size = get_size(block);
+	if (block)
+	{
+		if (size <= min_block_size) // block belongs to small_seg_list
+		{
+			block_t *b;
+			// traverse small_seg_list to find the target block
+			for (b = arena->small_seg_list; b != NULL; b = find_next_free(b))
+			{
+				if (b == block)
+				{
+					if (b == arena->small_seg_list)
+					{ // block is the root of small_seg_list
+						arena->small_seg_list = find_next_free(b); // set the successor to be the root
+					}
+					else
+					{	// link prev_free to next_free
+						set_next_free(prev_free, find_next_free(b));
+					}
+					return;
+				}
+				prev_free = b; // need to keep track of prev_free since small_seg_list is a singly linkedlist
+			}
+		}
+		else // block belongs to seg_list
+		{
+#if MM_POLICY == MM_POLICY_CTREE
+			tree_remove(arena, block);
+			return;
+#endif
+			int seg_list_index = get_seg_list(size);
+			prev_free = find_prev_free(block);
+			next_free = find_next_free(block);
+			if (!prev_free && !next_free)
+			{ // root of free list && current block is the only element in seg_list
+				arena->seg_list[seg_list_index] = NULL;
+			}
+			else if (prev_free && !next_free)
+			{ // end of free list
+				set_next_free(prev_free, NULL);  // prev_free becomes the new end
+				set_prev_free(block, NULL);
+			}
+			else if (!prev_free && next_free)
+			{ // root of free list
+				set_prev_free(next_free, NULL);  // next_free becomes the new root
+				set_next_free(block, NULL);
+				arena->seg_list[seg_list_index] = next_free;
+			}
+			else
+			{
+				set_next_free(prev_free, next_free);	// link prev_free and next_free
+				set_prev_free(next_free, prev_free);
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * insert_freeblock: inserts the free block into its corresponding seg_list 
+ * 			 		 or arena->small_seg_list with LIFO policy, and sets up the next 
+ * 					 and prev pointers appropriately. 
+ */
+static void insert_freeblock(arena_t *arena, block_t *block)
+{
+	size_t size = get_size(block);
+	if (size <= min_block_size) // block belongs to small_seg_list
+	{
+		set_next_free(block, arena->small_seg_list);
+		arena->small_seg_list = block;
+		return;
+	}
+	else  // block belongs to seg_list
+	{
+#if MM_POLICY == MM_POLICY_CTREE
+		tree_insert(arena, block);
+		return;
+#endif
+		int seg_list_index = get_seg_list(size);
+		if (!arena->seg_list[seg_list_index])
+		{ // originally empty list
+			arena->seg_list[seg_list_index] = block;
+			set_prev_free(arena->seg_list[seg_list_index], NULL);
+			set_next_free(arena->seg_list[seg_list_index], NULL);
+		}
+		else
+		{
+			set_prev_free(arena->seg_list[seg_list_index], block); // point the root to block
+			set_next_free(block, arena->seg_list[seg_list_index]);
+			set_prev_free(block, NULL);
+			arena->seg_list[seg_list_index] = block;
+		}
+		return;
+	}
+}
+
+/*
+ * coalesce: coalesces block with its predecessor block and its successor 
+ * 			 block accordingly.
+ * 			 Returns the pointer to the free block with the lowest address 
+ * 			 after coalescing.
+ */
+static block_t *coalesce(arena_t *arena, block_t *block)
+{
+	dbg_printf("\n!!!!!!!!!COALESCE!!!!!!!!!!\n");
+	block_t *next, *prev;
+	next = find_next(block);
+	bool next_alloc = get_alloc(next);
+	bool prev_alloc = get_prev_alloc(block) ? true : false;
+	if (!prev_alloc)
+	{
+		prev = find_prev(block);
+	}
+	else
+	{
+		prev = NULL;
+	}
+
+	size_t size = get_size(block);
+
+	if (!prev_alloc && next_alloc)
+	{ // case 3
+		dbg_printf("\ncase 3");
+		size += get_size(prev);	 // update size (will inherit prev_sseg status of prev)
+		size |= prev_alloc_mask; // inherit prev_alloc bit from previous block
+		remove_freeblock(arena, prev);	 // remove prev from free list
+		write_header(prev, size, false);
+		write_footer(prev, size, false);
+
+		// if block originally belongs to small_seg_list, zero out
+		// the prev_sseg bit of the successor
+		// (min size of two blocks: 2*16=32 bytes > 16 bytes)
+		if (get_size(block) == min_block_size)
+		{
+			clear_header_bits(next, prev_sseg_mask);
+		}
+
+		block = prev;
+	}
+	else if (prev_alloc && !next_alloc)
+	{ // case 2
+		dbg_printf("\ncase 2");
+		size += get_size(next);
+		size |= prev_alloc_mask;
+		remove_freeblock(arena, next);
+		write_header(block, size, false);
+		write_footer(block, size, false);
+
+		if (get_size(next) == min_block_size)
+		{
+			clear_header_bits(find_next(next), prev_sseg_mask);
+		}
+	}
+	else if (!prev_alloc && !next_alloc)
+	{ // case 4
+		dbg_printf("\ncase 4");
+		size += get_size(prev) + get_size(next);
+		size |= prev_alloc_mask;
+		remove_freeblock(arena, prev);
+		remove_freeblock(arena, next);
+
+		write_header(prev, size, false);
+		write_footer(prev, size, false);
+
+		if (get_size(next) == min_block_size)
+		{
+			clear_header_bits(find_next(next), prev_sseg_mask);
+		}
+
+		block = prev;
+	}
+	else
+	{ // case 1
+		dbg_printf("\ncase 1");
+	}
+
+	insert_freeblock(arena, block);
+
+	return block;
+}
+
+/*
+ * place: allocates a block of asize. If the remaining block size is greater than or
+ * 		  equal to the minimum block size, remove the block from free_list, perform split, and 
+ * 		  then insert block_next into free_list. Otherwise, only remove the block from free_list.
+ */
+static void place(arena_t *arena, block_t *block, size_t asize)
+{
+	dbg_printf("\nAllocated total size: %zu\n", asize);
+	size_t csize, prev_alloc, prev_sseg, temp;
+	csize = get_size(block);
+	prev_alloc = get_prev_alloc(block);
+	prev_sseg = get_prev_sseg(block);
+
+	if ((csize - asize) >= min_block_size) // if the remaining block size >= min_block_size
+	{
+		remove_freeblock(arena, block);
+		block_t *block_next;
+		temp = asize | prev_alloc | prev_sseg;
+		write_header(block, temp, true);
+
+		block_next = find_next(block); // perform split, the successor follows an allocated block
+		if (asize == min_block_size)   // if allocated size is the minimum, set the prev_sseg flag of the successor
+		{
+			temp = (csize - asize) | prev_sseg_mask | prev_alloc_mask;
+			write_header(block_next, temp, false);
+			write_footer(block_next, temp, false);
+		}
+		else
+		{
+			temp = (csize - asize) | prev_alloc_mask;
+			write_header(block_next, temp, false);
+			write_footer(block_next, temp, false);
+		}
+
+		if ((csize - asize) == min_block_size) 
+		{  // if the splitted block has min size, set sseg flag of its successor
+			set_header_bits(find_next(block_next), prev_sseg_mask);
+		}
+
+		insert_freeblock(arena, block_next);
+	}
+	else
+	{  // if the remaining block size > min_block_size, allocate the whole block
+		remove_freeblock(arena, block);
+		temp = csize | prev_alloc | prev_sseg;
+		write_header(block, temp, true);
+
+		if (csize == min_block_size)
+		{
+			set_header_bits(find_next(block), prev_sseg_mask);
+		}
+	}
+}
+
+/*
+ * malloc_congruent: allocates a block like malloc, but with its payload at the
+ * 					 same offset within a page of the given size as ptr. The
+ * 					 fit is searched for size plus a page, and the part before
+ * 					 the congruent payload is split off as a free block.
+ */
+static void *malloc_congruent(size_t size, const void *ptr, size_t page)
+{
+	size_t asize;
+	size_t lead;
+	block_t *block;
+	arena_t *arena;
+	bool locked;
+
+	// the fit is searched for asize plus a page, which must not wrap around
+	if (too_large(size, page))
+	{
+		return NULL;
+	}
+	asize = round_up(size + wsize, dsize);
+	arena = get_thread_arena();
+	locked = arena_lock(arena);
+
+	if (arena->heap_start == NULL && !arena_init_heap(arena))
+	{
+		arena_unlock(arena, locked);
+		return NULL;
+	}
+	remote_free_drain(arena);
+
+	block = find_fit(arena, asize + page);
+	if (block == NULL)
+	{
+		block = extend_heap(arena, max(asize + page, chunksize));
+		if (block == NULL)
+		{
+			arena_unlock(arena, locked);
+			return NULL;
+		}
+	}
+
+	// both payloads are 16-byte aligned, so lead is 0 or at least min_block_size
+	lead = ((char *)ptr - (char *)header_to_payload(block)) & (page - 1);
+	block = split_lead(arena, block, lead);
+	place(arena, block, asize);
+	arena_unlock(arena, locked);
+	return header_to_payload(block);
+}
+
+/*
+ * split_lead: splits the first lead bytes off the free block into a free block
+ * 			   of their own, and returns the free block that remains after it.
+ */
+static block_t *split_lead(arena_t *arena, block_t *block, size_t lead)
+{
+	size_t csize = get_size(block);
+	size_t flags = get_prev_alloc(block) | get_prev_sseg(block);
+	block_t *rest;
+
+	if (lead == 0)
+	{
+		return block;
+	}
+
+	remove_freeblock(arena, block);
+	write_header(block, lead | flags, false);
+	write_footer(block, lead | flags, false);
+	insert_freeblock(arena, block);
+
+	// the predecessor of the rest is now free, and a small one if lead is
+	rest = find_next(block);
+	flags = (lead == min_block_size) ? prev_sseg_mask : 0;
+	write_header(rest, (csize - lead) | flags, false);
+	write_footer(rest, (csize - lead) | flags, false);
+	insert_freeblock(arena, rest);
+	return rest;
+}
+
+/*
+ * find_fit: traverse the appropriate list according to asize and find the closest 25th fit
+ */
+static block_t *find_fit(arena_t *arena, size_t asize)
+{
+	block_t *block;
+	block_t *block_bestfit = NULL;
+	int if_firstfit = 1;
+	int n = 0;
+	size_t size_diff;
+	int class = get_seg_list(asize);
+	int index;
+
+	if (asize == min_block_size)
+	{
+		for (block = arena->small_seg_list; block != NULL; block = find_next_free(block))
+		{
+			if (asize <= get_size(block))
+			{
+				block_bestfit = block;
+				return block_bestfit;
+			}
+		}
+		class = 0;
+	}
+
+#if MM_POLICY == MM_POLICY_CTREE
+	return tree_fit(arena, asize);
+#endif
+
+	// traverse seg_list to find a fit
+	for (index = class; index < seg_list_size; index++)
+	{
+		for (block = arena->seg_list[index]; block != NULL; block = find_next_free(block))
+		{
+
+			if (asize == get_size(block))
+			{ // same size -> best fit
+				block_bestfit = block;
+				return block_bestfit;
+			}
+
+			if (asize < get_size(block))
+			{
+				n += 1;
+				if (if_firstfit)
+				{
+					block_bestfit = block;
+					if_firstfit = 0;
+					size_diff = get_size(block) - asize;
+				}
+
+				if (get_size(block) - asize < size_diff)
+				{
+					block_bestfit = block;
+					size_diff = get_size(block) - asize;
+				}
+
+				if (n == nth_fit)
+				{
+					return block_bestfit;
+				}
+			}
+		}
+	}
+
+	return block_bestfit; // no fit found
+}
+
+#if MM_POLICY == MM_POLICY_CTREE
+/*
+ * Cartesian tree (policy MM_POLICY_CTREE): every free block larger than
+ * 16 bytes is a node of one binary tree per arena, rooted at seg_list[0],
+ * whose left and right children are stored in the next and prev pointers
+ * of the block. The tree is a search tree by address and a max-heap by
+ * size, so the root is the largest free block, and the blocks that fit a
+ * request form a subtree hanging from the root. All operations walk a
+ * single path from the root (Stephenson's "fast fits").
+ */
+
+/*
+ * tree_insert: inserts block below the last node on its address path that
+ * 				is at least as large, and splits the subtree it displaces
+ * 				by address into its left and right children.
+ */
+static void tree_insert(arena_t *arena, block_t *block)
+{
+	size_t size = get_size(block);
+	block_t *parent = NULL;
+	bool right = false;
+	block_t *node = arena->seg_list[0];
+
+	while (node != NULL && get_size(node) >= size)
+	{
+		parent = node;
+		right = block > node;
+		node = tree_child(node, right);
+	}
+	set_tree_child(arena, parent, right, block);
+
+	// the nodes below block's address go down its left spine, the others
+	// down its right spine
+	block_t *lparent = block, *rparent = block;
+	bool lright = false, rright = true;
+	while (node != NULL)
+	{
+		if (node < block)
+		{
+			set_tree_child(arena, lparent, lright, node);
+			lparent = node;
+			lright = true;
+			node = tree_child(node, true);
+		}
 		else
 		{
-			seg_list[seg_list_index]->data.pointers.prev = block; // point the root to block
-			block->data.pointers.next = seg_list[seg_list_index];
-			block->data.pointers.prev = NULL;
-			seg_list[seg_list_index] = block;
+			set_tree_child(arena, rparent, rright, node);
+			rparent = node;
+			rright = false;
+			node = tree_child(node, false);
 		}
+	}
+	set_tree_child(arena, lparent, lright, NULL);
+	set_tree_child(arena, rparent, rright, NULL);
+}
+
+/*
+ * tree_remove: finds block by its address and replaces it by the merge of
+ * 				its children, taking the larger root at each step.
+ */
+static void tree_remove(arena_t *arena, block_t *block)
+{
+	block_t *parent = NULL;
+	bool right = false;
+	block_t *node = arena->seg_list[0];
+
+	while (node != NULL && node != block)
+	{
+		parent = node;
+		right = block > node;
+		node = tree_child(node, right);
+	}
+	dbg_assert(node == block);
+	if (node == NULL)
+	{
 		return;
 	}
+
+	block_t *l = tree_child(block, false);
+	block_t *r = tree_child(block, true);
+	while (l != NULL && r != NULL)
+	{
+		if (get_size(l) >= get_size(r))
+		{
+			set_tree_child(arena, parent, right, l);
+			parent = l;
+			right = true;
+			l = tree_child(l, true);
+		}
+		else
+		{
+			set_tree_child(arena, parent, right, r);
+			parent = r;
+			right = false;
+			r = tree_child(r, false);
+		}
+	}
+	set_tree_child(arena, parent, right, (l != NULL) ? l : r);
 }
 
 /*
- * coalesce: coalesces block with its predecessor block and its successor 
- * 			 block accordingly.
- * 			 Returns the pointer to the free block with the lowest address 
- * 			 after coalescing.
+ * tree_fit: descends from the root towards the smaller child that still
+ * 			 fits asize, preferring the lower address on ties, and returns
+ * 			 the node where neither child fits or an exact fit. This is
+ * 			 Stephenson's "better fit": every step takes the closer fit, but
+ * 			 the result is only the best fit on its path, since finding the
+ * 			 true best fit may have to visit every node that fits.
+ * 			 Returns NULL if even the largest block is too small.
  */
-static block_t *coalesce(block_t *block)
+static block_t *tree_fit(arena_t *arena, size_t asize)
 {
-	dbg_printf("\n!!!!!!!!!COALESCE!!!!!!!!!!\n");
-	block_t *next, *prev;
-	next = find_next(block);
-	bool next_alloc = get_alloc(next);
-	bool prev_alloc = get_prev_alloc(block) ? true : false;
-	if (!prev_alloc)
+	block_t *node = arena->seg_list[0];
+	if (node == NULL || get_size(node) < asize)
 	{
-		prev = find_prev(block);
+		return NULL;
+	}
+
+	while (get_size(node) != asize)
+	{
+		block_t *l = tree_child(node, false);
+		block_t *r = tree_child(node, true);
+		bool lfits = l != NULL && get_size(l) >= asize;
+		bool rfits = r != NULL && get_size(r) >= asize;
+		if (lfits && (!rfits || get_size(l) <= get_size(r)))
+		{
+			node = l;
+		}
+		else if (rfits)
+		{
+			node = r;
+		}
+		else
+		{
+			break;
+		}
+	}
+	return node;
+}
+
+/*
+ * tree_check: checks that the subtree at node holds free blocks larger than
+ * 			   16 bytes between addresses lo and hi, none larger than
+ * 			   max_size and none larger than its parent.
+ */
+static bool tree_check(block_t *node, block_t *lo, block_t *hi, size_t max_size)
+{
+	if (node == NULL)
+	{
+		return true;
+	}
+	if (node <= lo || node >= hi || get_alloc(node) || get_size(node) <= min_block_size ||
+		get_size(node) > max_size)
+	{
+		return false;
+	}
+	return tree_check(tree_child(node, false), lo, node, get_size(node)) &&
+		   tree_check(tree_child(node, true), node, hi, get_size(node));
+}
+
+/*
+ * tree_contains: returns true if block is in the tree of arena.
+ */
+static bool tree_contains(arena_t *arena, block_t *block)
+{
+	block_t *node = arena->seg_list[0];
+	while (node != NULL && node != block)
+	{
+		node = tree_child(node, block > node);
+	}
+	return node != NULL;
+}
+
+/*
+ * tree_child: returns the right child of node if right is set, and the
+ * 			   left child otherwise.
+ */
+static block_t *tree_child(block_t *node, bool right)
+{
+	return right ? find_prev_free(node) : find_next_free(node);
+}
+
+/*
+ * set_tree_child: links child as the right or left child of parent, or as
+ * 				   the root of the tree if parent is NULL.
+ */
+static void set_tree_child(arena_t *arena, block_t *parent, bool right, block_t *child)
+{
+	if (parent == NULL)
+	{
+		arena->seg_list[0] = child;
+	}
+	else if (right)
+	{
+		set_prev_free(parent, child);
 	}
 	else
 	{
-		prev = NULL;
+		set_next_free(parent, child);
+	}
+}
+#endif
+
+/* 
+ * mm_checkheap: runs a series of tests to check the validity and consistency
+ * 				 of the heap of every arena.
+ * 				 Returns false if any of the tests fail. Otherwise returns true.
+ * 
+ * A list of tests:
+ * 		1. check if all blocks in seg_list are free
+ * 	    2. check if all pointers in seg_list point to valid free blocks
+ * 		3. check the size and alignment of each block in seg_list
+ * 		4. check if each block in seg_list actually exists in the heap
+ * 
+ * 		5. check if all blocks in arena->small_seg_list are free
+ * 		6. check if all pointers in arena->small_seg_list point to valid free blocks
+ * 		7. check the size and alignment of each block in arena->small_seg_list
+ * 		8. check if each block in arena->small_seg_list actually exists in the heap
+ * 
+ *   	9. check if all pointers in heap point to valid heap blocks
+ *  	10. check if any contiguous free blocks escaped coalescing
+ * 		11. check if every free block is actually in the seg_list or arena->small_seg_list
+ * 		12. check if there is any overlap in allocated blocks
+ */
+bool mm_checkheap(int line)
+{
+	dbg_printf("\n!!!!!!!!!CHECKHEAP AT LINE %d!!!!!!!!!!!\n", line);
+
+#ifdef GUARD_PAGES
+	return guard_check();
+#endif
+
+	int index;
+	for (index = 0; index < num_arenas; index++)
+	{
+		bool locked = arena_lock_shared(&arenas[index]);
+		bool ok = arenas[index].heap_start == NULL || check_arena(&arenas[index]);
+		arena_unlock(&arenas[index], locked);
+		if (!ok)
+		{
+			dbg_printf("\nConsistency error in arena %d!!!\n", index);
+			return false;
+		}
+	}
+
+	dbg_printf(" \n");
+
+	return true;
+}
+
+/*
+ * check_arena: runs the tests of mm_checkheap on the heap of one arena.
+ */
+static bool check_arena(arena_t *arena)
+{
+	block_t *block, *prologue, *epilogue, *b;
+	bool free_list_is_complete = 0;
+	bool free_list_is_valid = 0;
+#if MM_POLICY != MM_POLICY_CTREE
+	int index;
+#endif
+
+	prologue = (block_t *)mem_region_lo(arena->region);
+	epilogue = (block_t *)mem_region_hi(arena->region);
+
+#if MM_POLICY == MM_POLICY_CTREE
+	// check the order, sizes and bounds of the blocks in the tree
+	if (!tree_check(arena->seg_list[0], prologue, epilogue, (size_t)-1))
+	{
+		dbg_printf("\nConsistency error: invalid cartesian tree!!!\n");
+		return false;
+	}
+#else
+	for (index = 0; index < seg_list_size; index++)
+	{
+		for (block = arena->seg_list[index]; block != NULL; block = find_next_free(block))
+		{
+			// check if all blocks in seg_list are free
+			if (get_alloc(block))
+			{
+				dbg_printf("\nConsistency error: allocated block in seg_list!!!\n");
+				return false;
+			}
+
+			// check if all pointers in seg_list point to valid free blocks
+			if (block < prologue || block > epilogue)
+			{
+				dbg_printf("\nConsistency error: block in seg_list out of bounds!!!\n");
+				return false;
+			}
+
+			// check the size and alignment of each block
+			if (get_size(block) % 16 != 0 || get_size(block) < 16)
+			{
+				dbg_printf("\nConsistency error: invalid size of seg_list block!!!\n");
+				return false;
+			}
+
+			// check if each block actually exists in the heap
+			for (b = arena->heap_start; get_size(b) > 0; b = find_next(b))
+			{
+				if (b == block)
+				{
+					free_list_is_valid = 1;
+					break;
+				}
+			}
+			if (free_list_is_valid == 0)
+			{
+				dbg_printf("\nConsistency error: seg_list block doesn't exist in heap'!!!\n");
+			}
+		}
+	}
+#endif
+
+	free_list_is_valid = 0;
+	for (block = arena->small_seg_list; block != NULL; block = find_next_free(block))
+	{
+		// check if all blocks in small_seg_list are free
+		if (get_alloc(block))
+		{
+			dbg_printf("\nConsistency error: allocated block in small_seg_list!!!\n");
+			return false;
+		}
+
+		// check if all pointers in small_seg_list point to valid free blocks
+		if (block < prologue || block > epilogue)
+		{
+			dbg_printf("\nConsistency error: block in small_seg_list out of bounds!!!\n");
+			return false;
+		}
+
+		// check the size and alignment of each block
+		if (get_size(block) % 16 != 0 || get_size(block) < 16)
+		{
+			dbg_printf("\nConsistency error: invalid size of small_seg_list block!!!\n");
+			return false;
+		}
+
+		// check if each block actually exists in the heap
+		for (b = arena->heap_start; get_size(b) > 0; b = find_next(b))
+		{
+			if (b == block)
+			{
+				free_list_is_valid = 1;
+				break;
+			}
+		}
+		if (free_list_is_valid == 0)
+		{
+			dbg_printf("\nConsistency error: small_seg_list block doesn't exist in heap'!!!\n");
+		}
 	}
 
-	size_t size = get_size(block);
+	for (block = arena->heap_start; get_size(block) > 0; block = find_next(block))
+	{
+		// check if all pointers in heap point to valid heap blocks
+		if (block < prologue || block > epilogue)
+		{
+			dbg_printf("\nConsistency error: invalid heap block in heap!!!\n");
+			return false;
+		}
+		if (get_size(block) % 16 != 0 || get_size(block) < 16)
+		{
+			dbg_printf("\nConsistency error: invalid size of heap block in heap!!!\n");
+			return false;
+		}
+
+		if (!get_alloc(block))
+		{
+			// check if any contiguous free blocks escaped coalescing
+			if (!get_prev_alloc(block) || !get_alloc(find_next(block)))
+			{
+				dbg_printf("\nConsistency error: uncoalesced free block!!!\n");
+				return false;
+			}
+
+			// check if every free block is actually in the seg_list or small_seg_list
+#if MM_POLICY == MM_POLICY_CTREE
+			free_list_is_complete = tree_contains(arena, block);
+#else
+			for (index = 0; index < seg_list_size; index++)
+			{
+				for (b = arena->seg_list[index]; b != NULL; b = find_next_free(b))
+				{
+					if (b == block)
+					{
+						free_list_is_complete = 1;
+						break;
+					}
+				}
+			}
+#endif
+
+			if (free_list_is_complete == 0)
+			{
+				for (b = arena->small_seg_list; b != NULL; b = find_next_free(b))
+				{
+					if (b == block)
+					{
+						free_list_is_complete = 1;
+						break;
+					}
+				}
+			}
 
-	if (!prev_alloc && next_alloc)
-	{ // case 3
-		dbg_printf("\ncase 3");
-		size += get_size(prev);	 // update size (will inherit prev_sseg status of prev)
-		size |= prev_alloc_mask; // inherit prev_alloc bit from previous block
-		remove_freeblock(prev);	 // remove prev from free list
-		write_header(prev, size, false);
-		write_footer(prev, size, false);
+			if (free_list_is_complete == 0)
+			{
+				dbg_printf("\nConsistency error: incomplete free_list!!!\n");
+				return false;
+			}
+		}
 
-		// if block originally belongs to small_seg_list, zero out
-		// the prev_sseg bit of the successor
-		// (min size of two blocks: 2*16=32 bytes > 16 bytes)
-		if (get_size(block) == min_block_size)
+		// check if there is any overlap in allocated blocks
+		if (get_alloc(block))
 		{
-			next->header &= (~prev_sseg_mask);
+			block_t *next;
+			next = find_next(block);
+			if ((block_t *)((char *)block + get_size(block)) > next)
+			{
+				dbg_printf("\nConsistency error: block overlap!!!\n");
+				return false;
+			}
 		}
-
-		block = prev;
 	}
-	else if (prev_alloc && !next_alloc)
-	{ // case 2
-		dbg_printf("\ncase 2");
-		size += get_size(next);
-		size |= prev_alloc_mask;
-		remove_freeblock(next);
-		write_header(block, size, false);
-		write_footer(block, size, false);
 
-		if (get_size(next) == min_block_size)
+	// check that the quarantine holds allocated blocks of the arena that add
+	// up to its byte count
+	size_t quarantined = 0;
+	int ite;
+	for (ite = 0; ite < arena->quarantine_count; ite++)
+	{
+		block = arena->quarantine[(arena->quarantine_head + ite) % quarantine_slots];
+		if (block < prologue || block > epilogue || !get_alloc(block))
 		{
-			find_next(next)->header &= (~prev_sseg_mask);
+			dbg_printf("\nConsistency error: invalid block in quarantine!!!\n");
+			return false;
 		}
+		quarantined += get_size(block);
+	}
+	if (quarantined != arena->quarantine_bytes)
+	{
+		dbg_printf("\nConsistency error: quarantine size mismatch!!!\n");
+		return false;
 	}
-	else if (!prev_alloc && !next_alloc)
-	{ // case 4
-		dbg_printf("\ncase 4");
-		size += get_size(prev) + get_size(next);
-		size |= prev_alloc_mask;
-		remove_freeblock(prev);
-		remove_freeblock(next);
 
-		write_header(prev, size, false);
-		write_footer(prev, size, false);
+	return true;
+}
 
-		if (get_size(next) == min_block_size)
+/*
+ * mm_heapinfo: adds up the sizes and counts of the allocated and free blocks
+ * 				in the heap of every arena into info. Blocks still waiting on
+ * 				a remote_free stack or in quarantine count as allocated.
+ */
+void mm_heapinfo(mm_heapinfo_t *info)
+{
+	int index;
+	memset(info, 0, sizeof(*info));
+#ifdef GUARD_PAGES
+	guard_heapinfo(info);
+	return;
+#endif
+	for (index = 0; index < num_arenas; index++)
+	{
+		if (arenas[index].heap_start != NULL)
 		{
-			find_next(next)->header &= (~prev_sseg_mask);
+			bool locked = arena_lock_shared(&arenas[index]);
+			arena_heapinfo(&arenas[index], info);
+			arena_unlock(&arenas[index], locked);
 		}
-
-		block = prev;
-	}
-	else
-	{ // case 1
-		dbg_printf("\ncase 1");
 	}
-
-	insert_freeblock(block);
-
-	return block;
 }
 
 /*
- * place: allocates a block of asize. If the remaining block size is greater than or
- * 		  equal to the minimum block size, remove the block from free_list, perform split, and 
- * 		  then insert block_next into free_list. Otherwise, only remove the block from free_list.
+ * arena_heapinfo: adds the blocks in the heap of one arena into info.
  */
-static void place(block_t *block, size_t asize)
+static void arena_heapinfo(arena_t *arena, mm_heapinfo_t *info)
 {
-	dbg_printf("\nAllocated total size: %zu\n", asize);
-	size_t csize, prev_alloc, prev_sseg, temp;
-	csize = get_size(block);
-	prev_alloc = get_prev_alloc(block);
-	prev_sseg = get_prev_sseg(block);
-
-	if ((csize - asize) >= min_block_size) // if the remaining block size >= min_block_size
+	block_t *block;
+	for (block = arena->heap_start; get_size(block) > 0; block = find_next(block))
 	{
-		remove_freeblock(block);
-		block_t *block_next;
-		temp = asize | prev_alloc | prev_sseg;
-		write_header(block, temp, true);
-
-		block_next = find_next(block); // perform split
-		if (asize == min_block_size)   // if allocated size is the minimum, set the prev_sseg flag of the successor
+		size_t size = get_size(block);
+		info->heap_bytes += size;
+		if (get_alloc(block))
 		{
-			temp = (csize - asize) | prev_sseg_mask | prev_alloc;
-			write_header(block_next, temp, false);
-			write_footer(block_next, temp, false);
+			info->alloc_bytes += size;
+			info->payload_bytes += get_payload_size(block);
+			info->alloc_blocks++;
 		}
 		else
 		{
-			temp = (csize - asize) | prev_alloc;
-			write_header(block_next, temp, false);
-			write_footer(block_next, temp, false);
-		}
-
-		if ((csize - asize) == min_block_size) 
-		{  // if the splitted block has min size, set sseg flag of its successor
-	  	find_next(block_next) -> header |= prev_sseg_mask;
+			info->free_bytes += size;
+			info->largest_free = max(info->largest_free, size);
+			info->free_blocks++;
 		}
-
-		insert_freeblock(block_next);
 	}
-	else
-	{  // if the remaining block size > min_block_size, allocate the whole block
-		remove_freeblock(block);
-		temp = csize | prev_alloc | prev_sseg;
-		write_header(block, temp, true);
+}
 
-		if (csize == min_block_size)
+/*
+ * mm_heapmap: prints where the space in the heap of every arena went, in a
+ * 			   few dozen lines instead of one line per block like print_heap:
+ * 			   the header overhead of the allocated blocks, the external
+ * 			   fragmentation of the free blocks with a histogram of free bytes
+ * 			   per size class, and an occupancy map of width cells per row.
+ */
+void mm_heapmap(FILE *out, int width)
+{
+	int index;
+	if (width < 1)
+	{
+		width = 1;
+	}
+	if (width > map_max_width)
+	{
+		width = map_max_width;
+	}
+#ifdef GUARD_PAGES
+	mm_heapinfo_t info;
+	mm_heapinfo(&info);
+	fprintf(out, "guard page mode: %zu allocations in %zu bytes of page runs, %zu freed runs in %zu bytes\n",
+			info.alloc_blocks, info.alloc_bytes, info.free_blocks, info.free_bytes);
+	return;
+#endif
+	for (index = 0; index < num_arenas; index++)
+	{
+		if (arenas[index].heap_start != NULL)
 		{
-			find_next(block)->header |= prev_sseg_mask;
+			bool locked = arena_lock_shared(&arenas[index]);
+			fprintf(out, "heap map of arena %d:\n", index);
+			arena_heapmap(out, &arenas[index], width);
+			arena_unlock(&arenas[index], locked);
 		}
 	}
 }
 
 /*
- * find_fit: traverse the appropriate list according to asize and find the closest 25th fit
+ * arena_heapmap: prints the heap map of one arena. Each cell of the map
+ * 				  covers an equal share of the heap and shows how much of it
+ * 				  lies in allocated blocks; each row ends with the number of
+ * 				  free blocks starting in its address range.
  */
-static block_t *find_fit(size_t asize)
+static void arena_heapmap(FILE *out, arena_t *arena, int width)
 {
+	mm_heapinfo_t info;
+	size_t class_bytes[seg_list_size + 1] = {0}; // small_seg_list comes first
+	size_t class_blocks[seg_list_size + 1] = {0};
+	size_t used[map_rows * map_max_width] = {0};
+	size_t row_free[map_rows] = {0};
+	size_t cells = (size_t)map_rows * width;
+	size_t cell, pos, next;
+	char *start = (char *)arena->heap_start;
 	block_t *block;
-	block_t *block_bestfit = NULL;
-	int if_firstfit = 1;
-	int n = 0;
-	size_t size_diff;
-	int class = get_seg_list(asize);
-	int index;
+	char label[32];
+	int index, row, col;
 
-	if (asize == min_block_size)
+	memset(&info, 0, sizeof(info));
+	arena_heapinfo(arena, &info);
+	cell = max(round_up(info.heap_bytes, cells) / cells, 1);
+
+	for (block = arena->heap_start; get_size(block) > 0; block = find_next(block))
 	{
-		for (block = small_seg_list; block != NULL; block = find_next_free(block))
+		size_t size = get_size(block);
+		size_t lo = (char *)block - start;
+		if (!get_alloc(block))
 		{
-			if (asize <= get_size(block))
+			index = (size == min_block_size) ? 0 : get_seg_list(size) + 1;
+			class_bytes[index] += size;
+			class_blocks[index]++;
+			row_free[lo / cell / width]++;
+			continue;
+		}
+
+		// spread the bytes of the allocated block over the cells it covers
+		for (pos = lo; pos < lo + size; pos = next)
+		{
+			next = (pos / cell + 1) * cell;
+			if (next > lo + size)
 			{
-				block_bestfit = block;
-				return block_bestfit;
+				next = lo + size;
 			}
+			used[pos / cell] += next - pos;
 		}
-		class = 0;
 	}
 
-	// traverse seg_list to find a fit
-	for (index = class; index < seg_list_size; index++)
+	fprintf(out, "  heap: %zu bytes in %zu blocks at %p\n", info.heap_bytes,
+			info.alloc_blocks + info.free_blocks, (void *)start);
+	fprintf(out, "  allocated: %zu bytes in %zu blocks, %zu of them headers (%.1f%%)\n",
+			info.alloc_bytes, info.alloc_blocks, info.alloc_bytes - info.payload_bytes,
+			info.alloc_bytes ? 100.0 * (info.alloc_bytes - info.payload_bytes) / info.alloc_bytes : 0.0);
+	fprintf(out, "  free: %zu bytes in %zu blocks, largest %zu, external fragmentation %.1f%%\n",
+			info.free_bytes, info.free_blocks, info.largest_free,
+			info.free_bytes ? 100.0 * (info.free_bytes - info.largest_free) / info.free_bytes : 0.0);
+
+	fprintf(out, "  free bytes by size class:\n");
+	for (index = 0; index <= seg_list_size; index++)
 	{
-		for (block = seg_list[index]; block != NULL; block = find_next_free(block))
+		if (index == 0)
+		{
+			snprintf(label, sizeof(label), "%zu", min_block_size);
+		}
+		else if (index == seg_list_size)
+		{
+			snprintf(label, sizeof(label), "> %zu", policy_class_max(seg_list_size - 2));
+		}
+		else
 		{
+			snprintf(label, sizeof(label), "<= %zu", policy_class_max(index - 1));
+		}
+		fprintf(out, "    %-8s %12zu bytes %8zu blocks |", label, class_bytes[index], class_blocks[index]);
+		for (col = 0; info.free_bytes && col < (int)(class_bytes[index] * width / info.free_bytes); col++)
+		{
+			fputc('*', out);
+		}
+		fputc('\n', out);
+	}
 
-			if (asize == get_size(block))
-			{ // same size -> best fit
-				block_bestfit = block;
-				return block_bestfit;
+	fprintf(out, "  occupancy, %zu bytes per cell ('#' allocated, '+' over half, '-' under half, '.' free):\n", cell);
+	for (row = 0; row < map_rows && (size_t)row * width * cell < info.heap_bytes; row++)
+	{
+		fprintf(out, "    +%#12zx |", (size_t)row * width * cell);
+		for (col = 0; col < width; col++)
+		{
+			size_t lo = ((size_t)row * width + col) * cell;
+			size_t len = (lo >= info.heap_bytes) ? 0 : info.heap_bytes - lo;
+			size_t u = used[row * width + col];
+			if (len > cell)
+			{
+				len = cell;
 			}
+			fputc(len == 0 ? ' ' : u == 0 ? '.' : u == len ? '#' : 2 * u > len ? '+' : '-', out);
+		}
+		fprintf(out, "| %zu free\n", row_free[row]);
+	}
+}
 
-			if (asize < get_size(block))
-			{
-				n += 1;
-				if (if_firstfit)
-				{
-					block_bestfit = block;
-					if_firstfit = 0;
-					size_diff = get_size(block) - asize;
-				}
+#ifdef GUARD_PAGES
+/*
+ * guard_init: forgets every run and pads the break of the main region to a
+ * 			   page boundary, where the first run will start. Requires
+ * 			   guard_lock.
+ */
+static void guard_init(void)
+{
+	size_t page = mem_pagesize();
+	char *brk = mem_sbrk(0);
+	mem_sbrk((page - (uintptr_t)brk % page) % page);
+
+	guard_fifo_head = 0;
+	guard_fifo_count = 0;
+	memset(guard_lists, 0, sizeof(guard_lists));
+	guard_live_runs = 0;
+	guard_live_pages = 0;
+	guard_live_bytes = 0;
+	guard_ready = true;
+}
 
-				if (get_size(block) - asize < size_diff)
-				{
-					block_bestfit = block;
-				}
+/*
+ * guard_malloc: malloc in guard page mode. Takes a reusable run of enough
+ * 				 pages or extends the heap by a new run and its guard page,
+ * 				 and places the payload at the end of the run. Returns NULL
+ * 				 if the heap is out of memory or the guard page could not be
+ * 				 protected.
+ */
+static void *guard_malloc(size_t size)
+{
+	size_t page = mem_pagesize();
+	size_t asize, pages;
+	char *run;
+	char *bp;
 
-				if (n == nth_fit)
-				{
-					return block_bestfit;
-				}
-			}
-		}
+	if (size == 0 || too_large(size, page))
+	{
+		return NULL;
 	}
+	asize = round_up(size, dsize);
+	pages = (asize + dsize + page - 1) / page;
 
-	return block_bestfit; // no fit found
+	pthread_mutex_lock(&guard_lock);
+	if (!guard_ready)
+	{
+		guard_init();
+	}
+	run = guard_take_run(&pages);
+	if (run == NULL)
+	{
+		run = mem_sbrk((intptr_t)((pages + 1) * page));
+		if (run == (void *)-1)
+		{
+			pthread_mutex_unlock(&guard_lock);
+			return NULL;
+		}
+		if (!mem_protect(run + pages * page, page, false))
+		{
+			// each run takes two mappings, so this fails once vm.max_map_count is reached
+			fprintf(stderr, "guard: could not protect the guard page at %p\n", run + pages * page);
+			pthread_mutex_unlock(&guard_lock);
+			return NULL;
+		}
+	}
+	guard_live_runs++;
+	guard_live_pages += pages;
+	guard_live_bytes += size;
+	pthread_mutex_unlock(&guard_lock);
+
+	bp = run + pages * page - asize;
+	store_word(bp - dsize, size);
+	store_word(bp - wsize, guard_magic ^ size ^ pages);
+	return bp;
 }
 
-/* 
- * mm_checkheap: runs a series of tests to check the validity and consistency
- * 				 of the heap.
- * 				 Returns false if any of the tests fail. Otherwise returns true.
- * 
- * A list of tests:
- * 		1. check if all blocks in seg_list are free
- * 	    2. check if all pointers in seg_list point to valid free blocks
- * 		3. check the size and alignment of each block in seg_list
- * 		4. check if each block in seg_list actually exists in the heap
- * 
- * 		5. check if all blocks in small_seg_list are free
- * 		6. check if all pointers in small_seg_list point to valid free blocks
- * 		7. check the size and alignment of each block in small_seg_list
- * 		8. check if each block in small_seg_list actually exists in the heap
- * 
- *   	9. check if all pointers in heap point to valid heap blocks
- *  	10. check if any contiguous free blocks escaped coalescing
- * 		11. check if every free block is actually in the seg_list or small_seg_list
- * 		12. check if there is any overlap in allocated blocks
+/*
+ * guard_free: free in guard page mode. Aborts if bp is not a payload handed
+ * 			   out by guard_malloc. Otherwise makes its run inaccessible and
+ * 			   queues it in guard_fifo; the run that has waited there for
+ * 			   guard_delay frees is made accessible and listed for reuse.
  */
-bool mm_checkheap(int line)
+static void guard_free(void *bp)
 {
-	dbg_printf("\n!!!!!!!!!CHECKHEAP AT LINE %d!!!!!!!!!!!\n", line);
+	size_t page = mem_pagesize();
+	size_t pages, size;
+	char *run = guard_find_run(bp, &pages, &size);
+	guard_run_t *old;
+	int class;
 
-	block_t *block, *prologue, *epilogue, *b;
-	bool free_list_is_complete = 0;
-	bool free_list_is_valid = 0;
-	int index;
+	if (run == NULL)
+	{
+		fprintf(stderr, "guard: free of %p, which is not an allocated payload\n", bp);
+		abort();
+	}
 
-	prologue = (block_t *)mem_heap_lo();
-	epilogue = (block_t *)mem_heap_hi();
+	pthread_mutex_lock(&guard_lock);
+	mem_protect(run, pages * page, false);
+	guard_live_runs--;
+	guard_live_pages -= pages;
+	guard_live_bytes -= size;
 
-	for (index = 0; index < seg_list_size; index++)
+	if (guard_fifo_count == guard_delay)
 	{
-		for (block = seg_list[index]; block != NULL; block = find_next_free(block))
-		{
-			// check if all blocks in seg_list are free
-			if (get_alloc(block))
-			{
-				dbg_printf("\nConsistency error: allocated block in seg_list!!!\n");
-				return false;
-			}
+		old = (guard_run_t *)guard_fifo[guard_fifo_head];
+		mem_protect(old, guard_fifo_pages[guard_fifo_head] * page, true);
+		old->pages = guard_fifo_pages[guard_fifo_head];
+		class = (old->pages < guard_classes) ? (int)old->pages : guard_classes - 1;
+		old->next = guard_lists[class];
+		guard_lists[class] = old;
+		guard_fifo_head = (guard_fifo_head + 1) % guard_delay;
+		guard_fifo_count--;
+	}
+	guard_fifo[(guard_fifo_head + guard_fifo_count) % guard_delay] = run;
+	guard_fifo_pages[(guard_fifo_head + guard_fifo_count) % guard_delay] = pages;
+	guard_fifo_count++;
+	pthread_mutex_unlock(&guard_lock);
+}
 
-			// check if all pointers in seg_list point to valid free blocks
-			if (block < prologue || block > epilogue)
-			{
-				dbg_printf("\nConsistency error: block in seg_list out of bounds!!!\n");
-				return false;
-			}
+/*
+ * guard_realloc: realloc in guard page mode. Always moves the payload to a
+ * 				  new run, so that stale pointers to the old one fault.
+ */
+static void *guard_realloc(void *ptr, size_t size)
+{
+	size_t pages, copysize;
+	void *newptr;
 
-			// check the size and alignment of each block
-			if (get_size(block) % 16 != 0 || get_size(block) < 16)
-			{
-				dbg_printf("\nConsistency error: invalid size of seg_list block!!!\n");
-				return false;
-			}
+	if (size == 0)
+	{
+		guard_free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL)
+	{
+		return guard_malloc(size);
+	}
+	if (guard_find_run(ptr, &pages, &copysize) == NULL)
+	{
+		fprintf(stderr, "guard: realloc of %p, which is not an allocated payload\n", ptr);
+		abort();
+	}
 
-			// check if each block actually exists in the heap
-			for (b = heap_start; get_size(b) > 0; b = find_next(b))
-			{
-				if (b == block)
-				{
-					free_list_is_valid = 1;
-					break;
-				}
-			}
-			if (free_list_is_valid == 0)
-			{
-				dbg_printf("\nConsistency error: seg_list block doesn't exist in heap'!!!\n");
-			}
-		}
+	newptr = guard_malloc(size);
+	if (newptr == NULL)
+	{
+		return NULL;
 	}
+	memcpy(newptr, ptr, (size < copysize) ? size : copysize);
+	guard_free(ptr);
+	return newptr;
+}
 
-	free_list_is_valid = 0;
-	for (block = small_seg_list; block != NULL; block = find_next_free(block))
+/*
+ * guard_find_run: decodes the size of the payload at bp and the length of
+ * 				   its run from the words before it. Returns the start of
+ * 				   the run, or NULL if bp cannot be a payload of the heap.
+ * 				   Faults if bp is in a freed run.
+ */
+static char *guard_find_run(void *bp, size_t *pages, size_t *size)
+{
+	size_t page = mem_pagesize();
+	char *lo = mem_heap_lo();
+	char *hi = mem_heap_hi();
+	char *end, *run;
+
+	if ((char *)bp < lo + dsize || (char *)bp > hi || (uintptr_t)bp % dsize != 0)
 	{
-		// check if all blocks in small_seg_list are free
-		if (get_alloc(block))
-		{
-			dbg_printf("\nConsistency error: allocated block in small_seg_list!!!\n");
-			return false;
-		}
+		return NULL;
+	}
+	*size = load_word((char *)bp - dsize);
+	*pages = load_word((char *)bp - wsize) ^ guard_magic ^ *size;
 
-		// check if all pointers in small_seg_list point to valid free blocks
-		if (block < prologue || block > epilogue)
-		{
-			dbg_printf("\nConsistency error: block in small_seg_list out of bounds!!!\n");
-			return false;
-		}
+	// the payload must end at a guard page, and its run must lie in the heap
+	end = (char *)bp + round_up(*size, dsize);
+	if (*size == 0 || end < (char *)bp || end > hi || (uintptr_t)end % page != 0 || *pages == 0 ||
+		*pages > (size_t)(end - lo) / page)
+	{
+		return NULL;
+	}
+	run = end - *pages * page;
+	if ((char *)bp - dsize < run)
+	{
+		return NULL;
+	}
+	return run;
+}
 
-		// check the size and alignment of each block
-		if (get_size(block) % 16 != 0 || get_size(block) < 16)
-		{
-			dbg_printf("\nConsistency error: invalid size of small_seg_list block!!!\n");
-			return false;
-		}
+/*
+ * guard_take_run: removes a reusable run of at least *pages pages from the
+ * 				   lists, taking the first that fits, and sets *pages to its
+ * 				   length. Returns NULL if there is none. Requires guard_lock.
+ */
+static char *guard_take_run(size_t *pages)
+{
+	int class = (*pages < guard_classes) ? (int)*pages : guard_classes - 1;
+	guard_run_t **link;
+	guard_run_t *run;
 
-		// check if each block actually exists in the heap
-		for (b = heap_start; get_size(b) > 0; b = find_next(b))
+	for (; class < guard_classes; class++)
+	{
+		for (link = &guard_lists[class]; *link != NULL; link = &(*link)->next)
 		{
-			if (b == block)
+			run = *link;
+			if (run->pages >= *pages)
 			{
-				free_list_is_valid = 1;
-				break;
+				*link = run->next;
+				*pages = run->pages;
+				return (char *)run;
 			}
 		}
-		if (free_list_is_valid == 0)
-		{
-			dbg_printf("\nConsistency error: small_seg_list block doesn't exist in heap'!!!\n");
-		}
 	}
+	return NULL;
+}
 
-	for (block = heap_start; get_size(block) > 0; block = find_next(block))
+/*
+ * guard_check: mm_checkheap in guard page mode. Checks that every freed run
+ * 				is page aligned and lies in the heap, that every reusable
+ * 				run is in the list for its length, and that the runs add up
+ * 				to no more than the heap.
+ */
+static bool guard_check(void)
+{
+	size_t page = mem_pagesize();
+	char *lo = mem_heap_lo();
+	char *hi = mem_heap_hi();
+	size_t total = (guard_live_pages + guard_live_runs) * page;
+	guard_run_t *run;
+	int index, class;
+
+	if (guard_fifo_count < 0 || guard_fifo_count > guard_delay)
 	{
-		// check if all pointers in heap point to valid heap blocks
-		if (block < prologue || block > epilogue)
-		{
-			dbg_printf("\nConsistency error: invalid heap block in heap!!!\n");
-			return false;
-		}
-		if (get_size(block) % 16 != 0 || get_size(block) < 16)
+		dbg_printf("\nConsistency error: guard_fifo count out of range!!!\n");
+		return false;
+	}
+	for (index = 0; index < guard_fifo_count; index++)
+	{
+		char *r = guard_fifo[(guard_fifo_head + index) % guard_delay];
+		size_t pages = guard_fifo_pages[(guard_fifo_head + index) % guard_delay];
+		if (r < lo || r + pages * page > hi || (uintptr_t)r % page != 0 || pages == 0)
 		{
-			dbg_printf("\nConsistency error: invalid size of heap block in heap!!!\n");
+			dbg_printf("\nConsistency error: invalid run in guard_fifo!!!\n");
 			return false;
 		}
-
-		if (!get_alloc(block))
+		total += (pages + 1) * page;
+	}
+	for (class = 0; class < guard_classes; class++)
+	{
+		for (run = guard_lists[class]; run != NULL; run = run->next)
 		{
-			// check if any contiguous free blocks escaped coalescing
-			if (!get_prev_alloc(block) || !get_alloc(find_next(block)))
-			{
-				dbg_printf("\nConsistency error: uncoalesced free block!!!\n");
-				return false;
-			}
-
-			// check if every free block is actually in the seg_list or small_seg_list
-			for (index = 0; index < seg_list_size; index++)
+			if ((char *)run < lo || (char *)run + run->pages * page > hi || (uintptr_t)run % page != 0 ||
+				run->pages == 0 || ((run->pages < guard_classes) ? (int)run->pages : guard_classes - 1) != class)
 			{
-				for (b = seg_list[index]; b != NULL; b = find_next_free(b))
-				{
-					if (b == block)
-					{
-						free_list_is_complete = 1;
-						break;
-					}
-				}
-			}
-
-			if (free_list_is_complete == 0)
-			{
-				for (b = small_seg_list; b != NULL; b = find_next_free(b))
-				{
-					if (b == block)
-					{
-						free_list_is_complete = 1;
-						break;
-					}
-				}
-			}
-
-			if (free_list_is_complete == 0)
-			{
-				dbg_printf("\nConsistency error: incomplete free_list!!!\n");
+				dbg_printf("\nConsistency error: invalid run in guard_lists!!!\n");
 				return false;
 			}
+			total += (run->pages + 1) * page;
 		}
+	}
+	if (total > mem_heapsize())
+	{
+		dbg_printf("\nConsistency error: guard runs exceed the heap!!!\n");
+		return false;
+	}
+	return true;
+}
 
-		// check if there is any overlap in allocated blocks
-		if (get_alloc(block))
+/*
+ * guard_heapinfo: mm_heapinfo in guard page mode. Each run counts as one
+ * 				   block that includes its guard page.
+ */
+static void guard_heapinfo(mm_heapinfo_t *info)
+{
+	size_t page = mem_pagesize();
+	guard_run_t *run;
+	int index, class;
+
+	info->heap_bytes = mem_heapsize();
+	info->alloc_bytes = (guard_live_pages + guard_live_runs) * page;
+	info->payload_bytes = guard_live_bytes;
+	info->alloc_blocks = guard_live_runs;
+	for (index = 0; index < guard_fifo_count; index++)
+	{
+		size_t size = (guard_fifo_pages[(guard_fifo_head + index) % guard_delay] + 1) * page;
+		info->free_bytes += size;
+		info->largest_free = max(info->largest_free, size);
+		info->free_blocks++;
+	}
+	for (class = 0; class < guard_classes; class++)
+	{
+		for (run = guard_lists[class]; run != NULL; run = run->next)
 		{
-			block_t *next;
-			next = find_next(block);
-			if ((block_t *)((char *)block + get_size(block)) > next)
-			{
-				dbg_printf("\nConsistency error: block overlap!!!\n");
-				return false;
-			}
+			size_t size = (run->pages + 1) * page;
+			info->free_bytes += size;
+			info->largest_free = max(info->largest_free, size);
+			info->free_blocks++;
 		}
 	}
-
-	dbg_printf(" \n");
-
-	return true;
 }
+#endif
 
 /*
  * max: returns x if x > y, and y otherwise.
@@ -1092,6 +3006,21 @@ static size_t round_up(size_t size, size_t n)
 	return (n * ((size + (n - 1)) / n));
 }
 
+/*
+ * too_large: returns true, with errno set to ENOMEM, if a block for a payload
+ * 			  of size bytes plus slack bytes would not fit in a size_t, so
+ * 			  that its rounded size would wrap around to a small one.
+ */
+static bool too_large(size_t size, size_t slack)
+{
+	if (slack > SIZE_MAX - dsize - wsize || size > SIZE_MAX - dsize - wsize - slack)
+	{
+		errno = ENOMEM;
+		return true;
+	}
+	return false;
+}
+
 /*
  * pack: returns a header reflecting a specified size and its alloc status.
  *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
@@ -1116,7 +3045,7 @@ static size_t extract_size(word_t word)
  */
 static size_t get_size(block_t *block)
 {
-	return extract_size(block->header);
+	return extract_size(load_word(&block->header));
 }
 
 /*
@@ -1144,7 +3073,7 @@ static bool extract_alloc(word_t word)
  */
 static bool get_alloc(block_t *block)
 {
-	return extract_alloc(block->header);
+	return extract_alloc(load_word(&block->header));
 }
 
 /*
@@ -1153,7 +3082,7 @@ static bool get_alloc(block_t *block)
  */
 static size_t get_prev_alloc(block_t *block)
 {
-	return (block->header & prev_alloc_mask);
+	return (load_word(&block->header) & prev_alloc_mask);
 }
 
 /*
@@ -1162,7 +3091,7 @@ static size_t get_prev_alloc(block_t *block)
  */
 static size_t get_prev_sseg(block_t *block)
 {
-	return (block->header & prev_sseg_mask);
+	return (load_word(&block->header) & prev_sseg_mask);
 }
 
 /*
@@ -1175,14 +3104,14 @@ static void write_header(block_t *block, size_t size, bool alloc)
 	if ((size & size_mask) <= min_block_size)
 	{
 		next = (block_t *)(((char *)block) + dsize);
-		next->header |= prev_sseg_mask;
+		set_header_bits(next, prev_sseg_mask);
 	}
 
-	block->header = pack(size, alloc);
+	store_word(&block->header, pack(size, alloc));
 
 	if (alloc)
 	{
-		find_next(block)->header |= prev_alloc_mask; // if allocated, set prev_alloc of the successor
+		set_header_bits(find_next(block), prev_alloc_mask); // if allocated, set prev_alloc of the successor
 	}
 }
 
@@ -1198,7 +3127,7 @@ static void write_footer(block_t *block, size_t size, bool alloc)
 		return;
 	} // don't write footer to small_seg_list blocks
 	word_t *footerp = (word_t *)((block->data.payload) + get_size(block) - dsize);
-	*footerp = pack(size, alloc);
+	store_word(footerp, pack(size, alloc));
 }
 
 /*
@@ -1219,9 +3148,7 @@ static block_t *find_next(block_t *block)
  */
 static block_t *find_next_free(block_t *block)
 {
-	block_t *block_next_free;
-	block_next_free = block->data.pointers.next;
-	return block_next_free;
+	return follow_link(block, load_word(&block->data.pointers.next));
 }
 
 /*
@@ -1248,7 +3175,7 @@ static block_t *find_prev(block_t *block)
 	else
 	{
 		word_t *footerp = find_prev_footer(block);
-		size = extract_size(*footerp);
+		size = extract_size(load_word(footerp));
 	}
 
 	return (block_t *)((char *)block - size);
@@ -1259,9 +3186,7 @@ static block_t *find_prev(block_t *block)
  */
 static block_t *find_prev_free(block_t *block)
 {
-	block_t *block_prev_free;
-	block_prev_free = block->data.pointers.prev;
-	return block_prev_free;
+	return follow_link(block, load_word(&block->data.pointers.prev));
 }
 
 /*
@@ -1281,3 +3206,210 @@ static void *header_to_payload(block_t *block)
 {
 	return (void *)(block->data.payload);
 }
+
+/*
+ * In sparse mode (built with -DSPARSE_MODE=1, see config.h) the heap is only
+ * emulated by memlib and its addresses cannot be dereferenced, so every
+ * access to heap memory goes through the helpers below.  In the normal
+ * dense build they compile down to plain loads and stores.
+ */
+
+/*
+ * load_word: returns the word stored at heap address addr.
+ */
+static word_t load_word(const void *addr)
+{
+#if SPARSE_MODE
+	return mem_read(addr, sizeof(word_t));
+#else
+	return *(const word_t *)addr;
+#endif
+}
+
+/*
+ * store_word: writes val to the word at heap address addr.
+ */
+static void store_word(void *addr, word_t val)
+{
+#if SPARSE_MODE
+	mem_write(addr, val, sizeof(word_t));
+#else
+	*(word_t *)addr = val;
+#endif
+}
+
+/*
+ * set_header_bits: sets the bits of mask in the header of block.
+ */
+static void set_header_bits(block_t *block, word_t mask)
+{
+	store_word(&block->header, load_word(&block->header) | mask);
+}
+
+/*
+ * clear_header_bits: clears the bits of mask in the header of block.
+ */
+static void clear_header_bits(block_t *block, word_t mask)
+{
+	store_word(&block->header, load_word(&block->header) & ~mask);
+}
+
+/*
+ * set_next_free: links block to next in its free list.
+ */
+static void set_next_free(block_t *block, block_t *next)
+{
+	store_word(&block->data.pointers.next, make_link(block, next));
+}
+
+/*
+ * set_prev_free: links block to prev in its free list.
+ */
+static void set_prev_free(block_t *block, block_t *prev)
+{
+	store_word(&block->data.pointers.prev, make_link(block, prev));
+}
+
+/*
+ * make_link: returns the link from block to target as stored in a free
+ * 			  block: the distance between the two, or 0 for NULL. Links do
+ * 			  not depend on where the heap is mapped (see mm_resume).
+ */
+static word_t make_link(block_t *block, block_t *target)
+{
+	return (target == NULL) ? 0 : (word_t)((char *)target - (char *)block);
+}
+
+/*
+ * follow_link: returns the block that the link stored in block points to.
+ */
+static block_t *follow_link(block_t *block, word_t link)
+{
+	return (link == 0) ? NULL : (block_t *)((char *)block + link);
+}
+
+/*
+ * move_payload: moves n bytes from the payload at src to the payload at dst,
+ * 				 at the same offset within a page. The whole pages in between
+ * 				 are moved by move_pages and only the partial pages at either
+ * 				 end are copied. Leaves stale data in the middle of src.
+ */
+static void move_payload(void *dst, void *src, size_t n, size_t page)
+{
+	char *first = (char *)round_up((uintptr_t)src, page);
+	char *last = (char *)(((uintptr_t)src + n) & ~(uintptr_t)(page - 1));
+	ptrdiff_t offset = (char *)dst - (char *)src;
+
+	if (first >= last)
+	{
+		stream_copy(dst, src, n);
+		return;
+	}
+	copy_payload(dst, src, first - (char *)src);
+	move_pages(first + offset, first, last - first, page);
+	copy_payload(last + offset, last, (char *)src + n - last);
+}
+
+/*
+ * move_pages: moves len bytes of whole pages from src to dst by remapping
+ * 			   them. memlib can only remap a range within one mapping, and
+ * 			   earlier moves split the heap into many, so a range that fails
+ * 			   is halved until the pieces fit; pieces too small to be worth
+ * 			   a remap are copied instead. Pages that memlib moved out of
+ * 			   src but could not put at dst are copied from where it left
+ * 			   them, so a failed remap never loses the payload.
+ */
+static void move_pages(char *dst, char *src, size_t len, size_t page)
+{
+	size_t half;
+	void *parked;
+
+	if (len < max(remap_min_size, 2 * page))
+	{
+		stream_copy(dst, src, len);
+		return;
+	}
+	if (mem_remap(dst, src, len, &parked))
+	{
+		return;
+	}
+	if (parked != NULL)
+	{
+		// the pages left src but did not reach dst: copy them from where
+		// memlib parked them instead
+		stream_copy(dst, parked, len);
+		mem_unpark(parked, len);
+		return;
+	}
+
+	half = (len / 2) & ~(page - 1);
+	move_pages(dst, src, half, page);
+	move_pages(dst + half, src + half, len - half, page);
+}
+
+/*
+ * stream_copy: copies n bytes between two large payloads with non-temporal
+ * 				stores, which do not evict the rest of the heap from the cache.
+ */
+static void stream_copy(void *dst, const void *src, size_t n)
+{
+#if defined(__SSE2__) && !SPARSE_MODE
+	if ((((uintptr_t)dst | (uintptr_t)src) & 15) == 0)
+	{
+		__m128i *d = (__m128i *)dst;
+		const __m128i *s = (const __m128i *)src;
+		size_t i, lines = n / 64;
+		for (i = 0; i < lines; i++, d += 4, s += 4)
+		{
+			__m128i x0 = _mm_load_si128(s);
+			__m128i x1 = _mm_load_si128(s + 1);
+			__m128i x2 = _mm_load_si128(s + 2);
+			__m128i x3 = _mm_load_si128(s + 3);
+			_mm_stream_si128(d, x0);
+			_mm_stream_si128(d + 1, x1);
+			_mm_stream_si128(d + 2, x2);
+			_mm_stream_si128(d + 3, x3);
+		}
+		_mm_sfence();
+		memcpy(d, s, n % 64);
+		return;
+	}
+#endif
+	copy_payload(dst, src, n);
+}
+
+/*
+ * copy_payload: copies n bytes between two payloads.
+ */
+static void copy_payload(void *dst, const void *src, size_t n)
+{
+#if SPARSE_MODE
+	mem_memcpy(dst, src, n);
+#else
+	memcpy(dst, src, n);
+#endif
+}
+
+/*
+ * zero_payload: clears the first n bytes of a payload.
+ */
+static void zero_payload(void *dst, size_t n)
+{
+#if SPARSE_MODE
+	mem_memset(dst, 0, n);
+#else
+	memset(dst, 0, n);
+#endif
+}
+
+/*
+ * poison_payload: fills the first n bytes of a payload with quarantine_poison.
+ */
+static void poison_payload(void *dst, size_t n)
+{
+#if SPARSE_MODE
+	mem_memset(dst, quarantine_poison & 0xff, n);
+#else
+	memset(dst, quarantine_poison & 0xff, n);
+#endif
+}
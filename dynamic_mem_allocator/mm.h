@@ -8,6 +8,12 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -16,6 +22,12 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
@@ -23,3 +35,36 @@ extern bool mm_init(void);
 
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
+
+/* Summary of the blocks in the heap, as filled in by mm_heapinfo */
+typedef struct {
+    size_t heap_bytes;     /* bytes covered by the blocks of every arena */
+    size_t alloc_bytes;    /* bytes in allocated blocks, headers included */
+    size_t payload_bytes;  /* usable payload bytes of the allocated blocks */
+    size_t free_bytes;     /* bytes in free blocks */
+    size_t largest_free;   /* size of the largest free block */
+    size_t alloc_blocks;   /* number of allocated blocks */
+    size_t free_blocks;    /* number of free blocks */
+} mm_heapinfo_t;
+
+/* These are for fragmentation analysis.  Not safe against concurrent calls */
+extern void mm_heapinfo(mm_heapinfo_t *info);
+extern void mm_heapmap(FILE *out, int width);
+
+/* Hold freed blocks poisoned in quarantine, up to budget bytes per arena; 0 = off.
+   libmm.so takes the budget from MM_QUARANTINE instead */
+extern void mm_set_quarantine(size_t budget);
+
+/* Heaps that outlive the process in the file given to mem_init_file */
+extern bool mm_resume(void);
+extern bool mm_sync(void);
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+
+/* Testing: attach threads round-robin to arenas of nodes made-up NUMA nodes,
+   so that frees across threads of one node take the remote path; 0 = the
+   real nodes.  Should be called before any threads are started */
+extern void mm_set_arena_nodes(int nodes);
+
+/* Heaps shared between processes in the memory given to mem_init_shared */
+extern bool mm_attach(void);
@@ -0,0 +1,455 @@
+/*
+ * mmtrace.c - capture the allocation requests of any program as a trace
+ *             that mdriver can replay
+ *
+ * Build libmmtrace.so with make and run the program with it preloaded:
+ *
+ *     MMTRACE_FILE=app.rep LD_PRELOAD=./libmmtrace.so app ...
+ *
+ * When the program exits, its requests are written to MMTRACE_FILE
+ * (default mmtrace.rep) in the .rep format, and also in the binary format
+ * of bintrace.h to MMTRACE_BINFILE if that is set.  A %p in either name
+ * is replaced by the process id, so that each program a command runs
+ * (e.g. cc1 and as under gcc) writes its own trace.  A child that forks
+ * without exec is not traced.
+ *
+ * malloc, calloc, realloc, free and the aligned allocation functions are
+ * interposed and passed on to the C library's own entry points
+ * (__libc_malloc and friends).  Every block is given an id from a global
+ * counter, kept in a 16-byte header in front of the payload, so free and
+ * realloc find the id of a block without any shared table.  calloc and
+ * the aligned allocations are recorded as plain allocations.
+ *
+ * Each thread appends its requests to its own buffer without locking,
+ * tagged with a global sequence number.  A full buffer is appended to a
+ * spool file with a single write.  At exit, the spool is sorted back
+ * into the order of the sequence numbers, which respects the order in
+ * which the requests happened, e.g. a block is always allocated before
+ * another thread frees it, and converted into the trace.
+ *
+ * The headers make each block 16 bytes larger (more for large alignments)
+ * in the traced program; the trace holds the sizes that were asked for.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bintrace.h"
+
+/* The C library's allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define HEADER_SIZE 16
+#define HEADER_MAGIC 0x6d6d7472u    /* "mmtr" */
+#define BUFFER_RECORDS 4096
+
+/* Header in front of every block handed out by the interposed functions */
+typedef struct {
+    uint64_t id;                    /* id of the block in the trace */
+    uint32_t offset;                /* bytes from the start of the libc block */
+    uint32_t magic;                 /* HEADER_MAGIC */
+} header_t;
+
+/* One request, as spooled: type in the low 2 bits of seq_type */
+typedef struct {
+    uint64_t seq_type;
+    uint64_t id;
+    uint64_t size;
+} record_t;
+
+/* Per-thread buffer of requests, on a list of every thread's buffer */
+typedef struct buffer {
+    struct buffer *next;
+    size_t count;
+    record_t records[BUFFER_RECORDS];
+} buffer_t;
+
+static uint64_t next_seq = 0;       /* global order of requests */
+static uint64_t next_id = 0;        /* ids of blocks */
+static buffer_t *buffers = NULL;    /* every thread's buffer */
+static int spool_fd = -1;
+static char rep_name[4096];
+static char bin_name[4096];
+static char spool_name[sizeof(rep_name) + 32];
+static bool tracing = false;        /* between mmtrace_init and mmtrace_fini */
+static __thread buffer_t *thread_buffer = NULL;
+static __thread bool in_tracer = false; /* don't record the tracer's own calls */
+
+static void record(int type, uint64_t id, size_t size);
+static void flush_buffer(buffer_t *buffer);
+static void *wrap(char *base, size_t offset, uint64_t id);
+static header_t *find_header(void *ptr);
+static void write_traces(void);
+static void expand_name(char *buf, size_t len, const char *name);
+static void stop_in_child(void);
+
+/*
+ * mmtrace_init - open the spool when the library is loaded
+ */
+__attribute__((constructor))
+static void mmtrace_init(void)
+{
+    const char *name = getenv("MMTRACE_FILE");
+    const char *binname = getenv("MMTRACE_BINFILE");
+    in_tracer = true;
+    expand_name(rep_name, sizeof(rep_name), name != NULL ? name : "mmtrace.rep");
+    if (binname != NULL)
+        expand_name(bin_name, sizeof(bin_name), binname);
+    snprintf(spool_name, sizeof(spool_name), "%s.%d.spool", rep_name, (int) getpid());
+    pthread_atfork(NULL, NULL, stop_in_child);
+    spool_fd = open(spool_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (spool_fd < 0)
+        fprintf(stderr, "mmtrace: could not create %s: %s\n", spool_name, strerror(errno));
+    else
+        __atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
+    in_tracer = false;
+}
+
+/*
+ * expand_name - copy name to buf, replacing %p by the process id
+ */
+static void expand_name(char *buf, size_t len, const char *name)
+{
+    size_t n = 0;
+    for (; *name != '\0' && n + 1 < len; name++) {
+        if (name[0] == '%' && name[1] == 'p') {
+            n += snprintf(buf + n, len - n, "%d", (int) getpid());
+            if (n >= len) {
+                n = len - 1;
+                break;
+            }
+            name++;
+        } else {
+            buf[n++] = *name;
+        }
+    }
+    buf[n] = '\0';
+}
+
+/*
+ * stop_in_child - stop tracing in the child of a fork, leaving the
+ *     parent's spool to the parent
+ */
+static void stop_in_child(void)
+{
+    __atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+    close(spool_fd);
+}
+
+/*
+ * mmtrace_fini - stop tracing at exit and write the traces. Requests made
+ *     by other threads while this runs may be left out.
+ */
+__attribute__((destructor))
+static void mmtrace_fini(void)
+{
+    buffer_t *buffer;
+    if (!__atomic_exchange_n(&tracing, false, __ATOMIC_ACQ_REL))
+        return;
+    in_tracer = true;
+    for (buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buffer != NULL;
+         buffer = buffer->next)
+        flush_buffer(buffer);
+    write_traces();
+    close(spool_fd);
+    unlink(spool_name);
+}
+
+/*
+ * record - append one request to the calling thread's buffer
+ */
+static void record(int type, uint64_t id, size_t size)
+{
+    buffer_t *buffer = thread_buffer;
+    record_t *r;
+
+    if (in_tracer || !__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+        return;
+    if (buffer == NULL) {
+        if ((buffer = __libc_malloc(sizeof(buffer_t))) == NULL)
+            return;
+        buffer->count = 0;
+        buffer->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &buffer->next, buffer, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        thread_buffer = buffer;
+    }
+    r = &buffer->records[buffer->count];
+    r->seq_type = (__atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED) << 2) | type;
+    r->id = id;
+    r->size = size;
+    if (++buffer->count == BUFFER_RECORDS)
+        flush_buffer(buffer);
+}
+
+/*
+ * flush_buffer - append the records of a buffer to the spool in one write
+ */
+static void flush_buffer(buffer_t *buffer)
+{
+    size_t len = buffer->count * sizeof(record_t);
+    if (len > 0 && write(spool_fd, buffer->records, len) != (ssize_t) len)
+        fprintf(stderr, "mmtrace: could not write %s\n", spool_name);
+    buffer->count = 0;
+}
+
+/*
+ * wrap - set up the header of a new block whose libc block starts at base
+ *     and return its payload, or NULL if base is NULL
+ */
+static void *wrap(char *base, size_t offset, uint64_t id)
+{
+    header_t *header;
+    if (base == NULL)
+        return NULL;
+    header = (header_t *) (base + offset) - 1;
+    header->id = id;
+    header->offset = offset;
+    header->magic = HEADER_MAGIC;
+    return base + offset;
+}
+
+/*
+ * find_header - return the header of a block handed out by the interposed
+ *     functions, or NULL if ptr was not (e.g. NULL)
+ */
+static header_t *find_header(void *ptr)
+{
+    header_t *header = (header_t *) ptr - 1;
+    if (ptr == NULL || header->magic != HEADER_MAGIC)
+        return NULL;
+    return header;
+}
+
+static void *aligned(size_t alignment, size_t size)
+{
+    size_t offset = (alignment > HEADER_SIZE) ? alignment : HEADER_SIZE;
+    uint64_t id;
+    void *p;
+    if (size + offset < size)
+        return NULL;
+    id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    p = wrap(__libc_memalign(alignment, size + offset), offset, id);
+    if (p != NULL)
+        record(BINTRACE_ALLOC, id, size);
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    uint64_t id;
+    void *p;
+    if (size + HEADER_SIZE < size)
+        return NULL;
+    id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    p = wrap(__libc_malloc(size + HEADER_SIZE), HEADER_SIZE, id);
+    if (p != NULL)
+        record(BINTRACE_ALLOC, id, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    uint64_t id;
+    void *p;
+    if (size != 0 && nmemb > (SIZE_MAX - HEADER_SIZE) / size)
+        return NULL;
+    id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    p = wrap(__libc_calloc(1, nmemb * size + HEADER_SIZE), HEADER_SIZE, id);
+    if (p != NULL)
+        record(BINTRACE_ALLOC, id, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    header_t *header = find_header(ptr);
+    if (header == NULL) {
+        if (ptr != NULL)
+            __libc_free(ptr);   /* not ours */
+        return;
+    }
+    record(BINTRACE_FREE, header->id, 0);
+    header->magic = 0;
+    __libc_free((char *) ptr - header->offset);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    header_t *header = find_header(ptr);
+    size_t offset;
+    uint64_t id;
+    char *base;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (header == NULL)
+        return __libc_realloc(ptr, size);   /* not ours */
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    offset = header->offset;
+    id = header->id;
+    if (size + offset < size)
+        return NULL;
+    /* the header moves with the block */
+    if ((base = __libc_realloc((char *) ptr - offset, size + offset)) == NULL)
+        return NULL;
+    record(BINTRACE_REALLOC, id, size);
+    return base + offset;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if ((p = aligned(alignment, size)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    header_t *header = find_header(ptr);
+    size_t (*usable)(void *) = NULL;
+    bool saved = in_tracer;
+    if (ptr == NULL)
+        return 0;
+    in_tracer = true;
+    usable = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    in_tracer = saved;
+    if (header == NULL)
+        return usable(ptr);
+    return usable((char *) ptr - header->offset) - header->offset;
+}
+
+/*
+ * compare_records - order records by sequence number
+ */
+static int compare_records(const void *a, const void *b)
+{
+    uint64_t x = ((const record_t *) a)->seq_type, y = ((const record_t *) b)->seq_type;
+    return (x > y) - (x < y);
+}
+
+/*
+ * write_traces - sort the spool into the order of the requests and write
+ *     it as a .rep trace, and as a binary trace if MMTRACE_BINFILE is set.
+ *     Ids are renumbered densely in order of first use, as mdriver wants.
+ */
+static void write_traces(void)
+{
+    struct stat st;
+    record_t *records;
+    uint64_t *ids;          /* trace id + 1 of each block id, 0 if none yet */
+    size_t *sizes;          /* live size of each trace id */
+    size_t n, i, max_id = 0, live = 0, peak = 0;
+    int num_ids = 0;
+    bintrace_header_t header;
+    bintrace_writer_t writer;
+    FILE *rep, *bin = NULL;
+
+    if (fstat(spool_fd, &st) != 0 || st.st_size == 0)
+        return;
+    n = st.st_size / sizeof(record_t);
+    records = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, spool_fd, 0);
+    if (records == MAP_FAILED)
+        return;
+    qsort(records, n, sizeof(record_t), compare_records);
+
+    for (i = 0; i < n; i++)
+        if (records[i].id > max_id)
+            max_id = records[i].id;
+    ids = __libc_calloc(max_id + 1, sizeof(*ids));
+    sizes = __libc_calloc(max_id + 1, sizeof(*sizes));
+    if (ids == NULL || sizes == NULL) {
+        fprintf(stderr, "mmtrace: out of memory writing the trace\n");
+        munmap(records, st.st_size);
+        return;
+    }
+
+    /* first pass: renumber ids and find the peak payload */
+    for (i = 0; i < n; i++) {
+        record_t *r = &records[i];
+        if (ids[r->id] == 0)
+            ids[r->id] = ++num_ids;
+        r->id = ids[r->id] - 1;
+        switch (r->seq_type & 3) {
+        case BINTRACE_ALLOC:
+        case BINTRACE_REALLOC:
+            live += r->size - sizes[r->id];
+            sizes[r->id] = r->size;
+            break;
+        case BINTRACE_FREE:
+            live -= sizes[r->id];
+            sizes[r->id] = 0;
+            break;
+        }
+        if (live > peak)
+            peak = live;
+    }
+
+    if ((rep = fopen(rep_name, "w")) == NULL) {
+        fprintf(stderr, "mmtrace: could not create %s\n", rep_name);
+        munmap(records, st.st_size);
+        return;
+    }
+    header.weight = 1;
+    header.num_ids = num_ids;
+    header.num_ops = n;
+    header.data_bytes = peak;
+    if (bin_name[0] != '\0' && ((bin = fopen(bin_name, "wb")) == NULL ||
+                                 !bintrace_write_header(&writer, bin, &header))) {
+        fprintf(stderr, "mmtrace: could not create %s\n", bin_name);
+        bin = NULL;
+    }
+    fprintf(rep, "%d\n%d\n%d\n%zu\n", header.weight, num_ids, header.num_ops, peak);
+    for (i = 0; i < n; i++) {
+        int type = records[i].seq_type & 3;
+        if (type == BINTRACE_FREE)
+            fprintf(rep, "f %lu\n", (unsigned long) records[i].id);
+        else
+            fprintf(rep, "%c %lu %lu\n", type == BINTRACE_ALLOC ? 'a' : 'r',
+                    (unsigned long) records[i].id, (unsigned long) records[i].size);
+        if (bin != NULL)
+            bintrace_write_op(&writer, type, records[i].id, records[i].size);
+    }
+    fclose(rep);
+    if (bin != NULL)
+        fclose(bin);
+    munmap(records, st.st_size);
+    __libc_free(ids);
+    __libc_free(sizes);
+}
@@ -0,0 +1,91 @@
+/*
+ * Hardware performance counters (see perfctr.h)
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+const char *perfctr_names[PERFCTR_EVENTS] = {
+    "cycles", "instructions", "cache-misses", "L1-dcache-load-misses",
+    "dTLB-load-misses", "branch-misses"
+};
+
+#define CACHE_EVENT(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERFCTR_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+int perfctr_open(perfctr_t *ctr) {
+    struct perf_event_attr attr;
+    int i, opened = 0;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        ctr->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (ctr->fds[i] >= 0)
+            opened++;
+    }
+    return opened;
+}
+
+void perfctr_start(perfctr_t *ctr) {
+    int i;
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (ctr->fds[i] >= 0) {
+            ioctl(ctr->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(ctr->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perfctr_stop(perfctr_t *ctr, int64_t counts[PERFCTR_EVENTS]) {
+    uint64_t value[3];          /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+        if (ctr->fds[i] >= 0)
+            ioctl(ctr->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        counts[i] = -1;
+        if (ctr->fds[i] < 0 || read(ctr->fds[i], value, sizeof(value)) != sizeof(value))
+            continue;
+        if (value[2] == 0)      /* never scheduled on the PMU */
+            continue;
+        if (value[2] < value[1])
+            value[0] = (uint64_t) ((double) value[0] * value[1] / value[2]);
+        counts[i] = (int64_t) value[0];
+    }
+}
+
+void perfctr_close(perfctr_t *ctr) {
+    int i;
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (ctr->fds[i] >= 0)
+            close(ctr->fds[i]);
+        ctr->fds[i] = -1;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Hardware performance counters of the calling thread, through
+ * perf_event_open(2)
+ *
+ * Each event is opened as a counter of its own, so that the events the
+ * CPU or the kernel does not offer are left out one by one.  Counters
+ * only count user-space events, which is all that perf_event_paranoid
+ * allows unprivileged users by default, and their counts are scaled up
+ * if the kernel had to multiplex them.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_CACHE_MISSES,
+    PERFCTR_L1D_MISSES,        /* L1 data cache load misses */
+    PERFCTR_DTLB_MISSES,       /* data TLB load misses */
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_EVENTS
+};
+
+/* Names of the events, as perf(1) spells them */
+extern const char *perfctr_names[PERFCTR_EVENTS];
+
+typedef struct {
+    int fds[PERFCTR_EVENTS];   /* -1 for the events that could not be opened */
+} perfctr_t;
+
+/* Opens the counters, stopped.  Returns the number that could be opened */
+int perfctr_open(perfctr_t *ctr);
+
+/* Zeroes and starts every open counter */
+void perfctr_start(perfctr_t *ctr);
+
+/* Stops the counters and reads them into counts, with -1 for the events
+   that are not counted */
+void perfctr_stop(perfctr_t *ctr, int64_t counts[PERFCTR_EVENTS]);
+
+void perfctr_close(perfctr_t *ctr);
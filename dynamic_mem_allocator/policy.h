@@ -0,0 +1,188 @@
+#ifndef __POLICY_H_
+#define __POLICY_H_
+
+/*
+ * policy.h - compile-time allocation policy of mm.c
+ *
+ * The block layout of mm.c (16-byte alignment, 16-byte minimum blocks kept
+ * on small_seg_list) is fixed; what varies between variants is how free
+ * blocks larger than that are sorted into size classes, how far find_fit
+ * searches for a better fit, and how much the heap grows at a time.
+ *
+ * A variant is chosen by defining MM_POLICY when compiling mm.c, e.g.
+ * -DMM_POLICY=MM_POLICY_TLSF.  Every parameter is a compile-time constant,
+ * so each variant is constant-folded into its own copy of the allocator.
+ * The Makefile links each one into its own driver (mdriver-small,
+ * mdriver-tlsf, mdriver-bestfit, mdriver-ctree).
+ *
+ * MM_POLICY_CTREE also changes how the free blocks are kept: instead of
+ * lists, the blocks larger than 16 bytes form a single cartesian tree
+ * (see tree_insert in mm.c), so it has one size class.
+ */
+
+#include <stddef.h>
+
+#define MM_POLICY_DEFAULT 0  /* power-of-two classes, 25th fit */
+#define MM_POLICY_SMALL   1  /* small heap growth and deeper search, for footprint */
+#define MM_POLICY_TLSF    2  /* four classes per power of two, first fit in class */
+#define MM_POLICY_BESTFIT 3  /* power-of-two classes, best fit over all lists */
+#define MM_POLICY_CTREE   4  /* cartesian tree of free blocks, better fit */
+
+#ifndef MM_POLICY
+#define MM_POLICY MM_POLICY_DEFAULT
+#endif
+
+/*
+ * seg_list_size - number of size classes for block sizes > 16 bytes
+ * nth_fit       - find_fit returns the best of the first nth_fit fits
+ * chunk_bytes   - minimum heap size to expand by; must be a multiple of 16
+ */
+#if MM_POLICY == MM_POLICY_SMALL
+#define seg_list_size 11
+#define nth_fit 100
+#define chunk_bytes (1 << 9)
+#elif MM_POLICY == MM_POLICY_TLSF
+#define seg_list_size 64
+#define nth_fit 1
+#define chunk_bytes (1 << 12)
+#elif MM_POLICY == MM_POLICY_BESTFIT
+#define seg_list_size 11
+#define nth_fit __INT_MAX__
+#define chunk_bytes (1 << 12)
+#elif MM_POLICY == MM_POLICY_CTREE
+#define seg_list_size 1 // seg_list[0] is the root of the tree
+#define nth_fit 1		// unused, the tree is searched by tree_fit
+#define chunk_bytes (1 << 12)
+#else
+#define seg_list_size 11
+#define nth_fit 25
+#define chunk_bytes (1 << 12)
+#endif
+
+#if MM_POLICY == MM_POLICY_TLSF
+
+/*
+ * policy_size_class: 16-byte steps up to 128 bytes, then four classes for
+ *                    each power of two, as the second level of a TLSF
+ *                    allocator. Sizes past the last class share it.
+ *                    Returns -1 for blocks of 16 bytes or less.
+ */
+static inline int policy_size_class(size_t size)
+{
+	if (size <= 16)
+	{
+		return -1;
+	}
+	if (size <= 128)
+	{
+		return (int)((size - 1) / 16) - 1;
+	}
+	int fl = 63 - __builtin_clzl(size - 1); // 2^fl < size <= 2^(fl+1)
+	int sl = (int)(((size - 1) >> (fl - 2)) & 3);
+	int class = 7 + (fl - 7) * 4 + sl;
+	return (class < seg_list_size) ? class : seg_list_size - 1;
+}
+
+/*
+ * policy_class_max: the largest block size in a class below the last.
+ */
+static inline size_t policy_class_max(int class)
+{
+	if (class < 7)
+	{
+		return (size_t)(class + 2) * 16;
+	}
+	int fl = 7 + (class - 7) / 4;
+	int sl = (class - 7) % 4;
+	return ((size_t)1 << fl) + ((size_t)(sl + 1) << (fl - 2));
+}
+
+#elif MM_POLICY == MM_POLICY_CTREE
+
+/*
+ * policy_size_class: a single class for all blocks larger than 16 bytes.
+ *                    Returns -1 for blocks of 16 bytes or less.
+ */
+static inline int policy_size_class(size_t size)
+{
+	return (size <= 16) ? -1 : 0;
+}
+
+/*
+ * policy_class_max: there is no class below the last; the smallest size
+ *                   past the small blocks is over 16 bytes.
+ */
+static inline size_t policy_class_max(int class)
+{
+	return 16;
+}
+
+#else
+
+/*
+ * policy_size_class: one class for each larger size: [(2^i)+1, 2^(i+1)].
+ *                    Returns -1 for blocks of 16 bytes or less.
+ */
+static inline int policy_size_class(size_t size)
+{
+	if ((size > 16) && (size <= 32))
+	{
+		return 0;
+	}
+	else if ((size > 32) && (size <= 64))
+	{
+		return 1;
+	}
+	else if ((size > 64) && (size <= 128))
+	{
+		return 2;
+	}
+	else if ((size > 128) && (size <= 256))
+	{
+		return 3;
+	}
+	else if ((size > 256) && (size <= 512))
+	{
+		return 4;
+	}
+	else if ((size > 512) && (size <= 1024))
+	{
+		return 5;
+	}
+	else if ((size > 1024) && (size <= 2048))
+	{
+		return 6;
+	}
+	else if ((size > 2048) && (size <= 4098))
+	{
+		return 7;
+	}
+	else if ((size > 4098) && (size <= 8192))
+	{
+		return 8;
+	}
+	else if ((size > 8192) && (size <= 16384))
+	{
+		return 9;
+	}
+	else if (size > 16384)
+	{
+		return 10;
+	}
+	else
+	{
+		return -1;
+	}
+}
+
+/*
+ * policy_class_max: the largest block size in a class below the last.
+ */
+static inline size_t policy_class_max(int class)
+{
+	return (size_t)32 << class;
+}
+
+#endif
+
+#endif /* __POLICY_H_ */
@@ -0,0 +1,71 @@
+/*
+ * rep2bin - convert a .rep trace to the binary trace format of bintrace.h,
+ *           which mdriver maps and replays without parsing
+ *
+ * usage: rep2bin <in.rep> <out.bin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bintrace.h"
+
+static void die(const char *msg, const char *name) __attribute__((noreturn));
+
+static void die(const char *msg, const char *name) {
+    fprintf(stderr, "rep2bin: %s %s\n", msg, name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    FILE *in, *out;
+    bintrace_header_t header;
+    bintrace_writer_t writer;
+    char type[16];
+    long index;
+    size_t size;
+    int ops = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+        return 1;
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die("could not open", argv[1]);
+    if (fscanf(in, "%d %d %d %zu", &header.weight, &header.num_ids,
+               &header.num_ops, &header.data_bytes) != 4)
+        die("bad header in", argv[1]);
+    if ((out = fopen(argv[2], "wb")) == NULL)
+        die("could not create", argv[2]);
+    if (!bintrace_write_header(&writer, out, &header))
+        die("could not write", argv[2]);
+
+    while (ops < header.num_ops && fscanf(in, "%15s", type) == 1) {
+        bool ok;
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(in, "%ld %zu", &index, &size) != 2)
+                die("bad request in", argv[1]);
+            ok = bintrace_write_op(&writer, type[0] == 'a' ? BINTRACE_ALLOC
+                                   : BINTRACE_REALLOC, index, size);
+            break;
+        case 'f':
+            if (fscanf(in, "%ld", &index) != 1)
+                die("bad request in", argv[1]);
+            ok = bintrace_write_op(&writer, BINTRACE_FREE, index, 0);
+            break;
+        default:
+            die("bogus request type in", argv[1]);
+        }
+        if (!ok)
+            die("could not write", argv[2]);
+        ops++;
+    }
+    if (ops != header.num_ops)
+        die("too few requests in", argv[1]);
+    fclose(in);
+    if (fclose(out) != 0)
+        die("could not write", argv[2]);
+    return 0;
+}
@@ -45,9 +45,11 @@ bool tree_insert(tree_t *tree, tkey_t key, void *record) {
     while (z) {
 	p = z;
 	tree->comparison_count++;
-	if (key == z->key)
+	if (key == z->key) {
 	    /* Already have key in tree */
+	    splay(tree, z);
 	    return false;
+	}
 	tree->comparison_count++;
 	if (key > z->key)
 	    z = z->right;
@@ -72,28 +74,40 @@ bool tree_insert(tree_t *tree, tkey_t key, void *record) {
     return true;
 }
   
+/* Lookups splay the last node on their search path, found or not, so
+   that the whole path is restructured and the amortized O(log n) bound
+   holds; splaying any other node would leave the rest of the path as
+   long for the next lookup */
 void *tree_find(tree_t *tree, tkey_t key) {
     node_t *z = tree->root;
+    node_t *last = NULL;
     while (z) {
+	last = z;
 	tree->comparison_count++;
 	if (key == z->key)
-	    return z->record;
+	    break;
 	tree->comparison_count++;
 	if (key > z->key)
 	    z = z->right;
 	else
 	    z = z->left;
     }
-    return NULL;
+    if (last)
+	splay(tree, last);
+    return z ? z->record : NULL;
 }
 
 void *tree_find_nearest(tree_t *tree, tkey_t key) {
     node_t *z = tree->root;
     node_t *n = NULL;
+    node_t *last = NULL;
     while (z) {
+	last = z;
 	tree->comparison_count++;
-	if (key == z->key)
-	    return z->record;
+	if (key == z->key) {
+	    n = z;
+	    break;
+	}
 	tree->comparison_count++;
 	if (key > z->key) {
 	    if (!n || n->key < z->key)
@@ -103,22 +117,29 @@ void *tree_find_nearest(tree_t *tree, tkey_t key) {
 	else
 	    z = z->left;
     }
+    if (last)
+	splay(tree, last);
     return n ? n->record : NULL;
 }
 
         
 void *tree_remove(tree_t *tree, tkey_t key) {
     node_t *z = tree->root;
+    node_t *last = NULL;
     void *r = NULL;
     while (z && z->key != key) {
+	last = z;
 	tree->comparison_count++;
 	if (key > z->key)
 	    z = z->right;
 	else
 	    z = z->left;
     }
-    if (!z)
+    if (!z) {
+	if (last)
+	    splay(tree, last);
 	return r;
+    }
     splay(tree, z);
     if (!z->left) replace(tree, z, z->right);
     else if (!z->right) replace(tree, z, z->left);
@@ -0,0 +1,121 @@
+/*
+ * streetest - check the answers of the splay tree of stree.c against a
+ *             plain array, and that its lookups keep the amortized
+ *             O(log n) bound on comparison_count
+ *
+ * usage: ./streetest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "stree.h"
+
+#define KEYS 100000     /* keys in the tree of the bound checks */
+#define LOOKUPS 100000  /* lookups in each bound check */
+#define SPAN 4096       /* keys 0..SPAN-1 of the random check */
+#define RANDOM_OPS 200000
+
+static int failures = 0;
+
+/* check_bound - lookups since start must average O(log KEYS) comparisons */
+static void check_bound(const char *what, tree_t *tree, size_t start) {
+    double per_op = (double) (tree->comparison_count - start) / LOOKUPS;
+    double bound = 6.0 * log2(KEYS); /* a splay step is 3 log n, each of 2 tests */
+
+    if (per_op > bound) {
+        fprintf(stderr, "streetest: %s took %.0f comparisons per lookup, "
+                "more than %.0f\n", what, per_op, bound);
+        failures++;
+    }
+}
+
+/* Records are the keys themselves, offset so that key 0 is not NULL */
+static void *record(long key) {
+    return (void *) (key + 1);
+}
+
+int main(void) {
+    static bool present[SPAN];
+    tree_t *tree = tree_new();
+    size_t start;
+    long key, i;
+
+    /* A tree built in increasing order is a path until it is splayed */
+    for (key = 2; key <= 2 * KEYS; key += 2)
+        tree_insert(tree, key, record(key));
+    tree_insert(tree, 0, record(0));
+
+    start = tree->comparison_count;
+    for (i = 0; i < LOOKUPS; i++)
+        if (tree_find_nearest(tree, 1) != record(0)) {
+            fprintf(stderr, "streetest: wrong nearest key to 1\n");
+            failures++;
+            break;
+        }
+    check_bound("repeated tree_find_nearest", tree, start);
+
+    start = tree->comparison_count;
+    for (i = 0; i < LOOKUPS; i++) {
+        key = random() % (2 * KEYS + 2);
+        if (tree_find_nearest(tree, key) != record(key & ~1L)) {
+            fprintf(stderr, "streetest: wrong nearest key to %ld\n", key);
+            failures++;
+            break;
+        }
+    }
+    check_bound("random tree_find_nearest", tree, start);
+
+    start = tree->comparison_count;
+    for (i = 0; i < LOOKUPS; i++)
+        tree_find(tree, 1); /* a miss at the bottom of the tree */
+    check_bound("repeated tree_find misses", tree, start);
+    tree_free(tree, NULL);
+
+    /* Random inserts, removes and lookups against an array */
+    tree = tree_new();
+    for (i = 0; i < RANDOM_OPS && failures == 0; i++) {
+        long nearest;
+        key = random() % SPAN;
+        switch (random() % 4) {
+        case 0:
+            if (tree_insert(tree, key, record(key)) == present[key]) {
+                fprintf(stderr, "streetest: tree_insert(%ld) was wrong\n", key);
+                failures++;
+            }
+            present[key] = true;
+            break;
+        case 1:
+            if (tree_remove(tree, key) != (present[key] ? record(key) : NULL)) {
+                fprintf(stderr, "streetest: tree_remove(%ld) was wrong\n", key);
+                failures++;
+            }
+            present[key] = false;
+            break;
+        case 2:
+            if (tree_find(tree, key) != (present[key] ? record(key) : NULL)) {
+                fprintf(stderr, "streetest: tree_find(%ld) was wrong\n", key);
+                failures++;
+            }
+            break;
+        default:
+            for (nearest = key; nearest >= 0 && !present[nearest]; nearest--)
+                ;
+            if (tree_find_nearest(tree, key) !=
+                (nearest >= 0 ? record(nearest) : NULL)) {
+                fprintf(stderr, "streetest: tree_find_nearest(%ld) was wrong\n",
+                        key);
+                failures++;
+            }
+        }
+    }
+    tree_free(tree, NULL);
+
+    if (failures != 0) {
+        fprintf(stderr, "streetest: %d failures\n", failures);
+        return 1;
+    }
+    printf("streetest: splay tree answers and bounds hold\n");
+    return 0;
+}